@@ -0,0 +1,1169 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include "errors.h"
+#include "general.h"
+#include "bench2310.h"
+
+/* Options passed on to every server started (see set_server_options()),
+ * NULL terminated. */
+static char* serverOptions[MAX_SERVER_OPTIONS + 1] = {NULL};
+
+int main(int argc, char** argv) {
+    // Squash SIGPIPE to prevent issues arising from sudden termination of
+    // the servers under test
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = SIG_IGN; // Ignore the signal
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    // The system scenario is sized via options, the arrivals scenario via
+    // the (original) positional arguments
+    char* scenario = get_option(&argc, argv, "scenario");
+    char* replay = get_option(&argc, argv, "replay");
+    char* replayPort = get_option(&argc, argv, "port");
+    char* replaySpeed = get_option(&argc, argv, "speed");
+    char* acceptCpus = get_option(&argc, argv, "accept-cpus");
+    char* workerCpus = get_option(&argc, argv, "worker-cpus");
+    char* sizes[] = {get_option(&argc, argv, "controls"),
+	    get_option(&argc, argv, "rocs"),
+	    get_option(&argc, argv, "clients"),
+	    get_option(&argc, argv, "requests"),
+	    get_option(&argc, argv, "entries"),
+	    get_option(&argc, argv, "connections")};
+    int systemSize[] = {DEFAULT_NUM_CONTROLS, DEFAULT_NUM_ROC_PROCESSES,
+	    DEFAULT_NUM_CLIENTS, DEFAULT_NUM_REQUESTS, DEFAULT_SOAK_ENTRIES,
+	    DEFAULT_SOAK_CONNECTIONS};
+    bool validOptions = !unknown_options(&argc, argv) && (!scenario ||
+	    !strcmp(scenario, "arrivals") || !strcmp(scenario, "system") ||
+	    !strcmp(scenario, "soak") || !strcmp(scenario, "accept"));
+    for (int size = 0; size < sizeof(sizes) / sizeof(char*); size++) {
+	if (sizes[size] && !option_to_int(sizes[size], 1, MAX_BENCH_SIZE,
+		systemSize + size)) {
+	    validOptions = false;
+	}
+    }
+
+    int numRocs = (argc > NUM_ROCS_ARG) ? atoi(argv[NUM_ROCS_ARG]) :
+	    DEFAULT_NUM_ROCS;
+    int numFlights = (argc > NUM_FLIGHTS_ARG) ?
+	    atoi(argv[NUM_FLIGHTS_ARG]) : DEFAULT_NUM_FLIGHTS;
+    if (!validOptions || numRocs < 1 || numFlights < 1) {
+	fprintf(stderr, "Usage: bench2310 "
+		"[--scenario=arrivals|system|soak|accept] "
+		"[--controls=n] [--rocs=n] [--clients=n] [--requests=n] "
+		"[--entries=n] [--connections=n] [--accept-cpus=list] "
+		"[--worker-cpus=list] [rocs] [flights]\n"
+		"       bench2310 --replay=file --port=port "
+		"[--speed=n|max]\n");
+	return UNSPECIFIED_ERROR;
+    }
+
+    // A replay runs a capture against a running server instead of any
+    // scenario
+    if (replay || replayPort || replaySpeed) {
+	int speed = 1;
+	if (!replay || !replayPort || scenario || (replaySpeed &&
+		strcmp(replaySpeed, "max") && !option_to_int(replaySpeed, 1,
+		MAX_REPLAY_SPEED, &speed))) {
+	    fprintf(stderr, "Usage: bench2310 --replay=file --port=port "
+		    "[--speed=n|max]\n");
+	    return UNSPECIFIED_ERROR;
+	}
+	return bench_replay(replay, replayPort, (replaySpeed &&
+		!strcmp(replaySpeed, "max")) ? 0 : speed);
+    }
+
+    // The servers are pinned (and the pinning reported) as asked for
+    set_server_options(acceptCpus, workerCpus);
+    if (acceptCpus) {
+	printf("accept_cpus %s\n", acceptCpus);
+    }
+    if (workerCpus) {
+	printf("worker_cpus %s\n", workerCpus);
+    }
+    fflush(stdout); // lest the servers started inherit (and repeat) it
+
+    // Without a scenario, run both (the soak and accept scenarios only run
+    // when asked for)
+    int exitCode = 0;
+    if (!scenario || !strcmp(scenario, "arrivals")) {
+	exitCode = bench_arrivals(numRocs, numFlights);
+    }
+    if (!scenario || !strcmp(scenario, "system")) {
+	int systemExitCode = bench_system(systemSize[0], systemSize[1],
+		systemSize[2], systemSize[3]);
+	exitCode = (exitCode) ? exitCode : systemExitCode;
+    }
+    if (scenario && !strcmp(scenario, "accept")) {
+	exitCode = bench_accept(numRocs, numFlights);
+    }
+    if (scenario && !strcmp(scenario, "soak")) {
+	exitCode = bench_soak(systemSize[4], systemSize[5]);
+    }
+    return exitCode;
+}
+
+double now_in_microseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * MICROSECONDS + now.tv_nsec / 1000.0;
+}
+
+pid_t start_control(char* id, char* info, char* portOfControl) {
+    char* command[] = {CONTROL_PROGRAM, id, info, NULL};
+    return start_server(command, portOfControl);
+}
+
+void set_server_options(char* acceptCpus, char* workerCpus) {
+    char* options[] = {acceptCpus, workerCpus};
+    char* names[] = {"accept-cpus", "worker-cpus"};
+    int numOptions = 0;
+    for (int option = 0; option < MAX_SERVER_OPTIONS; option++) {
+	if (options[option]) {
+	    serverOptions[numOptions] = (char*)malloc(strlen(names[option]) +
+		    strlen(options[option]) + 4);
+	    sprintf(serverOptions[numOptions++], "--%s=%s", names[option],
+		    options[option]);
+	}
+    }
+    serverOptions[numOptions] = NULL;
+}
+
+pid_t start_server(char** command, char* portOfServer) {
+    int numArguments = 0;
+    while (command[numArguments]) {
+	numArguments++;
+    }
+    char** arguments = (char**)malloc((numArguments + MAX_SERVER_OPTIONS +
+	    1) * sizeof(char*));
+
+    // The options precede the positional arguments, as the controls expect
+    int numOptions = 0;
+    arguments[0] = command[0];
+    while (serverOptions[numOptions]) {
+	arguments[numOptions + 1] = serverOptions[numOptions];
+	numOptions++;
+    }
+    memcpy(arguments + numOptions + 1, command + 1,
+	    numArguments * sizeof(char*)); // including the NULL
+
+    int portPipe[2];
+    if (pipe(portPipe) == ERROR_RETURN) {
+	free(arguments);
+	return ERROR_RETURN;
+    }
+    pid_t server = fork();
+    if (server == ERROR_RETURN) {
+	free(arguments);
+	return ERROR_RETURN;
+    }
+    if (!server) {
+	// The server displays its port on stdout, send it down the pipe
+	dup2(portPipe[1], STDOUT_FILENO);
+	close(portPipe[0]);
+	close(portPipe[1]);
+	execv(arguments[0], arguments);
+	_exit(UNSPECIFIED_ERROR); // exec failed
+    }
+    free(arguments);
+    close(portPipe[1]);
+    FILE* portStream = fdopen(portPipe[0], "r");
+    size_t portLength = INITIAL_BUFFER_SIZE;
+    char* port = (char*)malloc(portLength * sizeof(char));
+    bool portFound = get_line(&port, &portLength, portStream) &&
+	    strlen(port) != 0 && strlen(port) < PORT_STRING_SIZE;
+    if (portFound) {
+	strcpy(portOfServer, port);
+    }
+    free(port);
+    fclose(portStream);
+    if (!portFound) {
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return ERROR_RETURN;
+    }
+    return server;
+}
+
+char* send_request(char* port, char* request, int* numLines) {
+    *numLines = 0;
+    int thisEnd;
+    if (setup_client(port, &thisEnd, false) != ROC_NORMAL) {
+	return NULL;
+    }
+    FILE* writeEnd = fdopen(thisEnd, "w");
+    FILE* readEnd = fdopen(dup(thisEnd), "r");
+    fputs(request, writeEnd);
+    fflush(writeEnd);
+
+    // Closing the writing side tells the server there are no more requests,
+    // hence it closes the connection once every reply is sent
+    shutdown(thisEnd, SHUT_WR);
+
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    char* lastLine = NULL;
+    while (get_line(&line, &lineLength, readEnd)) {
+	free(lastLine);
+	lastLine = strdup(line);
+	(*numLines)++;
+    }
+    free(line);
+    fclose(readEnd);
+    fclose(writeEnd);
+    return lastLine;
+}
+
+void* fly_roc(void* thisRoc) {
+    RocWorker* roc = (RocWorker*)thisRoc;
+    char planeId[INITIAL_BUFFER_SIZE];
+    snprintf(planeId, INITIAL_BUFFER_SIZE, "roc%d", roc->rocNumber);
+
+    size_t infoLength = INITIAL_BUFFER_SIZE;
+    char* info = (char*)malloc(infoLength * sizeof(char));
+
+    for (int flight = 0; flight < roc->numFlights; flight++) {
+	double start = now_in_microseconds();
+	int thisEnd;
+
+	// Behave exactly as roc2310 does for each destination
+	if (setup_client(roc->controlPort, &thisEnd, false) != ROC_NORMAL) {
+	    roc->failures++;
+	    roc->latencies[flight] = 0;
+	    continue;
+	}
+	FILE* writeEnd = fdopen(thisEnd, "w");
+	FILE* readEnd = fdopen(dup(thisEnd), "r");
+	fprintf(writeEnd, "%s\n", planeId);
+	fflush(writeEnd);
+	if (!get_line(&info, &infoLength, readEnd) || strlen(info) == 0) {
+	    roc->failures++;
+	}
+	fclose(readEnd);
+	fclose(writeEnd);
+	roc->latencies[flight] = now_in_microseconds() - start;
+    }
+    free(info);
+    return NULL;
+}
+
+bool request_log(char* controlPort, int* logSize) {
+    int thisEnd;
+    if (setup_client(controlPort, &thisEnd, false) != ROC_NORMAL) {
+	return false;
+    }
+    FILE* writeEnd = fdopen(thisEnd, "w");
+    FILE* readEnd = fdopen(dup(thisEnd), "r");
+    fprintf(writeEnd, "log\n");
+    fflush(writeEnd);
+
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    bool complete = false;
+    *logSize = 0;
+
+    // The log is terminated by a line containing a single '.'
+    while (get_line(&line, &lineLength, readEnd)) {
+	if (!strcmp(line, ".")) {
+	    complete = true;
+	    break;
+	}
+	(*logSize)++;
+    }
+    free(line);
+    fclose(readEnd);
+    fclose(writeEnd);
+    return complete;
+}
+
+void* request_logs(void* thisLogWorker) {
+    LogWorker* logWorker = (LogWorker*)thisLogWorker;
+    while (!*(logWorker->finished)) {
+	double start = now_in_microseconds();
+	if (!request_log(logWorker->controlPort,
+		&logWorker->lastLogSize)) {
+	    break;
+	}
+	if (logWorker->numRequests == logWorker->capacity) {
+	    logWorker->capacity *= RESIZING_FACTOR;
+	    logWorker->latencies = (double*)realloc(logWorker->latencies,
+		    logWorker->capacity * sizeof(double));
+	}
+	logWorker->latencies[logWorker->numRequests++] =
+		now_in_microseconds() - start;
+    }
+    return NULL;
+}
+
+bool timed_operation(Client* client, int request) {
+    BenchSystem* system = client->system;
+    char* mapperPort = system->mapperPort;
+    char* controlId = system->controlIds[request % system->numControls];
+    char* controlPort = system->controlPorts[(client->clientNumber +
+	    request) % system->numControls];
+    char message[INITIAL_BUFFER_SIZE * 2];
+    char* reply = NULL;
+    int numLines;
+    bool expected = false;
+
+    switch (client->operation) {
+	case QUERY:
+	    sprintf(message, "?%s\n", controlId);
+	    reply = send_request(mapperPort, message, &numLines);
+	    expected = reply && numLines == 1 && strcmp(reply, ";");
+	    break;
+	case REGISTER:
+	    // The mapper does not reply to '!', so confirm via '?'
+	    sprintf(message, "!bench%d_%d:%s\n?bench%d_%d\n",
+		    client->clientNumber, request, controlPort,
+		    client->clientNumber, request);
+	    reply = send_request(mapperPort, message, &numLines);
+	    expected = reply && numLines == 1 && !strcmp(reply, controlPort);
+	    break;
+	case LIST:
+	    reply = send_request(mapperPort, "@\n", &numLines);
+	    expected = numLines >= system->numControls;
+	    break;
+	case ARRIVE:
+	    sprintf(message, "client%d\n", client->clientNumber);
+	    reply = send_request(controlPort, message, &numLines);
+	    expected = reply && numLines == 1;
+	    break;
+	case LOG:
+	    reply = send_request(controlPort, "log\n", &numLines);
+	    expected = reply && !strcmp(reply, ".");
+	    break;
+	default:
+	    break;
+    }
+    free(reply);
+    return expected;
+}
+
+void* run_client(void* thisClient) {
+    Client* client = (Client*)thisClient;
+    for (int request = 0; request < client->numRequests; request++) {
+	double start = now_in_microseconds();
+	if (!timed_operation(client, request)) {
+	    client->failures++;
+	}
+	client->latencies[request] = now_in_microseconds() - start;
+    }
+    client->finished = now_in_microseconds();
+    return NULL;
+}
+
+void* fly_roc_fleet(void* thisFleet) {
+    RocFleet* fleet = (RocFleet*)thisFleet;
+    BenchSystem* system = fleet->system;
+    pid_t* rocs = (pid_t*)malloc(fleet->numRocs * sizeof(pid_t));
+    double* starts = (double*)malloc(fleet->numRocs * sizeof(double));
+
+    for (int roc = 0; roc < fleet->numRocs; roc++) {
+	starts[roc] = now_in_microseconds();
+	rocs[roc] = fork();
+	if (rocs[roc] == ERROR_RETURN) {
+	    fleet->failures++;
+	    fleet->latencies[roc] = 0;
+	    continue;
+	}
+	if (!rocs[roc]) {
+	    // Each roc visits consecutive controls (via their IDs), starting
+	    // from a different control to the previous roc
+	    char planeId[INITIAL_BUFFER_SIZE];
+	    sprintf(planeId, "fleet%d", roc);
+	    char* command[ROUTE_LENGTH + 4] = {ROC_PROGRAM, planeId,
+		    system->mapperPort};
+	    for (int stop = 0; stop < ROUTE_LENGTH; stop++) {
+		command[stop + 3] = system->controlIds[(roc + stop) %
+			system->numControls];
+	    }
+	    command[ROUTE_LENGTH + 3] = NULL;
+	    freopen("/dev/null", "w", stdout);
+	    execv(ROC_PROGRAM, command);
+	    _exit(UNSPECIFIED_ERROR); // exec failed
+	}
+    }
+
+    // Rocs exit in any order, match each to its start time
+    for (int exited = 0; exited < fleet->numRocs; exited++) {
+	int status;
+	pid_t roc = wait(&status);
+	if (roc == ERROR_RETURN) {
+	    break;
+	}
+	bool isRoc = false;
+	for (int thisRoc = 0; thisRoc < fleet->numRocs; thisRoc++) {
+	    if (rocs[thisRoc] == roc) {
+		fleet->latencies[thisRoc] = now_in_microseconds() -
+			starts[thisRoc];
+		isRoc = true;
+	    }
+	}
+	if (!isRoc) {
+	    exited--; // a server under test exited, it is not counted here
+	} else if (!WIFEXITED(status) ||
+		WEXITSTATUS(status) != ROC_NORMAL) {
+	    fleet->failures++;
+	}
+    }
+    fleet->finished = now_in_microseconds();
+    free(starts);
+    free(rocs);
+    return NULL;
+}
+
+bool start_system(BenchSystem* system, int numControls) {
+    char* mapperCommand[] = {MAPPER_PROGRAM, NULL};
+    system->numControls = 0;
+    system->controlIds = (char**)malloc(numControls * sizeof(char*));
+    system->controlPorts = malloc(numControls * PORT_STRING_SIZE);
+    system->controls = (pid_t*)malloc(numControls * sizeof(pid_t));
+    if ((system->mapper = start_server(mapperCommand, system->mapperPort)) ==
+	    ERROR_RETURN) {
+	fprintf(stderr, "Failed to start %s\n", MAPPER_PROGRAM);
+	return false;
+    }
+
+    // Each control registers itself with the mapper (register_with_mapper())
+    for (int control = 0; control < numControls; control++) {
+	char info[INITIAL_BUFFER_SIZE];
+	system->controlIds[control] =
+		(char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
+	sprintf(system->controlIds[control], "control%d", control);
+	sprintf(info, "info%d", control);
+	char* controlCommand[] = {CONTROL_PROGRAM,
+		system->controlIds[control], info, system->mapperPort, NULL};
+	system->controls[control] = start_server(controlCommand,
+		system->controlPorts[control]);
+	if (system->controls[control] == ERROR_RETURN) {
+	    fprintf(stderr, "Failed to start %s\n", CONTROL_PROGRAM);
+	    free(system->controlIds[control]);
+	    return false;
+	}
+	system->numControls++;
+    }
+
+    // Registration happens after the control displays its port, so wait
+    // until the mapper lists every control
+    for (int attempt = 0; attempt < REGISTRATION_ATTEMPTS; attempt++) {
+	int numListed;
+	free(send_request(system->mapperPort, "@\n", &numListed));
+	if (numListed == numControls) {
+	    return true;
+	}
+	usleep(MICROSECONDS / 10);
+    }
+    fprintf(stderr, "Controls failed to register with the mapper\n");
+    return false;
+}
+
+void stop_system(BenchSystem* system) {
+    for (int control = 0; control < system->numControls; control++) {
+	kill(system->controls[control], SIGTERM);
+	waitpid(system->controls[control], NULL, 0);
+	free(system->controlIds[control]);
+    }
+    if (system->mapper != ERROR_RETURN) {
+	kill(system->mapper, SIGTERM);
+	waitpid(system->mapper, NULL, 0);
+    }
+    free(system->controlIds);
+    free(system->controlPorts);
+    free(system->controls);
+}
+
+/* qsort() comparison function for latencies. */
+static int compare_latencies(const void* first, const void* second) {
+    double difference = *(const double*)first - *(const double*)second;
+    return (difference > 0) - (difference < 0);
+}
+
+void report_latencies(char* name, double* latencies, int numLatencies) {
+    if (numLatencies == 0) {
+	printf("%s_count 0\n", name);
+	return;
+    }
+    qsort(latencies, numLatencies, sizeof(double), compare_latencies);
+    printf("%s_count %d\n", name, numLatencies);
+    printf("%s_p50_us %.1f\n", name, latencies[numLatencies / 2]);
+    printf("%s_p99_us %.1f\n", name,
+	    latencies[(int)(numLatencies * 0.99)]);
+    printf("%s_p999_us %.1f\n", name,
+	    latencies[(int)(numLatencies * 0.999)]);
+    printf("%s_max_us %.1f\n", name, latencies[numLatencies - 1]);
+}
+
+void report_operation(char* name, double* latencies, int numLatencies,
+	double elapsed) {
+    printf("%s_per_s %.1f\n", name,
+	    (elapsed > 0) ? numLatencies / (elapsed / MICROSECONDS) : 0);
+    report_latencies(name, latencies, numLatencies);
+}
+
+int bench_arrivals(int numRocs, int numFlights) {
+    char controlPort[PORT_STRING_SIZE];
+    pid_t control = start_control("bench", "benchinfo", controlPort);
+    if (control == ERROR_RETURN) {
+	fprintf(stderr, "Failed to start %s\n", CONTROL_PROGRAM);
+	return UNSPECIFIED_ERROR;
+    }
+
+    RocWorker* rocs = (RocWorker*)calloc(numRocs, sizeof(RocWorker));
+    pthread_t* rocThreads = (pthread_t*)malloc(numRocs * sizeof(pthread_t));
+    volatile bool finished = false;
+    LogWorker logWorker = {controlPort, &finished,
+	    (double*)malloc(INITIAL_BUFFER_SIZE * sizeof(double)), 0,
+	    INITIAL_BUFFER_SIZE, 0};
+    pthread_t logThread;
+
+    double start = now_in_microseconds();
+    pthread_create(&logThread, NULL, request_logs, &logWorker);
+    for (int roc = 0; roc < numRocs; roc++) {
+	rocs[roc].controlPort = controlPort;
+	rocs[roc].rocNumber = roc;
+	rocs[roc].numFlights = numFlights;
+	rocs[roc].latencies = (double*)malloc(numFlights * sizeof(double));
+	pthread_create(rocThreads + roc, NULL, fly_roc, rocs + roc);
+    }
+
+    // Gather every arrival latency into one array for the summary
+    double* arrivals = (double*)malloc(numRocs * numFlights * sizeof(double));
+    int failures = 0;
+    for (int roc = 0; roc < numRocs; roc++) {
+	pthread_join(rocThreads[roc], NULL);
+	memcpy(arrivals + roc * numFlights, rocs[roc].latencies,
+		numFlights * sizeof(double));
+	failures += rocs[roc].failures;
+	free(rocs[roc].latencies);
+    }
+    double elapsed = now_in_microseconds() - start;
+    finished = true;
+    pthread_join(logThread, NULL);
+
+    // Every acknowledged arrival must be visible in a subsequent log
+    int finalLogSize = 0;
+    request_log(controlPort, &finalLogSize);
+
+    printf("scenario arrivals\n");
+    printf("rocs %d\n", numRocs);
+    printf("flights %d\n", numRocs * numFlights);
+    printf("failures %d\n", failures);
+    printf("elapsed_s %.3f\n", elapsed / MICROSECONDS);
+    printf("arrivals_per_s %.1f\n",
+	    numRocs * numFlights / (elapsed / MICROSECONDS));
+    report_latencies("arrival", arrivals, numRocs * numFlights);
+    report_latencies("log", logWorker.latencies, logWorker.numRequests);
+    printf("final_log_size %d\n", finalLogSize);
+    fflush(stdout);
+
+    kill(control, SIGTERM);
+    waitpid(control, NULL, 0);
+    free(arrivals);
+    free(logWorker.latencies);
+    free(rocThreads);
+    free(rocs);
+    return (failures || finalLogSize != numRocs * numFlights) ?
+	    UNSPECIFIED_ERROR : 0;
+}
+
+int bench_accept(int numRocs, int numFlights) {
+    int listenerCounts[] = ACCEPT_LISTENER_COUNTS;
+    int numCounts = sizeof(listenerCounts) / sizeof(int);
+    RocWorker* rocs = (RocWorker*)calloc(numRocs, sizeof(RocWorker));
+    pthread_t* rocThreads = (pthread_t*)malloc(numRocs * sizeof(pthread_t));
+    double* arrivals = (double*)malloc(numRocs * numFlights * sizeof(double));
+    int failures = 0;
+
+    printf("scenario accept\n");
+    printf("rocs %d\n", numRocs);
+    printf("connections %d\n", numRocs * numFlights);
+    for (int count = 0; count < numCounts; count++) {
+	char listenersOption[INITIAL_BUFFER_SIZE];
+	char controlPort[PORT_STRING_SIZE];
+	sprintf(listenersOption, "--listeners=%d", listenerCounts[count]);
+	char* command[] = {CONTROL_PROGRAM, listenersOption, "bench",
+		"benchinfo", NULL};
+	pid_t control = start_server(command, controlPort);
+	if (control == ERROR_RETURN) {
+	    fprintf(stderr, "Failed to start %s\n", CONTROL_PROGRAM);
+	    failures++;
+	    break;
+	}
+
+	// Each flight is a connection of its own, hence the rocs measure
+	// how quickly the listeners accept (and serve) connections
+	double start = now_in_microseconds();
+	for (int roc = 0; roc < numRocs; roc++) {
+	    rocs[roc].controlPort = controlPort;
+	    rocs[roc].rocNumber = roc;
+	    rocs[roc].numFlights = numFlights;
+	    rocs[roc].failures = 0;
+	    rocs[roc].latencies = arrivals + roc * numFlights;
+	    pthread_create(rocThreads + roc, NULL, fly_roc, rocs + roc);
+	}
+	int countFailures = 0;
+	for (int roc = 0; roc < numRocs; roc++) {
+	    pthread_join(rocThreads[roc], NULL);
+	    countFailures += rocs[roc].failures;
+	}
+	double elapsed = now_in_microseconds() - start;
+	kill(control, SIGTERM);
+	waitpid(control, NULL, 0);
+
+	char name[INITIAL_BUFFER_SIZE];
+	sprintf(name, "listeners_%d", listenerCounts[count]);
+	printf("%s_connections_per_s %.1f\n", name,
+		numRocs * numFlights / (elapsed / MICROSECONDS));
+	report_latencies(name, arrivals, numRocs * numFlights);
+	printf("%s_failures %d\n", name, countFailures);
+	fflush(stdout);
+	failures += countFailures;
+    }
+    free(arrivals);
+    free(rocThreads);
+    free(rocs);
+    return (failures) ? UNSPECIFIED_ERROR : 0;
+}
+
+int bench_system(int numControls, int numRocs, int numClients,
+	int numRequests) {
+    BenchSystem system;
+    if (!start_system(&system, numControls)) {
+	stop_system(&system);
+	return UNSPECIFIED_ERROR;
+    }
+    char* operationNames[] = {"query", "register", "list", "arrival", "log"};
+    int numClientThreads = NUM_OPERATIONS * numClients;
+    Client* clients = (Client*)calloc(numClientThreads, sizeof(Client));
+    pthread_t* clientThreads =
+	    (pthread_t*)malloc(numClientThreads * sizeof(pthread_t));
+    RocFleet fleet = {&system, numRocs,
+	    (double*)calloc(numRocs, sizeof(double)), 0, 0};
+    pthread_t fleetThread;
+
+    // Every kind of request (and the rocs) run at once, as a mixed load
+    double start = now_in_microseconds();
+    pthread_create(&fleetThread, NULL, fly_roc_fleet, &fleet);
+    for (int client = 0; client < numClientThreads; client++) {
+	clients[client].system = &system;
+	clients[client].operation = client % NUM_OPERATIONS;
+	clients[client].clientNumber = client;
+	clients[client].numRequests = numRequests;
+	clients[client].latencies =
+		(double*)malloc(numRequests * sizeof(double));
+	pthread_create(clientThreads + client, NULL, run_client,
+		clients + client);
+    }
+    for (int client = 0; client < numClientThreads; client++) {
+	pthread_join(clientThreads[client], NULL);
+    }
+    pthread_join(fleetThread, NULL);
+    double elapsed = now_in_microseconds() - start;
+
+    printf("scenario system\n");
+    printf("controls %d\n", numControls);
+    printf("rocs %d\n", numRocs);
+    printf("clients %d\n", numClientThreads);
+    printf("elapsed_s %.3f\n", elapsed / MICROSECONDS);
+
+    // Gather the latencies of each kind of request for the summary
+    int failures = fleet.failures;
+    int arrivals = 0;
+    double* latencies =
+	    (double*)malloc(numClients * numRequests * sizeof(double));
+    for (int operation = 0; operation < NUM_OPERATIONS; operation++) {
+	double finished = start;
+	int operationFailures = 0;
+	for (int client = operation; client < numClientThreads;
+		client += NUM_OPERATIONS) {
+	    memcpy(latencies + (client / NUM_OPERATIONS) * numRequests,
+		    clients[client].latencies, numRequests * sizeof(double));
+	    finished = (clients[client].finished > finished) ?
+		    clients[client].finished : finished;
+	    operationFailures += clients[client].failures;
+	    free(clients[client].latencies);
+	}
+	report_operation(operationNames[operation], latencies,
+		numClients * numRequests, finished - start);
+	printf("%s_failures %d\n", operationNames[operation],
+		operationFailures);
+	failures += operationFailures;
+	if (operation == ARRIVE) {
+	    arrivals = numClients * numRequests - operationFailures;
+	}
+    }
+    report_operation("flight", fleet.latencies, numRocs,
+	    fleet.finished - start);
+    printf("flight_failures %d\n", fleet.failures);
+
+    // Every arrival (from the clients and the rocs) must be logged
+    int logged = 0;
+    for (int control = 0; control < numControls; control++) {
+	int logSize;
+	request_log(system.controlPorts[control], &logSize);
+	logged += logSize;
+    }
+    arrivals += (numRocs - fleet.failures) * ROUTE_LENGTH;
+    printf("failures %d\n", failures);
+    printf("logged_arrivals %d\n", logged);
+    fflush(stdout);
+
+    stop_system(&system);
+    free(latencies);
+    free(fleet.latencies);
+    free(clientThreads);
+    free(clients);
+    return (failures || logged != arrivals) ? UNSPECIFIED_ERROR : 0;
+}
+
+bool request_memory(char* port, char* command, MemoryReport* report) {
+    int thisEnd;
+    if (setup_client(port, &thisEnd, false) != ROC_NORMAL) {
+	return false;
+    }
+    FILE* writeEnd;
+    FILE* readEnd;
+    if (!open_streams(thisEnd, &writeEnd, &readEnd)) {
+	return false;
+    }
+    fprintf(writeEnd, "%s\n", command);
+    fflush(writeEnd);
+
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    bool complete = false;
+    report->numFields = 0;
+
+    // Each line is name:bytes (followed by :peak for the categories), and
+    // the reply is terminated by a line containing a single '.'
+    while (get_line(&line, &lineLength, readEnd)) {
+	if (!strcmp(line, ".")) {
+	    complete = true;
+	    break;
+	}
+	char* separator = strchr(line, ':');
+	if (!separator || separator - line >= INITIAL_BUFFER_SIZE ||
+		report->numFields == MAX_MEMORY_CATEGORIES + 2) {
+	    break;
+	}
+	*separator = '\0';
+	strcpy(report->names[report->numFields], line);
+	report->bytes[report->numFields++] = strtoul(separator + 1, NULL, 10);
+    }
+    free(line);
+    fclose(readEnd);
+    fclose(writeEnd);
+    return complete;
+}
+
+bool add_soak_entries(char* mapperPort, char* controlPort, int first,
+	int last) {
+    bool accepted = true;
+    for (int batch = first; batch < last && accepted;
+	    batch += SOAK_BATCH_SIZE) {
+	int batchSize = (last - batch < SOAK_BATCH_SIZE) ? last - batch :
+		SOAK_BATCH_SIZE;
+	char* registrations = NULL;
+	char* arrivals = NULL;
+	size_t registrationsSize, arrivalsSize;
+	FILE* toMapper = open_memstream(&registrations, &registrationsSize);
+	FILE* toControl = open_memstream(&arrivals, &arrivalsSize);
+	fprintf(toMapper, "*%d\n", batchSize);
+	for (int entry = batch; entry < batch + batchSize; entry++) {
+	    fprintf(toMapper, "soak%d:%s\n", entry, controlPort);
+	    fprintf(toControl, "soak%d\n", entry);
+	}
+	fclose(toMapper);
+	fclose(toControl);
+
+	// A bulk registration replies with the number added, and each
+	// arrival with the info of the control
+	int numLines;
+	char* reply = send_request(mapperPort, registrations, &numLines);
+	accepted = reply && atoi(reply) == batchSize;
+	free(reply);
+	reply = send_request(controlPort, arrivals, &numLines);
+	accepted = accepted && reply && numLines == batchSize;
+	free(reply);
+	free(registrations);
+	free(arrivals);
+    }
+    return accepted;
+}
+
+int bench_soak(int numEntries, int numConnections) {
+    char mapperPort[PORT_STRING_SIZE];
+    char controlPort[PORT_STRING_SIZE];
+    char* mapperCommand[] = {MAPPER_PROGRAM, NULL};
+    pid_t mapper = start_server(mapperCommand, mapperPort);
+    pid_t control = start_control("SOAK", "soak", controlPort);
+    if (mapper == ERROR_RETURN || control == ERROR_RETURN) {
+	fprintf(stderr, "Failed to start the servers under test\n");
+	if (mapper != ERROR_RETURN) {
+	    kill(mapper, SIGTERM);
+	    waitpid(mapper, NULL, 0);
+	}
+	if (control != ERROR_RETURN) {
+	    kill(control, SIGTERM);
+	    waitpid(control, NULL, 0);
+	}
+	return UNSPECIFIED_ERROR;
+    }
+    printf("scenario soak\n");
+    printf("entries %d\n", numEntries);
+    printf("connections %d\n", numConnections);
+
+    // The idle connections are only closed once every step is measured
+    int* idle = (int*)malloc(2 * numConnections * sizeof(int));
+    int numIdle = 0;
+    int failures = 0;
+    for (int step = 1; step <= SOAK_STEPS; step++) {
+	int entries = (long)numEntries * step / SOAK_STEPS;
+	int connections = (long)numConnections * step / SOAK_STEPS;
+	if (!add_soak_entries(mapperPort, controlPort,
+		(long)numEntries * (step - 1) / SOAK_STEPS, entries)) {
+	    failures++;
+	}
+	while (numIdle < 2 * connections) {
+	    if (setup_client((numIdle % 2) ? controlPort : mapperPort,
+		    idle + numIdle, false) != ROC_NORMAL) {
+		failures++;
+		break;
+	    }
+	    numIdle++;
+	}
+
+	// The log moves the arrivals into the control's plane IDs
+	int logSize;
+	if (!request_log(controlPort, &logSize) || logSize != entries) {
+	    failures++;
+	}
+	MemoryReport mapperMemory, controlMemory;
+	if (!request_memory(mapperPort, "memory", &mapperMemory) ||
+		!request_memory(controlPort, CONTROL_COMMAND_PREFIX "memory",
+		&controlMemory)) {
+	    failures++;
+	    break;
+	}
+
+	// One row per step (after a header naming the columns), to be
+	// plotted against the entries and connections
+	if (step == 1) {
+	    printf("soak entries connections");
+	    for (int field = 0; field < mapperMemory.numFields; field++) {
+		printf(" mapper_%s", mapperMemory.names[field]);
+	    }
+	    for (int field = 0; field < controlMemory.numFields; field++) {
+		printf(" control_%s", controlMemory.names[field]);
+	    }
+	    printf("\n");
+	}
+	printf("soak %d %d", entries, numIdle / 2);
+	for (int field = 0; field < mapperMemory.numFields; field++) {
+	    printf(" %lu", mapperMemory.bytes[field]);
+	}
+	for (int field = 0; field < controlMemory.numFields; field++) {
+	    printf(" %lu", controlMemory.bytes[field]);
+	}
+	printf("\n");
+	fflush(stdout);
+    }
+    printf("failures %d\n", failures);
+    fflush(stdout);
+
+    for (int connection = 0; connection < numIdle; connection++) {
+	close(idle[connection]);
+    }
+    free(idle);
+    kill(mapper, SIGTERM);
+    kill(control, SIGTERM);
+    waitpid(mapper, NULL, 0);
+    waitpid(control, NULL, 0);
+    return (failures) ? UNSPECIFIED_ERROR : 0;
+}
+
+ReplayConnection* load_capture(char* path, char* serverType,
+	int* numConnections) {
+    FILE* capture = fopen(path, "r");
+    if (!capture) {
+	return NULL;
+    }
+    CaptureHeader header;
+    if (fread(&header, sizeof(CaptureHeader), 1, capture) != 1 ||
+	    memcmp(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) ||
+	    (header.serverType != MAPPER_CAPTURE &&
+	    header.serverType != CONTROL_CAPTURE)) {
+	fclose(capture);
+	return NULL;
+    }
+    *serverType = header.serverType;
+
+    // Connections are numbered from 1 in order of acceptance, hence
+    // connection n is stored at n - 1
+    *numConnections = 0;
+    ReplayConnection* connections = NULL;
+    CaptureRecord record;
+    double firstOffset = -1;
+    bool valid = true;
+    while (valid && fread(&record, sizeof(CaptureRecord), 1, capture) == 1) {
+	if (record.connection == 0) {
+	    valid = false;
+	    break;
+	}
+	if (record.connection > *numConnections) {
+	    connections = (ReplayConnection*)realloc(connections,
+		    record.connection * sizeof(ReplayConnection));
+	    memset(connections + *numConnections, 0, (record.connection -
+		    *numConnections) * sizeof(ReplayConnection));
+	    *numConnections = record.connection;
+	}
+	ReplayConnection* connection = connections + record.connection - 1;
+	if (connection->numCommands == connection->capacity) {
+	    connection->capacity = (connection->capacity) ?
+		    connection->capacity * 2 : INITIAL_BUFFER_SIZE;
+	    connection->commands = (ReplayCommand*)realloc(
+		    connection->commands,
+		    connection->capacity * sizeof(ReplayCommand));
+	}
+
+	// Offsets are kept relative to the first command, such that the
+	// replay begins immediately
+	if (firstOffset < 0) {
+	    firstOffset = record.offset / 1000.0;
+	}
+	ReplayCommand* command = connection->commands +
+		connection->numCommands++;
+	command->offset = record.offset / 1000.0 - firstOffset;
+	command->command = NULL;
+	if (record.length != CAPTURE_CLOSED) {
+	    command->command = (char*)malloc(record.length + 1);
+	    valid = fread(command->command, sizeof(char), record.length,
+		    capture) == record.length;
+	    command->command[record.length] = '\0';
+	}
+    }
+    fclose(capture);
+    if (!valid) {
+	fprintf(stderr, "Capture is truncated or corrupt\n");
+    }
+    return (connections) ? connections :
+	    (ReplayConnection*)calloc(1, sizeof(ReplayConnection));
+}
+
+ReplayKind replay_kind(char serverType, char* command) {
+    if (serverType == CONTROL_CAPTURE) {
+	if (!strcmp(command, "log")) {
+	    return REPLAY_LOG;
+	}
+	return (is_control_command(command)) ? REPLAY_OTHER : REPLAY_ARRIVAL;
+    }
+    switch (command[0]) {
+	case '?':
+	    return REPLAY_QUERY;
+	case '!':
+	case '~':
+	case '*':
+	    return REPLAY_REGISTER;
+	case '@':
+	case '^':
+	case '[':
+	    return REPLAY_LIST;
+    }
+    return REPLAY_OTHER;
+}
+
+bool replay_command(char serverType, char* command, FILE* writeEnd,
+	FILE* readEnd) {
+    // Admin replies (and the log, top K and deltas) end with a "." line
+    bool dotTerminated = (serverType == CONTROL_CAPTURE) ?
+	    !strcmp(command, "log") ||
+	    !strcmp(command, CONTROL_COMMAND_PREFIX "stats") ||
+	    !strcmp(command, CONTROL_COMMAND_PREFIX "lockprof") ||
+	    !strcmp(command, CONTROL_COMMAND_PREFIX "memory") ||
+	    !strncmp(command, CONTROL_COMMAND_PREFIX "top ",
+	    strlen(CONTROL_COMMAND_PREFIX "top ")) :
+	    !strcmp(command, "stats") || !strcmp(command, "lockprof") ||
+	    !strcmp(command, "memory") || !strcmp(command, "lag") ||
+	    (command[0] == '@' && isdigit(command[1]));
+
+    // Valid queries, bulk registrations (captured with their entries) and
+    // arrivals are replied to with exactly one line. The
+    // remaining mapper commands (registrations, listings, invalid commands)
+    // reply with any number of ID:port lines (or nothing), hence the
+    // barrier: its reply is the first line without a ':'
+    bool oneLine = (serverType == CONTROL_CAPTURE) ? true :
+	    (command[0] == '*' || (command[0] == '?' && strlen(command) > 1 &&
+	    !check_invalid_chars(command + 1)));
+    // Both are sent at once, lest the barrier wait on the delayed ACK
+    fprintf(writeEnd, "%s\n", command);
+    if (!dotTerminated && !oneLine) {
+	fprintf(writeEnd, "%s\n", REPLAY_BARRIER);
+    }
+    fflush(writeEnd);
+
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    bool complete = false;
+    while (get_line(&line, &lineLength, readEnd)) {
+	if (dotTerminated ? !strcmp(line, ".") :
+		(oneLine || !strchr(line, ':'))) {
+	    complete = true;
+	    break;
+	}
+    }
+    free(line);
+    return complete;
+}
+
+void* replay_connection(void* thisConnection) {
+    ReplayConnection* connection = (ReplayConnection*)thisConnection;
+    connection->latencies =
+	    (double*)malloc(connection->numCommands * sizeof(double));
+    connection->kinds =
+	    (ReplayKind*)malloc(connection->numCommands * sizeof(ReplayKind));
+
+    // Connect when the first command is due, as the client did
+    int thisEnd;
+    FILE* writeEnd = NULL;
+    FILE* readEnd = NULL;
+    for (int index = 0; index < connection->numCommands; index++) {
+	ReplayCommand* command = connection->commands + index;
+	if (connection->speed > 0) {
+	    double due = connection->start + command->offset /
+		    connection->speed;
+	    double now = now_in_microseconds();
+	    if (due > now) {
+		usleep(due - now);
+	    }
+	}
+	if (!command->command) {
+	    break; // the client closed the connection
+	}
+	// Followers (and subscribers) stream mutations indefinitely, which
+	// cannot be replayed
+	if (connection->serverType == MAPPER_CAPTURE &&
+		(command->command[0] == '>' ||
+		!strcmp(command->command, "subscribe"))) {
+	    continue;
+	}
+	if (!writeEnd) {
+	    if (setup_client(connection->port, &thisEnd, false) !=
+		    ROC_NORMAL) {
+		connection->failures += connection->numCommands - index;
+		break;
+	    }
+	    writeEnd = fdopen(thisEnd, "w");
+	    readEnd = fdopen(dup(thisEnd), "r");
+	}
+
+	double sent = now_in_microseconds();
+	if (!replay_command(connection->serverType, command->command,
+		writeEnd, readEnd)) {
+	    connection->failures++;
+	    break; // the server closed the connection
+	}
+	connection->latencies[connection->numReplayed] =
+		now_in_microseconds() - sent;
+	connection->kinds[connection->numReplayed++] =
+		replay_kind(connection->serverType, command->command);
+    }
+    if (writeEnd) {
+	fclose(readEnd);
+	fclose(writeEnd);
+    }
+    return NULL;
+}
+
+int bench_replay(char* path, char* port, double speed) {
+    char serverType;
+    int numConnections;
+    ReplayConnection* connections = load_capture(path, &serverType,
+	    &numConnections);
+    if (!connections) {
+	fprintf(stderr, "Invalid capture %s\n", path);
+	return UNSPECIFIED_ERROR;
+    }
+    pthread_t* threads =
+	    (pthread_t*)malloc((numConnections + 1) * sizeof(pthread_t));
+
+    double start = now_in_microseconds();
+    int numCommands = 0;
+    for (int connection = 0; connection < numConnections; connection++) {
+	connections[connection].port = port;
+	connections[connection].serverType = serverType;
+	connections[connection].speed = speed;
+	connections[connection].start = start;
+	numCommands += connections[connection].numCommands;
+	pthread_create(threads + connection, NULL, replay_connection,
+		connections + connection);
+    }
+
+    // Gather the latencies of each kind of command for the summary
+    double* latencies[NUM_REPLAY_KINDS];
+    int numLatencies[NUM_REPLAY_KINDS] = {0};
+    for (int kind = 0; kind < NUM_REPLAY_KINDS; kind++) {
+	latencies[kind] = (double*)malloc((numCommands + 1) * sizeof(double));
+    }
+    int replayed = 0;
+    int failures = 0;
+    for (int connection = 0; connection < numConnections; connection++) {
+	ReplayConnection* thisConnection = connections + connection;
+	pthread_join(threads[connection], NULL);
+	for (int index = 0; index < thisConnection->numReplayed; index++) {
+	    ReplayKind kind = thisConnection->kinds[index];
+	    latencies[kind][numLatencies[kind]++] =
+		    thisConnection->latencies[index];
+	}
+	replayed += thisConnection->numReplayed;
+	failures += thisConnection->failures;
+    }
+    double elapsed = now_in_microseconds() - start;
+
+    char* kindNames[] = {"query", "register", "list", "arrival", "log",
+	    "other"};
+    printf("scenario replay\n");
+    printf("server %s\n", (serverType == MAPPER_CAPTURE) ? "mapper" :
+	    "control");
+    if (speed > 0) {
+	printf("speed %.0f\n", speed);
+    } else {
+	printf("speed max\n");
+    }
+    printf("connections %d\n", numConnections);
+    printf("commands %d\n", replayed);
+    printf("failures %d\n", failures);
+    printf("elapsed_s %.3f\n", elapsed / MICROSECONDS);
+    printf("commands_per_s %.1f\n", replayed / (elapsed / MICROSECONDS));
+    for (int kind = 0; kind < NUM_REPLAY_KINDS; kind++) {
+	report_operation(kindNames[kind], latencies[kind], numLatencies[kind],
+		elapsed);
+	free(latencies[kind]);
+    }
+    fflush(stdout);
+
+    for (int connection = 0; connection < numConnections; connection++) {
+	for (int index = 0; index < connections[connection].numCommands;
+		index++) {
+	    free(connections[connection].commands[index].command);
+	}
+	free(connections[connection].commands);
+	free(connections[connection].latencies);
+	free(connections[connection].kinds);
+    }
+    free(connections);
+    free(threads);
+    return failures ? UNSPECIFIED_ERROR : 0;
+}
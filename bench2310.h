@@ -0,0 +1,332 @@
+#ifndef BENCH_2310_H
+#define BENCH_2310_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "errors.h"
+#include "general.h"
+
+/* Number of simulated rocs flying to the control at once, unless given on
+ * the command line. */
+#define DEFAULT_NUM_ROCS 32
+
+/* Number of arrivals each simulated roc makes, unless given on the command
+ * line. */
+#define DEFAULT_NUM_FLIGHTS 200
+
+/* Used to index argv for the number of rocs. */
+#define NUM_ROCS_ARG 1
+
+/* Used to index argv for the number of flights per roc. */
+#define NUM_FLIGHTS_ARG 2
+
+/* Paths of the programs started by the benchmark. */
+#define CONTROL_PROGRAM "./control2310"
+#define MAPPER_PROGRAM "./mapper2310"
+#define ROC_PROGRAM "./roc2310"
+
+/* Number of controls registered with the mapper in the system scenario,
+ * unless given via --controls. */
+#define DEFAULT_NUM_CONTROLS 8
+
+/* Number of roc2310 processes flown in the system scenario, unless given via
+ * --rocs. */
+#define DEFAULT_NUM_ROC_PROCESSES 32
+
+/* Number of concurrent clients issuing each kind of request in the system
+ * scenario, unless given via --clients. */
+#define DEFAULT_NUM_CLIENTS 4
+
+/* Number of requests made by each client in the system scenario, unless
+ * given via --requests. */
+#define DEFAULT_NUM_REQUESTS 250
+
+/* Number of controls each roc2310 process visits. */
+#define ROUTE_LENGTH 4
+
+/* Upper bound of the sizes given on the command line. */
+#define MAX_BENCH_SIZE 100000
+
+/* Number of entries registered with the mapper (and arrivals at the
+ * control) by the end of the soak scenario, unless given via --entries. */
+#define DEFAULT_SOAK_ENTRIES 20000
+
+/* Number of idle connections held open to each server by the end of the
+ * soak scenario, unless given via --connections. */
+#define DEFAULT_SOAK_CONNECTIONS 200
+
+/* Number of steps the soak scenario grows the servers in, measuring their
+ * footprint after each. */
+#define SOAK_STEPS 10
+
+/* Most registrations (or arrivals) sent per request in the soak scenario,
+ * such that the replies never fill the connection before it is read. */
+#define SOAK_BATCH_SIZE 1000
+
+/* Most options (--accept-cpus and --worker-cpus) passed on to every server
+ * started (see start_server()). */
+#define MAX_SERVER_OPTIONS 2
+
+/* Numbers of listeners (--listeners) of the controls compared by the accept
+ * scenario. */
+#define ACCEPT_LISTENER_COUNTS {1, 2, 4, 8}
+
+/* Number of attempts (a tenth of a second apart) made whilst waiting for the
+ * controls to register with the mapper. */
+#define REGISTRATION_ATTEMPTS 50
+
+/* Number of microseconds in a second. */
+#define MICROSECONDS 1000000.0
+
+/* Upper bound of the --speed multiplier of a replay. */
+#define MAX_REPLAY_SPEED 1000
+
+/* ID queried after a replayed mapper command which has no reply of its own,
+ * such that the end of its reply is known (see replay_command()). */
+#define REPLAY_BARRIER "?replay-barrier"
+
+/* A simulated roc repeatedly arriving at the control under test */
+typedef struct {
+    char* controlPort;
+    int rocNumber;
+    int numFlights;
+    double* latencies; // one entry (in microseconds) per flight
+    int failures;
+} RocWorker;
+
+/* Kinds of request timed by the system scenario */
+typedef enum {
+    QUERY = 0, // ?ID to the mapper
+    REGISTER = 1, // !ID:port to the mapper, confirmed by ?ID
+    LIST = 2, // @ to the mapper
+    ARRIVE = 3, // plane ID to a control
+    LOG = 4, // log to a control
+    NUM_OPERATIONS = 5
+} Operation;
+
+/* The mapper and controls under test in the system scenario */
+typedef struct {
+    char mapperPort[PORT_STRING_SIZE];
+    pid_t mapper;
+    char** controlIds;
+    char (*controlPorts)[PORT_STRING_SIZE];
+    pid_t* controls;
+    int numControls;
+} BenchSystem;
+
+/* A client repeatedly making one kind of request to the system under test */
+typedef struct {
+    BenchSystem* system;
+    Operation operation;
+    int clientNumber;
+    int numRequests;
+    double* latencies; // one entry (in microseconds) per request
+    int failures;
+    double finished; // time (in microseconds) the last request completed
+} Client;
+
+/* The real roc2310 processes flown through the system under test */
+typedef struct {
+    BenchSystem* system;
+    int numRocs;
+    double* latencies; // one entry (in microseconds) per process
+    int failures;
+    double finished;
+} RocFleet;
+
+/* Kinds of replayed command, by which the latencies are reported */
+typedef enum {
+    REPLAY_QUERY = 0, // ?ID to the mapper
+    REPLAY_REGISTER = 1, // !ID:port or ~ID:port to the mapper
+    REPLAY_LIST = 2, // @, @local, ^prefix or [low:high to the mapper
+    REPLAY_ARRIVAL = 3, // plane ID to a control
+    REPLAY_LOG = 4, // log to a control
+    REPLAY_OTHER = 5, // admin commands and invalid commands
+    NUM_REPLAY_KINDS = 6
+} ReplayKind;
+
+/* A captured command, as replayed */
+typedef struct {
+    double offset; // microseconds since the first captured command
+    char* command; // NULL if the client closed the connection here
+} ReplayCommand;
+
+/* A captured connection, replayed by its own thread */
+typedef struct {
+    char* port;
+    char serverType; // MAPPER_CAPTURE or CONTROL_CAPTURE
+    double speed; // 0 to replay as fast as possible
+    double start; // time (in microseconds) the replay began
+    ReplayCommand* commands;
+    int numCommands;
+    int capacity;
+    double* latencies; // one entry (in microseconds) per command
+    ReplayKind* kinds; // one entry per command
+    int numReplayed;
+    int failures;
+} ReplayConnection;
+
+/* A client repeatedly requesting the log while the rocs arrive */
+typedef struct {
+    char* controlPort;
+    volatile bool* finished;
+    double* latencies;
+    int numRequests;
+    int capacity;
+    int lastLogSize;
+} LogWorker;
+
+/* The reply to a memory command, one field per line (see display_memory()) */
+typedef struct {
+    char names[MAX_MEMORY_CATEGORIES + 2][INITIAL_BUFFER_SIZE];
+    unsigned long bytes[MAX_MEMORY_CATEGORIES + 2]; // current, not peak
+    int numFields;
+} MemoryReport;
+
+/* Returns the current (monotonic) time in microseconds. */
+double now_in_microseconds(void);
+
+/* Takes in the program and its arguments (NULL terminated), and an empty
+ * space to store the port of the started server. Starts said server (with
+ * the options of set_server_options() first), which displays its port on
+ * stdout, and returns its process ID (or ERROR_RETURN should the server fail
+ * to start). */
+pid_t start_server(char** command, char* portOfServer);
+
+/* Takes in the CPUs of the servers' accepting threads and worker threads
+ * (either NULL to leave them unpinned). Passes said CPUs on to every server
+ * started from now on (as --accept-cpus and --worker-cpus). */
+void set_server_options(char* acceptCpus, char* workerCpus);
+
+/* Takes in the airport ID and info, and an empty space to store the port of
+ * the started control. Starts a control2310 process and returns its process
+ * ID (or ERROR_RETURN should the control fail to start). */
+pid_t start_control(char* id, char* info, char* portOfControl);
+
+/* Takes in the port of a server, the request to send and an empty space to
+ * store the number of lines replied. Sends said request, closes the writing
+ * side and reads every line until the server closes the connection. Returns
+ * the last line replied (NULL if the connection failed or there was no
+ * reply), which must be freed. */
+char* send_request(char* port, char* request, int* numLines);
+
+/* Takes in a simulated roc. Performs every flight of said roc, recording the
+ * latency of each arrival (connect, send ID, receive info). */
+void* fly_roc(void* thisRoc);
+
+/* Takes in a log requester. Requests the log until every roc has finished,
+ * recording the latency of each request. */
+void* request_logs(void* thisLogWorker);
+
+/* Takes in the port of a control and an empty space to store the number of
+ * plane IDs logged. Requests the log once and returns whether the request
+ * succeeded. */
+bool request_log(char* controlPort, int* logSize);
+
+/* Takes in a client. Makes each of the client's requests, recording the
+ * latency and any failure of each. */
+void* run_client(void* thisClient);
+
+/* Takes in a client and the number of the request. Makes said request and
+ * returns if the reply was as expected. */
+bool timed_operation(Client* client, int request);
+
+/* Takes in a roc fleet. Starts every roc2310 process at once, each visiting
+ * ROUTE_LENGTH of the controls via the mapper, and records the time taken
+ * for each to exit. */
+void* fly_roc_fleet(void* thisFleet);
+
+/* Takes in the system to start and the number of controls. Starts a mapper
+ * and said number of controls registered with it, waiting until every
+ * control is listed. Returns if the system was started. */
+bool start_system(BenchSystem* system, int numControls);
+
+/* Takes in the system to stop. Terminates every process of said system. */
+void stop_system(BenchSystem* system);
+
+/* Takes in an array of latencies and the size of said array. Sorts said
+ * latencies and displays the median and tail latencies under the given
+ * name. */
+void report_latencies(char* name, double* latencies, int numLatencies);
+
+/* Takes in the name of a kind of request, the latencies and number of said
+ * requests and the time (in microseconds) they took. Displays the
+ * throughput and latencies of said requests. */
+void report_operation(char* name, double* latencies, int numLatencies,
+	double elapsed);
+
+/* Takes in the number of rocs and flights per roc. Runs the arrival
+ * contention benchmark against a freshly started control and returns the
+ * appropriate exit code. */
+int bench_arrivals(int numRocs, int numFlights);
+
+/* Takes in the number of rocs and flights per roc. Runs the arrivals of
+ * said rocs (each a connection of its own) against a freshly started control
+ * for each of ACCEPT_LISTENER_COUNTS, displaying the connections accepted
+ * (and served) per second with each number of listeners. Returns the
+ * appropriate exit code. */
+int bench_accept(int numRocs, int numFlights);
+
+/* Takes in the number of controls, roc2310 processes, clients per kind of
+ * request and requests per client. Runs the whole system (mapper, controls
+ * and rocs) under a mixed load and returns the appropriate exit code. */
+int bench_system(int numControls, int numRocs, int numClients,
+	int numRequests);
+
+/* Takes in the port of a server, its memory command (which differs between
+ * the mapper and control) and an empty report. Requests the memory of said
+ * server into said report and returns whether the request succeeded. */
+bool request_memory(char* port, char* command, MemoryReport* report);
+
+/* Takes in the ports of the mapper and control, and the first and last
+ * (exclusive) entries to add. Registers said entries with the mapper (in
+ * bulk) and arrives them at the control. Returns whether every entry was
+ * accepted. */
+bool add_soak_entries(char* mapperPort, char* controlPort, int first,
+	int last);
+
+/* Takes in the number of entries and idle connections each server ends up
+ * with. Grows a freshly started mapper and control to said size in steps,
+ * displaying the memory of both after each step (as a table, one row per
+ * step), and returns the appropriate exit code. */
+int bench_soak(int numEntries, int numConnections);
+
+/* Takes in the path of a capture file (see enable_capture()), an empty space
+ * to store the kind of server captured and to store the number of
+ * connections. Loads every captured command, grouped by connection in the
+ * order received. Returns said connections (NULL if the file is not a valid
+ * capture). */
+ReplayConnection* load_capture(char* path, char* serverType,
+	int* numConnections);
+
+/* Takes in the kind of server captured and a command. Returns the kind of
+ * said command. */
+ReplayKind replay_kind(char serverType, char* command);
+
+/* Takes in the kind of server, the command to send and both ends of the
+ * connection. Sends said command (followed by the barrier if needed) and
+ * reads its whole reply. Returns if the reply was complete. */
+bool replay_command(char serverType, char* command, FILE* writeEnd,
+	FILE* readEnd);
+
+/* Takes in a replayed connection. Connects to the server under test and
+ * sends each command at its captured offset (scaled by the speed),
+ * recording the latency of each reply. */
+void* replay_connection(void* thisConnection);
+
+/* Takes in the path of a capture file, the port of the server under test
+ * and the speed of the replay (0 for as fast as possible). Replays the
+ * capture against said server and returns the appropriate exit code. */
+int bench_replay(char* path, char* port, double speed);
+
+#endif
@@ -9,10 +9,30 @@
 #include <semaphore.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include "errors.h"
 #include "general.h"
 #include "control2310.h"
 
+/* Names of each PlaneCommand, as displayed by the statistics and lock
+ * profile. */
+static char* holderNames[] = {"arrival", "log", "stats", "lockprof", "top",
+	"visits", "memory"};
+
+/* Names of each ControlMemory category, as displayed by the memory command.
+ */
+static char* memoryNames[] = {"plane_ids", "arrivals", "visits",
+	"connections"};
+
+/* Names of the control's options, as declared (see declare_options()) such
+ * that an airport ID may begin with "--". */
+static const char* optionNames[] = {"heartbeat", "listeners", "lockprof",
+	"trace", "capture", "hosts", "idle-timeout", "request-timeout",
+	"accept-cpus", "worker-cpus", NULL};
+
 int main(int argc, char** argv) {
     // Squash SIGPIPE to prevent issues arising from sudden termination of
     // client(s)
@@ -22,6 +42,64 @@ int main(int argc, char** argv) {
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, NULL);
 
+    // The categories of tracked memory are named once, for the whole process
+    track_memory(memoryNames, NUM_CONTROL_MEMORY);
+
+    // Renewing a lease with the mapper (rather than registering once) is
+    // optional, as per --heartbeat
+    int heartbeatInterval = 0;
+    int numListeners = MIN_LISTENERS;
+    declare_options(optionNames);
+    char* heartbeatOption = get_option(&argc, argv, "heartbeat");
+    char* listenersOption = get_option(&argc, argv, "listeners");
+    char* lockProfileOption = get_option(&argc, argv, "lockprof");
+    char* traceOption = get_option(&argc, argv, "trace");
+    char* captureOption = get_option(&argc, argv, "capture");
+    char* hostsOption = get_option(&argc, argv, "hosts");
+    char* idleOption = get_option(&argc, argv, "idle-timeout");
+    char* requestOption = get_option(&argc, argv, "request-timeout");
+    char* acceptCpusOption = get_option(&argc, argv, "accept-cpus");
+    char* workerCpusOption = get_option(&argc, argv, "worker-cpus");
+    int idleTimeout = 0;
+    int requestTimeout = 0;
+    if ((idleOption && !option_to_int(idleOption, MIN_DEADLINE,
+	    MAX_DEADLINE, &idleTimeout)) || (requestOption &&
+	    !option_to_int(requestOption, MIN_DEADLINE, MAX_DEADLINE,
+	    &requestTimeout)) || (heartbeatOption &&
+	    !option_to_int(heartbeatOption, MIN_HEARTBEAT_INTERVAL,
+	    MAX_HEARTBEAT_INTERVAL, &heartbeatInterval)) || (listenersOption &&
+	    !option_to_int(listenersOption, MIN_LISTENERS, MAX_LISTENERS,
+	    &numListeners)) || (lockProfileOption &&
+	    lockProfileOption[0] != '\0') || (traceOption &&
+	    traceOption[0] == '\0') || (captureOption &&
+	    captureOption[0] == '\0') || (hostsOption &&
+	    (hostsOption[0] == '\0' || heartbeatOption || listenersOption ||
+	    argc > HOSTS_MAPPER_PORT + 1)) || unknown_options(&argc, argv) ||
+	    !enable_cpu_sets(acceptCpusOption, workerCpusOption)) {
+	return control_error_message(CONTROL_ARGS);
+    }
+
+    // The lock profile is dumped on SIGUSR1 (and the trace on SIGUSR2),
+    // which must be blocked before the registration session starts its
+    // thread
+    if (traceOption) {
+	enable_tracing(traceOption);
+    }
+    enable_deadlines(idleTimeout, requestTimeout);
+    if (captureOption && !enable_capture(captureOption, CONTROL_CAPTURE)) {
+	return UNSPECIFIED_ERROR;
+    }
+    if ((lockProfileOption || traceOption) && !block_dump_signals()) {
+	return UNSPECIFIED_ERROR;
+    }
+
+    // Many airports may be hosted by this process instead, in which case
+    // only the mapper is given
+    if (hostsOption) {
+	return serve_hosts(hostsOption, (argc > HOSTS_MAPPER_PORT) ?
+		argv[HOSTS_MAPPER_PORT] : NULL, lockProfileOption != NULL);
+    }
+
     if (argc < MIN_NUM_COMMAND_LINE_ARGS ||
 	    argc > MAX_NUM_COMMAND_LINE_ARGS) {
 	return control_error_message(CONTROL_ARGS);
@@ -29,43 +107,45 @@ int main(int argc, char** argv) {
     if (check_invalid_chars(argv[ID]) || check_invalid_chars(argv[INFO])) {
 	return control_error_message(CONTROL_CHAR);
     }
+    // The mapper may be a cluster of mappers (a list of ports), each owning
+    // a partition of the airport IDs
+    MapperRing* mappers = NULL;
     bool mapperProvided = false;
     if (argc == MAX_NUM_COMMAND_LINE_ARGS) {
 	mapperProvided = true;
-	char* mapperPortErrors;
-	int mapperPortNumber = strtol(argv[MAPPER_PORT], &mapperPortErrors,
-		10);
-
-	if (strtol_invalid(argv[MAPPER_PORT], mapperPortErrors) ||
-		mapperPortNumber > PORT_MAX ||
-		mapperPortNumber < PORT_MIN) {
+	if (!(mappers = build_mapper_ring(argv[MAPPER_PORT]))) {
 	    return control_error_message(CONTROL_PORT);
 	}
     }
-    uint16_t thisPortNumber;
-    int* serverEnd = setup_server(&thisPortNumber);
-    if (serverEnd == NULL) {
+    uint16_t thisPortNumber = 0; // listen on an ephemeral port
+    int* serverEnds = setup_listeners(&thisPortNumber, numListeners);
+    if (serverEnds == NULL) {
 	return UNSPECIFIED_ERROR;
     }
 
+    // session lives on the stack of main(), which never returns whilst the
+    // planes are being handled
+    MapperSession session = {argv[ID], mappers, thisPortNumber,
+	    heartbeatInterval, NULL};
     if (mapperProvided) {
-	ControlExitCodes mapperReturn =
-		register_with_mapper(argv[ID], argv[MAPPER_PORT],
-		thisPortNumber);
+	ControlExitCodes mapperReturn = (heartbeatInterval) ?
+		start_mapper_session(&session) :
+		register_with_mapper(argv[ID], mappers, thisPortNumber);
 	if (mapperReturn != CONTROL_NORMAL) {
-	    free(serverEnd);
+	    free(serverEnds);
 	    return control_error_message(mapperReturn);
 	}
     }
     // wait for and act on plane connections
-    handle_planes(*serverEnd, argv[INFO]);
+    handle_planes(serverEnds, numListeners, argv[INFO],
+	    lockProfileOption != NULL);
 
-    free(serverEnd);
+    free(serverEnds);
     // Should never reach here - control should run until killed
     return UNSPECIFIED_ERROR;
 }
 
-ControlExitCodes register_with_mapper(char* id, char* mapperPort,
+ControlExitCodes register_with_mapper(char* id, MapperRing* mappers,
 	int thisPortNumber) {
     int thisEnd; // stores mapper socket
 
@@ -73,7 +153,9 @@ ControlExitCodes register_with_mapper(char* id, char* mapperPort,
     // are calling said functions
     bool controlCalled = true;
 
-    ControlExitCodes mapperError = setup_client(mapperPort, &thisEnd,
+    // Register with the mapper which owns this airport's ID
+    ControlExitCodes mapperError = setup_client(route_to_mapper(mappers, id),
+	    &thisEnd,
 	    controlCalled);
     if (mapperError == CONTROL_MAPPER) {
 	return mapperError;
@@ -91,55 +173,457 @@ ControlExitCodes register_with_mapper(char* id, char* mapperPort,
     return CONTROL_NORMAL;
 }
 
-void handle_planes(int serverEnd, char* controlInfo) {
-    int connectionWrite; // file descriptor for accepted socket
+ControlExitCodes register_hosts_with_mapper(HostedAirport* hosts,
+	int numHosts, MapperRing* mappers) {
+    for (int mapper = 0; mapper < mappers->numMappers; mapper++) {
+	// Only the airports owned by this mapper are registered with it
+	char* mapperPort = mappers->mapperPorts[mapper];
+	int numOwned = 0;
+	for (int host = 0; host < numHosts; host++) {
+	    numOwned += route_to_mapper(mappers, hosts[host].id) == mapperPort;
+	}
+	if (numOwned == 0) {
+	    continue;
+	}
 
-    sem_t* lock = (sem_t*)malloc(sizeof(sem_t));
-    int numPlanes = INITIAL_NUM_PLANES;
-    ConnectingPlane* planes = init_connecting_planes(lock, numPlanes,
-	    controlInfo);
+	int thisEnd;
+	if (setup_client(mapperPort, &thisEnd, true) == CONTROL_MAPPER) {
+	    return CONTROL_MAPPER;
+	}
+	FILE* toWrite;
+	FILE* toRead;
+	if (!open_streams(thisEnd, &toWrite, &toRead)) {
+	    return CONTROL_MAPPER;
+	}
+	fprintf(toWrite, "*%d\n", numOwned);
+	for (int host = 0; host < numHosts; host++) {
+	    if (route_to_mapper(mappers, hosts[host].id) == mapperPort) {
+		fprintf(toWrite, "%s:%u\n", hosts[host].id,
+			hosts[host].portNumber);
+	    }
+	}
+	fflush(toWrite);
+
+	// The mapper replies (with the number added) once every airport is
+	// registered. Any airport not added was already registered elsewhere,
+	// hence would never be routed to this control.
+	size_t replyLength = INITIAL_BUFFER_SIZE;
+	char* reply = (char*)malloc(replyLength * sizeof(char));
+	bool registered = get_line(&reply, &replyLength, toRead) &&
+		strspn(reply, "0123456789") == strlen(reply) &&
+		atoi(reply) == numOwned;
+	free(reply);
+	fclose(toRead);
+	fclose(toWrite);
+	if (!registered) {
+	    return CONTROL_MAPPER;
+	}
+    }
+    return CONTROL_NORMAL;
+}
 
-    // Ensures each thread gets a unique semaphore
-    int currentPlane = 0;
+ControlExitCodes start_mapper_session(MapperSession* session) {
+    ControlExitCodes mapperError = connect_mapper_session(session);
+    if (mapperError != CONTROL_NORMAL) {
+	return mapperError;
+    }
+    pthread_t sessionThread;
+    if (pthread_create(&sessionThread, NULL, maintain_mapper_session,
+	    session) || pthread_detach(sessionThread)) {
+	return CONTROL_MAPPER;
+    }
+    return CONTROL_NORMAL;
+}
+
+ControlExitCodes connect_mapper_session(MapperSession* session) {
+    int thisEnd; // stores mapper socket
+    bool controlCalled = true;
+
+    if (setup_client(route_to_mapper(session->mappers, session->id),
+	    &thisEnd, controlCalled) ==
+	    CONTROL_MAPPER) {
+	return CONTROL_MAPPER;
+    }
+    session->toWrite = fdopen(thisEnd, "w");
+    if (!session->toWrite) {
+	close(thisEnd);
+	return CONTROL_MAPPER;
+    }
+    fprintf(session->toWrite, "~%s:%d\n", session->id,
+	    session->thisPortNumber);
+    if (fflush(session->toWrite)) {
+	fclose(session->toWrite);
+	session->toWrite = NULL;
+	return CONTROL_MAPPER;
+    }
+    return CONTROL_NORMAL;
+}
+
+bool mapper_session_alive(MapperSession* session) {
+    // The mapper never replies on a registration session, so anything
+    // readable means it has closed (or reset) its end of the connection
+    char peek;
+    ssize_t peeked = recv(fileno(session->toWrite), &peek, sizeof(char),
+	    MSG_PEEK | MSG_DONTWAIT);
+    return peeked == ERROR_RETURN && (errno == EAGAIN ||
+	    errno == EWOULDBLOCK);
+}
+
+void* maintain_mapper_session(void* mapperSession) {
+    MapperSession* session = (MapperSession*)mapperSession;
+    while (true) {
+	sleep(session->heartbeatInterval);
+	if (session->toWrite && mapper_session_alive(session)) {
+	    // Repeating the registration renews the lease
+	    fprintf(session->toWrite, "~%s:%d\n", session->id,
+		    session->thisPortNumber);
+	    if (!fflush(session->toWrite)) {
+		continue;
+	    }
+	}
+	// Connection lost, reconnect (and hence re-register) with the mapper
+	// at the next heartbeat should the mapper not be reachable yet
+	if (session->toWrite) {
+	    fclose(session->toWrite);
+	    session->toWrite = NULL;
+	}
+	connect_mapper_session(session);
+    }
+    return NULL;
+}
+
+void handle_planes(int* serverEnds, int numListeners, char* controlInfo,
+	bool profileLock) {
+    sem_t* lock = (sem_t*)malloc(sizeof(sem_t));
+    ConnectingPlane* planeTemplate = init_connecting_planes(lock,
+	    controlInfo, NULL);
     sem_init(lock, SHARED_BETWEEN_THREADS, 1);
+    planeTemplate->stats->profileLock = profileLock;
+    if ((profileLock || tracing_enabled()) &&
+	    !start_signal_dumper(planeTemplate->stats)) {
+	sem_destroy(lock);
+	free(lock);
+	return;
+    }
+    if (!start_reaper(planeTemplate->stats)) {
+	sem_destroy(lock);
+	free(lock);
+	return;
+    }
+
+    // Listeners only need pinning when sharing the port (or given the
+    // accepting CPUs), in which case each takes the next CPU (its planes'
+    // threads inherit said CPU, unless given the worker CPUs)
+    PlaneListener* listeners =
+	    (PlaneListener*)malloc(numListeners * sizeof(PlaneListener));
+    for (int listener = 0; listener < numListeners; listener++) {
+	listeners[listener].serverEnd = serverEnds[listener];
+	listeners[listener].cpu = accept_cpu(listener, numListeners);
+	listeners[listener].planeTemplate = planeTemplate;
+    }
+    pthread_t* listenerThreads =
+	    (pthread_t*)malloc(numListeners * sizeof(pthread_t));
+    int numStarted = 1;
+    while (numStarted < numListeners && !pthread_create(listenerThreads +
+	    numStarted, NULL, accept_planes, listeners + numStarted)) {
+	numStarted++;
+    }
+    if (numStarted == numListeners) {
+	accept_planes(listeners); // the first listener uses this thread
+    }
 
-    while (connectionWrite = accept(serverEnd, NULL, NULL),
+    // Once any listener stops, every other listener is stopped (shutdown()
+    // wakes a blocked accept()) and joined before the listeners are freed
+    for (int listener = 0; listener < numListeners; listener++) {
+	shutdown(serverEnds[listener], SHUT_RDWR);
+    }
+    for (int listener = 1; listener < numStarted; listener++) {
+	pthread_join(listenerThreads[listener], NULL);
+    }
+    free(listenerThreads);
+    free(listeners);
+    // The lock is never destroyed, as the (detached) threads of the
+    // connections accepted may still hold it until the process exits
+}
+
+void* accept_planes(void* thisListener) {
+    PlaneListener* listener = (PlaneListener*)thisListener;
+    int connectionWrite; // file descriptor for accepted socket
+
+    // An unpinned listener still accepts, merely without the locality
+    if (listener->cpu != NO_CPU_PINNING && !pin_to_cpu(listener->cpu)) {
+	fprintf(stderr, "Failed to pin a listener to CPU %d\n",
+		listener->cpu);
+    }
+
+    while (connectionWrite = accept(listener->serverEnd, NULL, NULL),
 	    connectionWrite >= 0) { // Ensure accept() succeeded
+	if (!start_plane(listener->planeTemplate, connectionWrite)) {
+	    return NULL;
+	}
+    }
+    return NULL;
+}
+
+bool start_plane(ConnectingPlane* planeTemplate, int connectionWrite) {
+    // Each thread gets its own copy of the shared plane information
+    // (free'd by each_plane() when the plane disconnects)
+    ConnectingPlane* thisPlane = (ConnectingPlane*)tracked_malloc(
+	    CONTROL_MEMORY_CONNECTIONS, sizeof(ConnectingPlane));
+    if (!thisPlane) {
+	close(connectionWrite);
+	return true; // malloc() failed, drop this connection only
+    }
+    *thisPlane = *planeTemplate;
+    thisPlane->connectionWrite = connectionWrite;
+
+    pthread_t threadId;
+    pthread_attr_t attributes;
+
+    if (pthread_attr_init(&attributes) ||
+	    pthread_attr_setdetachstate(&attributes,
+	    PTHREAD_CREATE_DETACHED) || !pin_worker(&attributes) ||
+	    pthread_create(&threadId, &attributes, each_plane,
+	    thisPlane) ||
+	    pthread_attr_destroy(&attributes)) {
+	close(connectionWrite);
+	tracked_free(thisPlane);
+	return false;
+    }
+    return true;
+}
 
-	// If numConnections is exceeded, allocate more memory (-1 for
-	// indexing purposes)
-	if (currentPlane == numPlanes - 1) {
-	    numPlanes++;
-	    resize_connecting_planes(&planes, &numPlanes, lock);
-	    if (numPlanes == ERROR_RETURN) {
-		return; // realloc() failed
+int serve_hosts(char* hostsPath, char* mapperPorts, bool profileLock) {
+    ControlExitCodes error;
+    int numHosts;
+    HostedAirport* hosts = read_hosts(hostsPath, &numHosts, &error);
+    if (!hosts) {
+	return control_error_message(error);
+    }
+    MapperRing* mappers = NULL;
+    if (mapperPorts && !(mappers = build_mapper_ring(mapperPorts))) {
+	return control_error_message(CONTROL_PORT);
+    }
+    if (!open_hosted_listeners(hosts, numHosts)) {
+	return UNSPECIFIED_ERROR;
+    }
+    if (mappers) {
+	ControlExitCodes mapperReturn = register_hosts_with_mapper(hosts,
+		numHosts, mappers);
+	if (mapperReturn != CONTROL_NORMAL) {
+	    return control_error_message(mapperReturn);
+	}
+    }
+    host_airports(hosts, numHosts, profileLock);
+
+    // Should never reach here - control should run until killed
+    return UNSPECIFIED_ERROR;
+}
+
+/* qsort() comparison function for airport IDs. */
+static int compare_ids(const void* first, const void* second) {
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+HostedAirport* read_hosts(char* path, int* numHosts,
+	ControlExitCodes* error) {
+    FILE* hostsFile = (!strcmp(path, "-")) ? stdin : fopen(path, "r");
+    *error = CONTROL_ARGS;
+    if (!hostsFile) {
+	return NULL;
+    }
+    *numHosts = 0;
+    int capacity = INITIAL_NUM_HOSTS;
+    HostedAirport* hosts =
+	    (HostedAirport*)malloc(capacity * sizeof(HostedAirport));
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    bool outOfMemory = !hosts || !line;
+    bool valid = !outOfMemory;
+    while (valid && get_line(&line, &lineLength, hostsFile)) {
+	if (line[0] == '\0') {
+	    continue;
+	}
+	// The ID is given before the first ':', the info after it
+	char* colonAndInfo = index(line, ':');
+	if (!colonAndInfo || colonAndInfo == line || colonAndInfo[1] == '\0'
+		|| *numHosts == MAX_HOSTED_AIRPORTS) {
+	    valid = false;
+	    break;
+	}
+	*colonAndInfo = '\0'; // terminate the ID
+	if (check_invalid_chars(line)) {
+	    valid = false;
+	    break;
+	}
+	*colonAndInfo = ':';
+	if (check_invalid_chars(colonAndInfo + 1)) {
+	    *error = CONTROL_CHAR;
+	    valid = false;
+	    break;
+	}
+	if (*numHosts == capacity) {
+	    HostedAirport* moreHosts = (HostedAirport*)realloc(hosts,
+		    2 * capacity * sizeof(HostedAirport));
+	    if (!moreHosts) {
+		outOfMemory = true;
+		valid = false;
+		break;
 	    }
+	    hosts = moreHosts;
+	    capacity *= 2;
 	}
-	(planes[currentPlane]).connectionWrite = connectionWrite;
+	HostedAirport* host = hosts + (*numHosts)++;
+	memset(host, 0, sizeof(HostedAirport));
+	host->id = strndup(line, colonAndInfo - line);
+	host->info = strdup(colonAndInfo + 1);
+	if (!host->id || !host->info) {
+	    outOfMemory = true;
+	    valid = false;
+	}
+    }
+    free(line);
+    if (hostsFile != stdin) {
+	fclose(hostsFile);
+    }
 
-	pthread_t threadId;
-	pthread_attr_t attributes;
+    // Each ID may only be hosted once (as the mapper would ignore repeats),
+    // which sorting the IDs reveals as neighbours
+    char** ids = (valid) ?
+	    (char**)malloc((*numHosts + 1) * sizeof(char*)) : NULL;
+    if (valid && !ids) {
+	outOfMemory = true;
+	valid = false;
+    }
+    for (int host = 0; valid && host < *numHosts; host++) {
+	ids[host] = hosts[host].id;
+    }
+    if (valid) {
+	qsort(ids, *numHosts, sizeof(char*), compare_ids);
+    }
+    for (int host = 1; valid && host < *numHosts; host++) {
+	valid = strcmp(ids[host - 1], ids[host]) != 0;
+    }
+    free(ids);
+    if (outOfMemory) {
+	fprintf(stderr, "Failed to hold the hosted airports\n");
+    }
+    if (!valid || *numHosts == 0) {
+	for (int host = 0; host < *numHosts; host++) {
+	    free(hosts[host].id);
+	    free(hosts[host].info);
+	}
+	free(hosts);
+	return NULL;
+    }
+    return hosts;
+}
 
-	if (pthread_attr_init(&attributes) ||
-		pthread_attr_setdetachstate(&attributes,
-		PTHREAD_CREATE_DETACHED) ||
-		pthread_create(&threadId, &attributes, each_plane,
-		planes + currentPlane) ||
-		pthread_attr_destroy(&attributes)) {
-	    sem_destroy(lock);
-	    free(lock);
+bool open_hosted_listeners(HostedAirport* hosts, int numHosts) {
+    // Every airport holds a listening socket, so allow as many descriptors
+    // as the system permits
+    struct rlimit descriptors;
+    if (!getrlimit(RLIMIT_NOFILE, &descriptors)) {
+	descriptors.rlim_cur = descriptors.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &descriptors);
+    }
+    for (int host = 0; host < numHosts; host++) {
+	hosts[host].portNumber = 0; // listen on an ephemeral port
+	hosts[host].serverEnd = open_listener(&hosts[host].portNumber,
+		false);
+	if (hosts[host].serverEnd == ERROR_RETURN) {
+	    for (int opened = 0; opened < host; opened++) {
+		close(hosts[opened].serverEnd);
+	    }
+	    return false;
+	}
+    }
+    // Display every port at once (as ID:port), as setup_listeners() would
+    // for a single airport
+    for (int host = 0; host < numHosts; host++) {
+	printf("%s:%u\n", hosts[host].id, hosts[host].portNumber);
+    }
+    fflush(stdout);
+    return true;
+}
+
+void host_airports(HostedAirport* hosts, int numHosts, bool profileLock) {
+    // Every airport has its own lock (and plane IDs), but the statistics
+    // describe the whole process
+    ServerStats* stats = NULL;
+    for (int host = 0; host < numHosts; host++) {
+	sem_t* lock = (sem_t*)malloc(sizeof(sem_t));
+	hosts[host].planeTemplate = init_connecting_planes(lock,
+		hosts[host].info, stats);
+	sem_init(lock, SHARED_BETWEEN_THREADS, 1);
+	stats = hosts[host].planeTemplate->stats;
+    }
+    stats->profileLock = profileLock;
+    if (((profileLock || tracing_enabled()) && !start_signal_dumper(stats)) ||
+	    !start_reaper(stats)) {
+	return;
+    }
+    accept_hosted_planes(hosts, numHosts);
+}
+
+void accept_hosted_planes(HostedAirport* hosts, int numHosts) {
+    int epollEnd = epoll_create1(0);
+    if (epollEnd == ERROR_RETURN) {
+	return;
+    }
+    // Listening sockets are non-blocking, such that a plane which gave up
+    // between being reported and being accepted cannot stall every airport
+    for (int host = 0; host < numHosts; host++) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	event.data.ptr = hosts + host;
+	if (fcntl(hosts[host].serverEnd, F_SETFL,
+		fcntl(hosts[host].serverEnd, F_GETFL) | O_NONBLOCK) ||
+		epoll_ctl(epollEnd, EPOLL_CTL_ADD, hosts[host].serverEnd,
+		&event)) {
+	    close(epollEnd);
 	    return;
 	}
-	currentPlane++;
     }
-    sem_destroy(lock);
-    free(lock);
+
+    struct epoll_event ready[MAX_READY_LISTENERS];
+    while (true) {
+	int numReady = epoll_wait(epollEnd, ready, MAX_READY_LISTENERS, -1);
+	if (numReady == ERROR_RETURN) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+	for (int event = 0; event < numReady; event++) {
+	    HostedAirport* host = (HostedAirport*)ready[event].data.ptr;
+	    int connectionWrite;
+	    while (connectionWrite = accept(host->serverEnd, NULL, NULL),
+		    connectionWrite >= 0 || errno == EINTR) {
+		if (connectionWrite >= 0 &&
+			!start_plane(host->planeTemplate, connectionWrite)) {
+		    close(epollEnd);
+		    return;
+		}
+	    }
+
+	    // Other than having accepted every pending plane, accept() fails
+	    // when out of descriptors (EMFILE or ENFILE), which the listener
+	    // stays ready through, so back off rather than spin until some
+	    // are freed
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		usleep(ACCEPT_RETRY_DELAY * 1000);
+	    }
+	}
+    }
+    close(epollEnd);
 }
 
-ConnectingPlane* init_connecting_planes(sem_t* lock, int numPlanes,
-	char* controlInfo) {
-    ConnectingPlane* planes =
-	    (ConnectingPlane*)malloc(numPlanes * sizeof(ConnectingPlane));
+ConnectingPlane* init_connecting_planes(sem_t* lock, char* controlInfo,
+	ServerStats* stats) {
+    ConnectingPlane* plane = (ConnectingPlane*)tracked_malloc(
+	    CONTROL_MEMORY_CONNECTIONS, sizeof(ConnectingPlane));
 
     int* numPlaneIds = (int*)malloc(sizeof(int));
     *numPlaneIds = INITIAL_NUM_PLANE_IDS;
@@ -147,44 +631,35 @@ ConnectingPlane* init_connecting_planes(sem_t* lock, int numPlanes,
     // Form a pointer to an array of plane IDs (strings), such that if one
     // thread resizes the array, the other threads point to the resized array
     char*** planeIds = (char***)malloc(sizeof(char**));
-    *planeIds = (char**)malloc(sizeof(char*) * (*numPlaneIds));
+    *planeIds = (char**)tracked_malloc(CONTROL_MEMORY_PLANE_IDS,
+	    sizeof(char*) * (*numPlaneIds));
 
     for (int id = 0; id < *numPlaneIds; id++) {
-	(*planeIds)[id] = (char*)malloc(sizeof(char) * INITIAL_BUFFER_SIZE);
+	(*planeIds)[id] = (char*)tracked_malloc(CONTROL_MEMORY_PLANE_IDS,
+		sizeof(char) * INITIAL_BUFFER_SIZE);
 	((*planeIds)[id])[0] = '\0';
     }
 
-    for (int plane = 0; plane < numPlanes; plane++) {
-	// all connecting planes should have access to the same plane info so
-	// that each connection can update information (e.g. add a new plane)
-	// and all other connections will register any changes
-	(planes[plane]).planeIds = planeIds;
-	(planes[plane]).controlInfo = controlInfo;
-	(planes[plane]).numPlaneIds = numPlaneIds;
-	(planes[plane]).guard = lock;
-    }
-    return planes;
-}
-
-void resize_connecting_planes(ConnectingPlane** planes, int* numPlanes,
-	sem_t* lock) {
-    void* morePlanes =
-	    realloc(*planes, (*numPlanes) * sizeof(ConnectingPlane));
+    // The arrival stack begins empty
+    Arrival** arrivals = (Arrival**)malloc(sizeof(Arrival*));
+    *arrivals = NULL;
 
-    if (!morePlanes) {
-	*numPlanes = ERROR_RETURN;
-	return; // realloc() failed
+    // all connecting planes should have access to the same plane info so
+    // that each connection can update information (e.g. add a new plane)
+    // and all other connections will register any changes
+    plane->planeIds = planeIds;
+    plane->controlInfo = controlInfo;
+    plane->numPlaneIds = numPlaneIds;
+    plane->arrivals = arrivals;
+    plane->visits = init_visit_counts();
+    if (!plane->visits) {
+	// The control still logs planes, but counts none of their visits
+	fprintf(stderr, "Failed to hold the visit counts\n");
     }
-    *planes = morePlanes;
-
-    // after reallocating memory, provide the new connecting plane with the
-    // required information. NOTE: all connecting planes point to the same
-    // plane ID array, hence we pick any connecting plane (in this case the
-    // first)
-    ((*planes)[*numPlanes - 1]).planeIds = ((*planes)[0]).planeIds;
-    ((*planes)[*numPlanes - 1]).controlInfo = ((*planes)[0]).controlInfo;
-    ((*planes)[*numPlanes - 1]).numPlaneIds = ((*planes)[0]).numPlaneIds;
-    ((*planes)[*numPlanes - 1]).guard = lock;
+    plane->guard = lock;
+    plane->stats = (stats) ? stats : init_stats("log_size", holderNames,
+	    NUM_PLANE_COMMANDS, NUM_PLANE_COMMANDS, false);
+    return plane;
 }
 
 void* each_plane(void* thisPlane) {
@@ -194,69 +669,224 @@ void* each_plane(void* thisPlane) {
     
     // Ensure dup() succeeded
     if (connectionRead == ERROR_RETURN) {
+	close(thisPlaneOriginal->connectionWrite);
+	tracked_free(thisPlaneOriginal);
 	return NULL;
     }
 
-    FILE* readEnd = fdopen(connectionRead, "r");
-    FILE* writeEnd = fdopen(thisPlaneOriginal->connectionWrite, "w");
+    ServerStats* stats = thisPlaneOriginal->stats;
+    WatchedConnection* watch = watch_connection(&thisPlaneOriginal->watch,
+	    connectionRead);
+    FILE* readEnd = counted_fdopen(connectionRead, "r", &stats->bytesIn,
+	    watch);
+    FILE* writeEnd = counted_fdopen(thisPlaneOriginal->connectionWrite, "w",
+	    &stats->bytesOut, watch);
     
-    // Ensure fdopen() succeeded
+    // Ensure fdopen() succeeded (closing whichever end was opened)
     if (!readEnd || !writeEnd) {
+	unwatch_connection(&thisPlaneOriginal->watch);
+	if (readEnd) {
+	    fclose(readEnd);
+	} else {
+	    close(connectionRead);
+	}
+	if (writeEnd) {
+	    fclose(writeEnd);
+	} else {
+	    close(thisPlaneOriginal->connectionWrite);
+	}
+	tracked_free(thisPlaneOriginal);
 	return NULL;
     }
+    stat_add(&stats->totalConnections, 1);
+    stat_add(&stats->activeConnections, 1);
+    uint32_t connectionId = capture_connection(); // 0 unless capturing
+
+    // A plane choosing the binary protocol sends BINARY_MAGIC first,
+    // anything else is the first character of a text command
+    int first = fgetc(readEnd);
+    bool binary = first == BINARY_MAGIC;
+    if (binary) {
+	serve_binary_planes(thisPlaneOriginal, readEnd, &writeEnd,
+		connectionId);
+    } else if (first != EOF) {
+	ungetc(first, readEnd);
+    }
     
     size_t commandLength = INITIAL_BUFFER_SIZE;
     char* command = (char*)malloc(commandLength * sizeof(char));
 
-    while (get_line(&command, &commandLength, readEnd),
-	    strlen(command) != 0) {
-	// Apart from the lock, only the plane IDs shared, hence only
-	// processing commands (thus consequently manipulating the plane IDs)
-	// requires the lock as each thread has its own socket
-	sem_wait(thisPlaneOriginal->guard);
-
-	handle_command(command, thisPlaneOriginal, &writeEnd);
+    while (!binary && (get_line(&command, &commandLength, readEnd),
+	    strlen(command) != 0)) {
+	finish_request(&thisPlaneOriginal->watch);
+	capture_command(connectionId, command);
+	// Only the plane IDs are shared. Arrivals are pushed without the lock,
+	// and handle_command() takes the lock itself for the log
+	long long started = monotonic_nanoseconds();
+	record_command(stats, handle_command(command, thisPlaneOriginal,
+		&writeEnd), started);
 	
 	if (*(thisPlaneOriginal->numPlaneIds) == ERROR_RETURN) {
-	    free(command);
-	    fflush(writeEnd);
-	    fclose(writeEnd);
-	    fclose(readEnd);
-	    sem_post(thisPlaneOriginal->guard);
-	    return NULL; // realloc() failed, return prevents segfault
+	    break; // realloc() failed, stop to prevent segfault
 	}
-	sem_post(thisPlaneOriginal->guard);
     }
+    capture_close(connectionId);
     free(command);
+    unwatch_connection(&thisPlaneOriginal->watch);
     fflush(writeEnd);
     fclose(writeEnd);
     fclose(readEnd); 
+    stat_add(&stats->activeConnections, -1);
+    tracked_free(thisPlaneOriginal);
     return NULL;
 }
 
-void handle_command(char* command, ConnectingPlane* thisPlane,
+void serve_binary_planes(ConnectingPlane* thisPlane, FILE* readEnd,
+	FILE** writeEnd, uint32_t connectionId) {
+    Frame frame;
+    memset(&frame, 0, sizeof(Frame));
+    while (read_frame(readEnd, &frame)) {
+	finish_request(&thisPlane->watch);
+	// Unlike a text arrival, an invalid plane ID does not end the control
+	if (frame.type != FRAME_ARRIVAL || frame.id[0] == '\0' ||
+		check_invalid_chars(frame.id)) {
+	    continue;
+	}
+	long long started = monotonic_nanoseconds();
+	capture_command(connectionId, frame.id);
+	push_arrival(thisPlane, frame.id);
+	write_frame(*writeEnd, FRAME_INFO, ERROR_RETURN,
+		thisPlane->controlInfo);
+	fflush(*writeEnd);
+	record_command(thisPlane->stats, PLANE_ARRIVAL, started);
+    }
+    free(frame.payload);
+}
+
+PlaneCommand handle_command(char* command, ConnectingPlane* thisPlane,
 	FILE** writeEnd) {
     if (!strcmp(command, "log")) {
-	display_plane_ids(thisPlane, writeEnd);
+	// The log is the only reader of the plane IDs, so it is responsible
+	// for moving any pending arrivals into them. Only a copy is taken
+	// under the lock, it is sorted and sent once the lock is released
+	long long acquired = stats_guard_wait(thisPlane->guard,
+		thisPlane->stats, PLANE_LOG);
+	drain_arrivals(thisPlane);
+	int numPlaneIds;
+	char** planeIds = snapshot_plane_ids(thisPlane, &numPlaneIds);
+	stats_guard_post(thisPlane->guard, thisPlane->stats, PLANE_LOG,
+		acquired);
+	display_plane_ids(planeIds, numPlaneIds, writeEnd);
+	return PLANE_LOG;
+    } else if (!strcmp(command, CONTROL_COMMAND_PREFIX "stats")) {
+	display_control_stats(thisPlane, writeEnd, PLANE_STATS);
+	return PLANE_STATS;
+    } else if (!strcmp(command, CONTROL_COMMAND_PREFIX "lockprof")) {
+	display_control_stats(thisPlane, writeEnd, PLANE_LOCK_PROFILE);
+	return PLANE_LOCK_PROFILE;
+    } else if (!strcmp(command, CONTROL_COMMAND_PREFIX "memory")) {
+	display_control_stats(thisPlane, writeEnd, PLANE_MEMORY);
+	return PLANE_MEMORY;
+    } else if (is_control_command(command)) {
+	// The remaining commands are the visit analytics (top and visits)
+	PlaneCommand commandType =
+		(command[strlen(CONTROL_COMMAND_PREFIX)] == 't') ?
+		PLANE_TOP : PLANE_VISITS;
+	long long acquired = stats_guard_wait(thisPlane->guard,
+		thisPlane->stats, commandType);
+	display_visits(thisPlane, command, writeEnd);
+	stats_guard_post(thisPlane->guard, thisPlane->stats, commandType,
+		acquired);
+	return commandType;
     } else if (check_invalid_chars(command)) {
 	// Invalid chars found in plane ID. Handling this is unspecified in
 	// the spec however Joel mentioned to simply exit in this case.
 	ControlExitCodes invalidPlaneId = control_error_message(CONTROL_CHAR);
 	exit(invalidPlaneId);
     } else {
-	add_plane_id(thisPlane, command);
+	// The plane is still given the info, even if its arrival is dropped
+	push_arrival(thisPlane, command);
 	fprintf(*writeEnd, "%s\n", thisPlane->controlInfo);
 	fflush(*writeEnd);
     }
+    return PLANE_ARRIVAL;
+}
+
+bool push_arrival(ConnectingPlane* thisPlane, char* planeId) {
+    Arrival* arrival = (Arrival*)tracked_malloc(CONTROL_MEMORY_ARRIVALS,
+	    sizeof(Arrival));
+    if (!arrival) {
+	fprintf(stderr, "Failed to record the arrival of %s\n", planeId);
+	return false; // malloc() failed, drop this arrival only
+    }
+    arrival->planeId = tracked_strdup(CONTROL_MEMORY_ARRIVALS, planeId);
+    if (!arrival->planeId) {
+	tracked_free(arrival);
+	fprintf(stderr, "Failed to record the arrival of %s\n", planeId);
+	return false;
+    }
+
+    // Standard lock-free (Treiber) stack push: link to the current head and
+    // retry if another plane replaced the head in the meantime (a failed
+    // compare-and-swap reloads arrival->next with the new head)
+    arrival->next = __atomic_load_n(thisPlane->arrivals, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(thisPlane->arrivals, &arrival->next,
+	    arrival, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    stat_add(&thisPlane->stats->storedEntries, 1);
+    return true;
+}
+
+void drain_arrivals(ConnectingPlane* thisPlane) {
+    // Detach the entire stack at once, hence planes may continue to push
+    // while the detached arrivals are processed
+    Arrival* pending = __atomic_exchange_n(thisPlane->arrivals, NULL,
+	    __ATOMIC_ACQUIRE);
+
+    // The stack holds the most recent arrival first, reverse it such that
+    // plane IDs are added in order of arrival
+    Arrival* inOrder = NULL;
+    while (pending) {
+	Arrival* next = pending->next;
+	pending->next = inOrder;
+	inOrder = pending;
+	pending = next;
+    }
+
+    while (inOrder) {
+	Arrival* next = inOrder->next;
+	if (*(thisPlane->numPlaneIds) != ERROR_RETURN) {
+	    add_plane_id(thisPlane, inOrder->planeId);
+	}
+	tracked_free(inOrder->planeId);
+	tracked_free(inOrder);
+	inOrder = next;
+    }
 }
 
 void add_plane_id(ConnectingPlane* thisPlane, char* planeIdToAdd) {
+    if (!count_visit(thisPlane->visits, planeIdToAdd)) {
+	fprintf(stderr, "Failed to count the visit of %s\n", planeIdToAdd);
+    }
     for (int planeId = 0; planeId < *(thisPlane->numPlaneIds); planeId++) {
 
 	// *(thisPlane->planeIDs) is initialised with INITIAL_NUM_PLANE_IDS
 	// plane IDs, all set to be == \0 to denote available space. Find the
 	// first available space and add the plane ID there
 	if (((*(thisPlane->planeIds))[planeId])[0] == '\0') {
+	    // Longer plane IDs need more than the space each begins with
+	    size_t idLength = strlen(planeIdToAdd);
+	    if (idLength >= INITIAL_BUFFER_SIZE) {
+		char* longerId = (char*)tracked_realloc(
+			CONTROL_MEMORY_PLANE_IDS,
+			(*(thisPlane->planeIds))[planeId], idLength + 1);
+		if (!longerId) {
+		    fprintf(stderr, "Failed to log plane %s\n",
+			    planeIdToAdd);
+		    return; // realloc() failed, the space stays available
+		}
+		(*(thisPlane->planeIds))[planeId] = longerId;
+	    }
 	    strcat((*(thisPlane->planeIds))[planeId], planeIdToAdd);
 	    return;
 	}
@@ -268,7 +898,8 @@ void add_plane_id(ConnectingPlane* thisPlane, char* planeIdToAdd) {
 void resize_and_add_plane_id(ConnectingPlane* thisPlane, char* planeIdToAdd) {
     (*(thisPlane->numPlaneIds))++;
 
-    void* morePlaneIds = realloc(*(thisPlane->planeIds),
+    void* morePlaneIds = tracked_realloc(CONTROL_MEMORY_PLANE_IDS,
+	    *(thisPlane->planeIds),
 	    (*(thisPlane->numPlaneIds)) * sizeof(char**));
 
     if (!morePlaneIds) {
@@ -279,51 +910,241 @@ void resize_and_add_plane_id(ConnectingPlane* thisPlane, char* planeIdToAdd) {
     *(thisPlane->planeIds) = morePlaneIds;
 
     // After re-allocating memory, add the new plane ID
-    (*(thisPlane->planeIds))[*(thisPlane->numPlaneIds) - 1] =
-	    (char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
-
+    size_t idLength = strlen(planeIdToAdd);
+    char* newId = (char*)tracked_malloc(CONTROL_MEMORY_PLANE_IDS,
+	    ((idLength < INITIAL_BUFFER_SIZE) ? INITIAL_BUFFER_SIZE :
+	    idLength + 1) * sizeof(char));
+    if (!newId) {
+	// The reallocated plane IDs simply hold one unused pointer
+	(*(thisPlane->numPlaneIds))--;
+	fprintf(stderr, "Failed to log plane %s\n", planeIdToAdd);
+	return; // malloc() failed
+    }
+    (*(thisPlane->planeIds))[*(thisPlane->numPlaneIds) - 1] = newId;
     ((*(thisPlane->planeIds))[*(thisPlane->numPlaneIds) - 1])[0] = '\0';
     strcat((*(thisPlane->planeIds))[*(thisPlane->numPlaneIds) - 1],
 	    planeIdToAdd);
 }
 
-void display_plane_ids(ConnectingPlane* thisPlane, FILE** writeEnd) {
-    sort_plane_ids(thisPlane);
-    for (int planeId = 0; planeId < *(thisPlane->numPlaneIds); planeId++) {
-	if (((*(thisPlane->planeIds))[planeId])[0] != '\0') {
-	    fprintf(*writeEnd, "%s\n", (*(thisPlane->planeIds))[planeId]);
-	    fflush(*writeEnd);
+VisitCounts* init_visit_counts(void) {
+    VisitCounts* visits = (VisitCounts*)tracked_malloc(CONTROL_MEMORY_VISITS,
+	    sizeof(VisitCounts));
+    if (!visits) {
+	return NULL; // malloc() failed
+    }
+    visits->numSlots = INITIAL_VISIT_SLOTS;
+    visits->slots = (PlaneVisits**)tracked_calloc(CONTROL_MEMORY_VISITS,
+	    visits->numSlots, sizeof(PlaneVisits*));
+    if (!visits->slots) {
+	tracked_free(visits);
+	return NULL; // calloc() failed
+    }
+    visits->numPlanes = 0;
+    visits->highest = NULL;
+    visits->lowest = NULL;
+    return visits;
+}
+
+/* Helper function for find_visits() and count_visit(). Takes in visit counts
+ * and a plane ID. Returns the slot holding said plane or, if absent, the
+ * empty slot where it belongs. */
+static PlaneVisits** visit_slot(VisitCounts* visits, char* planeId) {
+    uint32_t slot = hash_id(planeId) & (visits->numSlots - 1);
+    while (visits->slots[slot] &&
+	    strcmp(visits->slots[slot]->planeId, planeId)) {
+	slot = (slot + 1) & (visits->numSlots - 1);
+    }
+    return visits->slots + slot;
+}
+
+PlaneVisits* find_visits(VisitCounts* visits, char* planeId) {
+    return *visit_slot(visits, planeId);
+}
+
+/* Helper function for count_visit(). Takes in visit counts whose hash table
+ * is half full. Doubles the slots of said table, re-inserting every plane.
+ * Returns false (leaving the table as it was) if memory ran out. */
+static bool grow_visit_slots(VisitCounts* visits) {
+    PlaneVisits** newSlots = (PlaneVisits**)tracked_calloc(
+	    CONTROL_MEMORY_VISITS, visits->numSlots * 2,
+	    sizeof(PlaneVisits*));
+    if (!newSlots) {
+	return false; // calloc() failed
+    }
+    PlaneVisits** oldSlots = visits->slots;
+    int numOldSlots = visits->numSlots;
+    visits->numSlots *= 2;
+    visits->slots = newSlots;
+    for (int slot = 0; slot < numOldSlots; slot++) {
+	if (oldSlots[slot]) {
+	    *visit_slot(visits, oldSlots[slot]->planeId) = oldSlots[slot];
+	}
+    }
+    tracked_free(oldSlots);
+    return true;
+}
+
+bool count_visit(VisitCounts* visits, char* planeId) {
+    if (!visits) {
+	return false; // the visit counts could not be allocated
+    }
+    PlaneVisits** slot = visit_slot(visits, planeId);
+    PlaneVisits* plane = *slot;
+    bool isNew = !plane;
+    if (isNew) {
+	// The table grows before it is over half full, but must at least
+	// keep one slot empty to end every probe
+	if ((visits->numPlanes + 1) * 2 > visits->numSlots &&
+		!grow_visit_slots(visits) &&
+		visits->numPlanes + 2 > visits->numSlots) {
+	    return false;
+	}
+	slot = visit_slot(visits, planeId);
+	plane = (PlaneVisits*)tracked_malloc(CONTROL_MEMORY_VISITS,
+		sizeof(PlaneVisits));
+	if (!plane) {
+	    return false; // malloc() failed
+	}
+	plane->planeId = tracked_strdup(CONTROL_MEMORY_VISITS, planeId);
+	if (!plane->planeId) {
+	    tracked_free(plane);
+	    return false;
+	}
+	plane->bucket = NULL;
+    }
+
+    // The bucket one count higher is directly above the plane's bucket (or,
+    // for a new plane, is the lowest bucket), unless it must be created
+    VisitBucket* from = plane->bucket;
+    unsigned long count = (from) ? from->count + 1 : 1;
+    VisitBucket* to = (from) ? from->higher : visits->lowest;
+    if (!to || to->count != count) {
+	VisitBucket* above = to;
+	to = (VisitBucket*)tracked_malloc(CONTROL_MEMORY_VISITS,
+		sizeof(VisitBucket));
+	if (!to) {
+	    // Nothing has moved yet, a new plane is simply never added
+	    if (isNew) {
+		tracked_free(plane->planeId);
+		tracked_free(plane);
+	    }
+	    return false; // malloc() failed
+	}
+	to->count = count;
+	to->planes = NULL;
+	to->lower = from;
+	to->higher = above;
+	if (above) {
+	    above->lower = to;
+	} else {
+	    visits->highest = to;
+	}
+	if (from) {
+	    from->higher = to;
+	} else {
+	    visits->lowest = to;
+	}
+    }
+
+    // Leave the plane's bucket, which is dropped once empty
+    if (from) {
+	if (plane->previous) {
+	    plane->previous->next = plane->next;
+	} else {
+	    from->planes = plane->next;
+	}
+	if (plane->next) {
+	    plane->next->previous = plane->previous;
+	}
+	if (!from->planes) {
+	    to->lower = from->lower;
+	    if (from->lower) {
+		from->lower->higher = to;
+	    } else {
+		visits->lowest = to;
+	    }
+	    tracked_free(from);
+	}
+    }
+    plane->previous = NULL;
+    plane->next = to->planes;
+    if (to->planes) {
+	to->planes->previous = plane;
+    }
+    to->planes = plane;
+    plane->bucket = to;
+    if (isNew) {
+	*slot = plane;
+	visits->numPlanes++;
+    }
+    return true;
+}
+
+void display_visits(ConnectingPlane* thisPlane, char* command,
+	FILE** writeEnd) {
+    // Pending arrivals are yet to be counted
+    drain_arrivals(thisPlane);
+    VisitCounts* visits = thisPlane->visits;
+    command += strlen(CONTROL_COMMAND_PREFIX);
+    if (command[0] == 'v') {
+	PlaneVisits* plane = (visits) ?
+		find_visits(visits, command + strlen("visits ")) : NULL;
+	fprintf(*writeEnd, "%lu\n", (plane) ? plane->bucket->count : 0);
+	fflush(*writeEnd);
+	return;
+    }
+
+    // An invalid K lists no planes
+    int numTop = 0;
+    option_to_int(command + strlen("top "), 1, MAX_TOP_PLANES, &numTop);
+    for (VisitBucket* bucket = (visits) ? visits->highest : NULL;
+	    bucket && numTop; bucket = bucket->lower) {
+	for (PlaneVisits* plane = bucket->planes; plane && numTop;
+		plane = plane->next, numTop--) {
+	    fprintf(*writeEnd, "%s:%lu\n", plane->planeId, bucket->count);
 	}
     }
     fprintf(*writeEnd, ".\n");
     fflush(*writeEnd);
 }
 
-void sort_plane_ids(ConnectingPlane* thisPlane) {
+char** snapshot_plane_ids(ConnectingPlane* thisPlane, int* numPlaneIds) {
+    char** planeIds = (char**)malloc((*(thisPlane->numPlaneIds) + 1) *
+	    sizeof(char*));
+    *numPlaneIds = 0;
     for (int planeId = 0; planeId < *(thisPlane->numPlaneIds); planeId++) {
-	
-	// Compare each element with the succeeding elements and work to the
-	// end of the array
-	for (int planeIdNext = planeId + 1;
-		planeIdNext < *(thisPlane->numPlaneIds); planeIdNext++) {
-
-	    // strcmp() returns a positive int if, in terms of lexicographic
-	    // order, the first argument should come after the second
-	    // argument. Swap this ordering if this is the case
-	    if (strcmp((*(thisPlane->planeIds))[planeId],
-		    (*(thisPlane->planeIds))[planeIdNext]) > 0) {
-		
-		char* toSwap =
-			(char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
-		char* currentPlaneId = (*(thisPlane->planeIds))[planeId];
-		char* nextPlaneId = (*(thisPlane->planeIds))[planeIdNext];
-
-		strcpy(toSwap, currentPlaneId);
-		strcpy(currentPlaneId, nextPlaneId);
-		strcpy(nextPlaneId, toSwap);
-
-		free(toSwap);
-	    }
+	if (((*(thisPlane->planeIds))[planeId])[0] != '\0') {
+	    planeIds[(*numPlaneIds)++] =
+		    strdup((*(thisPlane->planeIds))[planeId]);
 	}
     }
+    return planeIds;
+}
+
+void display_plane_ids(char** planeIds, int numPlaneIds, FILE** writeEnd) {
+    sort_plane_ids(planeIds, numPlaneIds);
+    for (int planeId = 0; planeId < numPlaneIds; planeId++) {
+	fprintf(*writeEnd, "%s\n", planeIds[planeId]);
+	free(planeIds[planeId]);
+    }
+    free(planeIds);
+    fprintf(*writeEnd, ".\n");
+    fflush(*writeEnd);
+}
+
+void display_control_stats(ConnectingPlane* thisPlane, FILE** writeEnd,
+	PlaneCommand command) {
+    if (command == PLANE_LOCK_PROFILE) {
+	display_lock_profile(thisPlane->stats, *writeEnd);
+    } else if (command == PLANE_MEMORY) {
+	display_memory(*writeEnd);
+    } else {
+	display_stats(thisPlane->stats, *writeEnd);
+    }
+    fprintf(*writeEnd, ".\n");
+    fflush(*writeEnd);
+}
+
+void sort_plane_ids(char** planeIds, int numPlaneIds) {
+    qsort(planeIds, numPlaneIds, sizeof(char*), compare_ids);
 }
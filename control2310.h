@@ -12,6 +12,9 @@
 #include <semaphore.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include "errors.h"
 #include "general.h"
 
@@ -32,10 +35,23 @@
 /* Used to index argv for the mapper port. */
 #define MAPPER_PORT 3
 
-/* The control will store connection information about each connecting plane.
- * Let us allow information of upto 15 planes to be stored initially, and
- * reallocate memory if more planes connect to this airport. */
-#define INITIAL_NUM_PLANES 15
+/* Used to index argv for the mapper port when hosting many airports
+ * (--hosts), which replaces the ID and info. */
+#define HOSTS_MAPPER_PORT 1
+
+/* Upper bound of the number of airports hosted by one process (--hosts). */
+#define MAX_HOSTED_AIRPORTS 100000
+
+/* Initial capacity for the hosted airports, doubled whenever full. */
+#define INITIAL_NUM_HOSTS 64
+
+/* Number of ready listening sockets handled per epoll_wait() when hosting
+ * many airports. */
+#define MAX_READY_LISTENERS 64
+
+/* Milliseconds to wait, when hosting many airports, after accept() fails
+ * other than for want of pending planes (e.g. out of descriptors). */
+#define ACCEPT_RETRY_DELAY 10
 
 /* A plane may connect to the control multiple times. The control will store
  * connection information about the plane each time it connects. Let us allow
@@ -43,23 +59,159 @@
  * connect more than 10 times. */
 #define INITIAL_NUM_PLANE_IDS 10
 
+/* Upper bound of K, the number of planes listed by ":top K". */
+#define MAX_TOP_PLANES 1000
+
+/* Initial number of slots of the visit counts' hash table (a power of two),
+ * doubled whenever half are used. */
+#define INITIAL_VISIT_SLOTS 64
+
+/* Bounds (in seconds) of the heartbeat interval given via --heartbeat. The
+ * interval should be well below the lease duration of the mapper. */
+#define MIN_HEARTBEAT_INTERVAL 1
+#define MAX_HEARTBEAT_INTERVAL 3600
+
+/* Commands a plane (or any client) may send to the control */
+typedef enum {
+    PLANE_ARRIVAL = 0, // a plane ID
+    PLANE_LOG = 1,
+    PLANE_STATS = 2,
+    PLANE_LOCK_PROFILE = 3,
+    PLANE_TOP = 4, // :top K
+    PLANE_VISITS = 5, // :visits ID
+    PLANE_MEMORY = 6,
+    NUM_PLANE_COMMANDS = 7
+} PlaneCommand;
+
+/* Categories of the control's tracked memory (see tracked_malloc()) */
+typedef enum {
+    CONTROL_MEMORY_PLANE_IDS = 0, // the log
+    CONTROL_MEMORY_ARRIVALS = 1, // pending, see push_arrival()
+    CONTROL_MEMORY_VISITS = 2,
+    CONTROL_MEMORY_CONNECTIONS = 3, // each plane's copy of the information
+    NUM_CONTROL_MEMORY = 4
+} ControlMemory;
+
+/* Mapper Registration Session Representation. Whilst connected, the control
+ * holds a connection to the mapper open and renews its lease ('~') every
+ * heartbeatInterval seconds. If the connection is lost (e.g. the mapper
+ * restarted), the control reconnects and thus re-registers. */
+typedef struct {
+    char* id;
+    MapperRing* mappers;
+    int thisPortNumber;
+    int heartbeatInterval; // seconds between lease renewals
+    FILE* toWrite; // NULL whilst disconnected from the mapper
+} MapperSession;
+
+/* Pending Arrival Representation. Arrivals are pushed onto a lock-free stack
+ * by the plane threads and only moved into the plane IDs (under the lock)
+ * when the log is next required. */
+typedef struct Arrival {
+    char* planeId;
+    struct Arrival* next;
+} Arrival;
+
+/* Visit Count of a single plane, within the bucket of every plane with the
+ * same count */
+typedef struct PlaneVisits {
+    char* planeId;
+    struct VisitBucket* bucket;
+    struct PlaneVisits* previous;
+    struct PlaneVisits* next;
+} PlaneVisits;
+
+/* Visit Bucket: every plane with a given count. Buckets are only ever
+ * non-empty, and listed in order of count. */
+typedef struct VisitBucket {
+    unsigned long count;
+    PlaneVisits* planes;
+    struct VisitBucket* higher; // the bucket of the next highest count
+    struct VisitBucket* lower;
+} VisitBucket;
+
+/* Visit Counts of every plane (see count_visit()). A visit moves a plane to
+ * the bucket one count higher, hence counting is O(1) and the K most
+ * frequent planes are the first K of the buckets from the highest. NOTE:
+ * only accessed whilst the lock is held. */
+typedef struct {
+    PlaneVisits** slots; // hash table of plane IDs, by linear probing
+    int numSlots;
+    int numPlanes;
+    VisitBucket* highest; // NULL until the first visit
+    VisitBucket* lowest;
+} VisitCounts;
+
 /* Connecting Plane Representation */
 typedef struct {
     char*** planeIds;
     char* controlInfo;
     int* numPlaneIds; // A plane can connect multiple times
+    Arrival** arrivals; // pushed to without holding the lock
+    VisitCounts* visits; // of every plane ID added
     sem_t* guard;
+    ServerStats* stats;
     int connectionWrite;
+    WatchedConnection watch; // each connection's own (see each_plane())
 } ConnectingPlane;
 
-/* Takes in this airport's (validated) ID, the mapper's port, and this
- * airport's port number. This function connects to the mapper, registers the
- * ID and port of this airport, and returns the appropriate exit code. */
-ControlExitCodes register_with_mapper(char* id, char* mapperPort,
+/* Hosted Airport Representation (--hosts). Each hosted airport has its own
+ * port, info, plane IDs, arrival stack and lock, but the listening sockets of
+ * every hosted airport are watched by a single accept loop (see
+ * accept_hosted_planes()). */
+typedef struct {
+    char* id;
+    char* info;
+    int serverEnd;
+    uint16_t portNumber;
+    ConnectingPlane* planeTemplate;
+} HostedAirport;
+
+/* Plane Listener Representation. Each listener accepts planes on its own
+ * socket (all sharing this airport's port) from its own thread. */
+typedef struct {
+    int serverEnd;
+    int cpu; // as per accept_cpu()
+    ConnectingPlane* planeTemplate;
+} PlaneListener;
+
+/* Takes in this airport's (validated) ID, the mapper(s), and this airport's
+ * port number. This function connects to the mapper owning said ID (see
+ * route_to_mapper()), registers the ID and port of this airport, and returns
+ * the appropriate exit code. */
+ControlExitCodes register_with_mapper(char* id, MapperRing* mappers,
 	int thisPortNumber);
 
-/* Takes in the listening socket and this airport's information. Waits for and
- * acts on incoming connections by planes. This function should ideally never
+/* Takes in the hosted airports, the number of said airports and the
+ * mapper(s). Registers every airport in one bulk registration ('*') per
+ * mapper, each holding the airports said mapper owns (see
+ * route_to_mapper()). Returns the appropriate exit code. */
+ControlExitCodes register_hosts_with_mapper(HostedAirport* hosts,
+	int numHosts, MapperRing* mappers);
+
+/* Takes in a registration session. Connects to the mapper, registers this
+ * airport with a lease and starts a thread to maintain the session (see
+ * maintain_mapper_session()). Returns the appropriate exit code. */
+ControlExitCodes start_mapper_session(MapperSession* session);
+
+/* Takes in a registration session. Connects to the mapper and registers this
+ * airport with a lease ('~'), keeping the connection open. Returns the
+ * appropriate exit code. */
+ControlExitCodes connect_mapper_session(MapperSession* session);
+
+/* Takes in a registration session. Checks (and returns) if the connection to
+ * the mapper is still open, i.e. the mapper has not closed its end. */
+bool mapper_session_alive(MapperSession* session);
+
+/* Takes in a registration session. Renews the lease every heartbeat interval,
+ * reconnecting (and thus re-registering) whenever the connection to the
+ * mapper is lost. Never returns. */
+void* maintain_mapper_session(void* mapperSession);
+
+/* Takes in the listening sockets (all bound to the same port), the number of
+ * said sockets, this airport's information and whether to profile the lock
+ * (--lockprof). Waits for and acts on incoming connections by planes on
+ * every socket (see accept_planes()). This function should ideally never
  * return as it will continuously accept plane connections, thus running until
  * killed. It may return prematurely should any error(s) arise, in which case
  * the program will terminate. 
@@ -77,19 +229,61 @@ ControlExitCodes register_with_mapper(char* id, char* mapperPort,
  * called said function and what the function should do in the given case)
  * were explored, and overall it was deemed to be better design to keep these
  * functions separate. */
-void handle_planes(int serverEnd, char* controlInfo);
+void handle_planes(int* serverEnds, int numListeners, char* controlInfo,
+	bool profileLock);
+
+/* Takes in the path of a hosts file ("-" for stdin), the mapper port(s) (NULL
+ * if not given) and whether to profile the lock. Hosts every airport in said
+ * file from this process, each registered with the mapper (if given). Should
+ * ideally never return, otherwise returns the appropriate exit code. */
+int serve_hosts(char* hostsPath, char* mapperPorts, bool profileLock);
+
+/* Takes in the path of a hosts file ("-" for stdin), an empty space to store
+ * the number of airports and an empty space to store the exit code. Reads
+ * one airport per line as ID:info (blank lines ignored). Returns said
+ * airports, or NULL (with the exit code set) if the file cannot be read or
+ * holds an invalid (or repeated) airport. */
+HostedAirport* read_hosts(char* path, int* numHosts,
+	ControlExitCodes* error);
+
+/* Takes in the hosted airports and the number of said airports. Opens a
+ * listening socket on an ephemeral port for each airport and displays each
+ * airport's ID and port (as ID:port). Returns if every socket was opened. */
+bool open_hosted_listeners(HostedAirport* hosts, int numHosts);
+
+/* Takes in the hosted airports (each listening), the number of said airports
+ * and whether to profile the lock (--lockprof). Initialises each airport's
+ * plane IDs, all sharing one set of statistics, and accepts planes for every
+ * airport (see accept_hosted_planes()). Should ideally never return, as per
+ * handle_planes(). */
+void host_airports(HostedAirport* hosts, int numHosts, bool profileLock);
+
+/* Takes in the hosted airports and the number of said airports. Waits (via
+ * epoll) on the listening socket of every airport from this single thread,
+ * handing each accepted plane to its own thread (see start_plane()).
+ * Returns only on error. */
+void accept_hosted_planes(HostedAirport* hosts, int numHosts);
+
+/* Takes in the connecting plane representation of an airport and an
+ * accepted connection. Starts a thread handling said connection (see
+ * each_plane()) with its own copy of said representation. Returns if the
+ * thread was started (otherwise the connection is closed). */
+bool start_plane(ConnectingPlane* planeTemplate, int connectionWrite);
 
-/* Takes in the thread lock, the initial number of planes that can connect to
- * this airport, and the info about this airport. Allocates memory for each
- * connecting plane representation and returns said representations. */
-ConnectingPlane* init_connecting_planes(sem_t* lock, int numPlanes,
-	char* controlInfo);
+/* Takes in a plane listener. Pins the calling thread to the listener's CPU
+ * (if any), then accepts planes on the listener's socket, handing each to
+ * its own thread (see each_plane()). Returns only on error. */
+void* accept_planes(void* thisListener);
 
-/* Takes in the connecting plane representations, the number of said
- * representations, and the thread lock. If required, reallocates more memory
- * to store more connecting plane representations. */
-void resize_connecting_planes(ConnectingPlane** planes, int* numPlanes,
-	sem_t* lock);
+/* Takes in the thread lock, the info about this airport and the statistics
+ * to update (NULL to create them). Allocates the shared plane IDs and
+ * arrival stack, and returns a connecting plane representation to be copied
+ * for each connection. NOTE: every accepted connection receives its own copy
+ * (free'd by each_plane() once the plane disconnects), as handing out
+ * pointers into a reallocated array would leave running threads pointing at
+ * free'd memory. */
+ConnectingPlane* init_connecting_planes(sem_t* lock, char* controlInfo,
+	ServerStats* stats);
 
 /* Takes in a connecting plane's representation. Listens and processes any
  * commands given by the plane.
@@ -109,23 +303,83 @@ void resize_connecting_planes(ConnectingPlane** planes, int* numPlanes,
  * functions separate. */
 void* each_plane(void* thisPlane);
 
+/* Takes in a connecting plane's representation, both ends of the network
+ * communication (the binary magic already read) and the number of the
+ * connection (see capture_connection()). Serves arrival frames (see
+ * read_frame()), each replied to with a FRAME_INFO, until the plane
+ * disconnects. Frames of any other type, or with an invalid plane ID, are
+ * ignored. */
+void serve_binary_planes(ConnectingPlane* thisPlane, FILE* readEnd,
+	FILE** writeEnd, uint32_t connectionId);
+
 /* Takes in the plane's command, the plane's representation, and the output
  * stream of the connection with said plane. Executes the appropriate action
- * based on the given command. Entry point for all command processing. NOTE:
- * this function will terminate the program if an invalid plane ID is given */
-void handle_command(char* command, ConnectingPlane* thisPlane,
+ * based on the given command (see is_control_command()) and returns the
+ * type of said command. Entry point for all command processing. Only the log
+ * (and the visit analytics) require the lock - arrivals are pushed via
+ * push_arrival(). NOTE: this function will terminate the program if an
+ * invalid plane ID is given */
+PlaneCommand handle_command(char* command, ConnectingPlane* thisPlane,
 	FILE** writeEnd);
 
-/* Takes in the connecting plane's representation, and the write end of the
- * network communication. Displays the plane IDs in lexicographic order. */
-void display_plane_ids(ConnectingPlane* thisPlane, FILE** writeEnd);
+/* Takes in a connecting plane's representation and the id of the arriving
+ * plane. Pushes a copy of said id onto the shared arrival stack without
+ * taking the lock (compare-and-swap on the stack head), such that arrivals
+ * never wait on a log being sorted. Returns if the arrival was recorded
+ * (it is dropped, with an error, should allocation fail). */
+bool push_arrival(ConnectingPlane* thisPlane, char* planeId);
+
+/* Takes in a connecting plane's representation. Detaches every pending
+ * arrival from the arrival stack and adds them (in order of arrival) to the
+ * plane IDs. NOTE: the lock must be held by the caller. */
+void drain_arrivals(ConnectingPlane* thisPlane);
+
+/* Takes in the connecting plane's representation (whilst holding the lock)
+ * and an empty space to store the number of plane IDs. Returns a copy of
+ * each plane ID, such that the copy can be used once the lock is released. */
+char** snapshot_plane_ids(ConnectingPlane* thisPlane, int* numPlaneIds);
+
+/* Takes in (and frees) a copy of the plane IDs (see snapshot_plane_ids()),
+ * the number of plane IDs, and the write end of the network communication.
+ * Displays said plane IDs in lexicographic order. */
+void display_plane_ids(char** planeIds, int numPlaneIds, FILE** writeEnd);
+
+/* Takes in the connecting plane's representation, the write end of the
+ * network communication and the command (:stats, :lockprof or :memory).
+ * Displays the control's statistics (see display_stats()), lock profile
+ * (see display_lock_profile()) or memory (see display_memory()) followed by
+ * a line containing a single '.'. NOTE: the lock is not required. */
+void display_control_stats(ConnectingPlane* thisPlane, FILE** writeEnd,
+	PlaneCommand command);
 
-/* Takes in a connecting plane's representation and sorts all plane IDs known
- * by control in lexicographic order. */
-void sort_plane_ids(ConnectingPlane* thisPlane);
+/* Takes in plane IDs (see snapshot_plane_ids()) and the number of plane IDs.
+ * Sorts said plane IDs in lexicographic order. */
+void sort_plane_ids(char** planeIds, int numPlaneIds);
+
+/* Allocates and returns empty visit counts, or NULL if memory ran out. */
+VisitCounts* init_visit_counts(void);
+
+/* Takes in visit counts and a plane ID. Returns the visit count of said
+ * plane, or NULL if it has never visited. */
+PlaneVisits* find_visits(VisitCounts* visits, char* planeId);
+
+/* Takes in visit counts (NULL counts nothing) and the ID of a visiting plane.
+ * Counts the visit, adding said plane if new. Returns false, leaving the
+ * counts as they were, if memory ran out. */
+bool count_visit(VisitCounts* visits, char* planeId);
+
+/* Takes in the connecting plane's representation, a ":top K" or ":visits
+ * ID" command and the write end of the network communication. Displays (after
+ * draining any pending arrivals) the K planes with the most visits, as
+ * ID:count lines from the most (ties in no particular order) followed by a
+ * line containing a single '.', or the number of visits of the given plane
+ * (0 if none). NOTE: the lock must be held by the caller. */
+void display_visits(ConnectingPlane* thisPlane, char* command,
+	FILE** writeEnd);
 
 /* Takes in this connecting plane's representation and the id of the plane.
- * Adds said plane id and reallocates more memory if required. */
+ * Adds said plane id (counting the visit) and reallocates more memory if
+ * required. */
 void add_plane_id(ConnectingPlane* thisPlane, char* planeIdToAdd);
 
 /* Helper function for add_plane_id(). Takes in a connecting plane's
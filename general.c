@@ -1,17 +1,101 @@
+#define _GNU_SOURCE // for CPU affinity
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
 #include "errors.h"
 #include "general.h"
 
+/* Tracing state, shared by every thread of the process (see
+ * enable_tracing()). The rings form a lock-free list, pushed to by
+ * thread_trace_ring(). */
+static bool tracing = false;
+static char* tracePath = NULL;
+static TraceRing* traceRings = NULL;
+static __thread TraceRing* threadTraceRing = NULL;
+static pthread_key_t traceRingKey;
+static pthread_once_t traceRingKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Memory accounting state (see tracked_malloc()). Counters are atomic, such
+ * that allocating takes no lock. */
+static char** memoryNames = NULL;
+static int numMemoryCategories = 0;
+static unsigned long memoryBytes[MAX_MEMORY_CATEGORIES];
+static unsigned long memoryPeaks[MAX_MEMORY_CATEGORIES];
+static unsigned long trackedBytes = 0;
+static unsigned long trackedPeak = 0;
+
+/* Capture state (see enable_capture()). Records are appended under
+ * captureLock, such that each is written whole. */
+static FILE* captureFile = NULL;
+static pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+static long long captureStart;
+static uint32_t captureConnections = 0;
+
+/* Deadline state (see enable_deadlines()). The reaper walks the watched
+ * connections under watchLock, which is also held to add or remove one. */
+static long long idleDeadline = 0; // nanoseconds, 0 for none
+static long long requestDeadline = 0;
+static WatchedConnection* watchedConnections = NULL;
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connect policy (see enable_connect_policy()), used by setup_client(). */
+static int connectTimeout = 0; // milliseconds, 0 for none
+static int connectRetries = 0;
+static long long connectDeadline = 0; // nanoseconds, 0 for none
+static unsigned int backoffSeed;
+
+/* Names of the program's options (see declare_options()), NULL unless
+ * declared. */
+static const char** knownOptions = NULL;
+
+/* CPU sets of the accepting and worker threads (see enable_cpu_sets()), each
+ * only used whilst it holds any CPUs. */
+static cpu_set_t acceptCpus;
+static cpu_set_t workerCpus;
+static int numAcceptCpus = 0;
+static int numWorkerCpus = 0;
+
 int* setup_server(uint16_t* thisPortNumber) {
+    return setup_listeners(thisPortNumber, 1);
+}
+
+int* setup_listeners(uint16_t* thisPortNumber, int numListeners) {
+    int* serverEnds = (int*)malloc(numListeners * sizeof(int));
+
+    // Every listener after the first binds to the port chosen by the first,
+    // which requires SO_REUSEPORT on all of them (including the first)
+    for (int listener = 0; listener < numListeners; listener++) {
+	serverEnds[listener] = open_listener(thisPortNumber,
+		numListeners > 1);
+	if (serverEnds[listener] == ERROR_RETURN) {
+	    for (int opened = 0; opened < listener; opened++) {
+		close(serverEnds[opened]);
+	    }
+	    free(serverEnds);
+	    return NULL;
+	}
+    }
+    printf("%u\n", *thisPortNumber); // display port number
+    fflush(stdout);
+
+    return serverEnds;
+}
+
+int open_listener(uint16_t* thisPortNumber, bool sharePort) {
     struct addrinfo* ai = NULL;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -21,43 +105,53 @@ int* setup_server(uint16_t* thisPortNumber) {
 
     if (getaddrinfo("localhost", NULL, &hints, &ai)) {
 	freeaddrinfo(ai);
-	return NULL;
+	return ERROR_RETURN;
     }
 
-    int* serverEnd = (int*)malloc(sizeof(int));
-    if ((*serverEnd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL)) ==
+    int serverEnd;
+    if ((serverEnd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL)) ==
 	    ERROR_RETURN) {
 	freeaddrinfo(ai);
-	free(serverEnd);
-	return NULL;
+	return ERROR_RETURN;
+    }
+
+    // A fixed port allows a restarted server to be found again by its
+    // clients, so allow it to be re-bound whilst old connections linger
+    int reuse = 1;
+    if (*thisPortNumber != 0) {
+	setsockopt(serverEnd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+		sizeof(int));
+	((struct sockaddr_in*)ai->ai_addr)->sin_port = htons(*thisPortNumber);
     }
-    if (bind(*serverEnd, (struct sockaddr*)ai->ai_addr,
+
+    // Sharing the port lets the kernel balance new connections across each
+    // listener bound to it
+    if ((sharePort && setsockopt(serverEnd, SOL_SOCKET, SO_REUSEPORT,
+	    &reuse, sizeof(int))) ||
+	    bind(serverEnd, (struct sockaddr*)ai->ai_addr,
 	    sizeof(struct sockaddr))) {
 	freeaddrinfo(ai);
-	free(serverEnd);
-	return NULL;
+	close(serverEnd);
+	return ERROR_RETURN;
     }
     freeaddrinfo(ai); // no need for ai anymore
 
     struct sockaddr_in internetAddress;
     socklen_t lengthOfSocket = sizeof(struct sockaddr_in);
     memset(&internetAddress, 0, lengthOfSocket);
-    if (getsockname(*serverEnd, (struct sockaddr*)&internetAddress,
+    if (getsockname(serverEnd, (struct sockaddr*)&internetAddress,
 	    &lengthOfSocket)) {
-	free(serverEnd);
-	return NULL;
+	close(serverEnd);
+	return ERROR_RETURN;
     }
 
     int numConnections = get_num_connections();
     if (numConnections == UNSPECIFIED_ERROR ||
-	    listen(*serverEnd, numConnections)) {
-	free(serverEnd);
-	return NULL;
+	    listen(serverEnd, numConnections)) {
+	close(serverEnd);
+	return ERROR_RETURN;
     }
     *thisPortNumber = ntohs(internetAddress.sin_port);
-    printf("%u\n", *thisPortNumber); // display port number
-    fflush(stdout);
-
     return serverEnd;
 }
 
@@ -68,26 +162,129 @@ int setup_client(char* portToConnectTo, int* thisEnd, bool controlCalled) {
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
+    long long started = trace_begin();
     if (getaddrinfo("localhost", portToConnectTo, &hints, &ai)) {
 	freeaddrinfo(ai);
 	return (controlCalled) ? CONTROL_MAPPER : ROC_MAPPER_CONNECT;
     }
+    trace_end("getaddrinfo", "connect", started);
 
-    if ((*thisEnd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL)) ==
-	    ERROR_RETURN) {
-	freeaddrinfo(ai);
-        return (controlCalled) ? CONTROL_MAPPER : ROC_MAPPER_CONNECT;
-    }
-    
-    if (connect(*thisEnd, (struct sockaddr*)ai->ai_addr,
-	    sizeof(struct sockaddr)) == ERROR_RETURN) {
-	freeaddrinfo(ai);
-	return (controlCalled) ? CONTROL_MAPPER : ROC_MAPPER_CONNECT;
+    // Each failed attempt is retried after a jittered backoff (between half
+    // and all of the current backoff), which doubles each time
+    int backoff = MIN_BACKOFF;
+    for (int attempt = 0; ; attempt++) {
+	started = trace_begin();
+	*thisEnd = connect_within(ai);
+	if (*thisEnd != ERROR_RETURN) {
+	    trace_end("connect", "connect", started);
+	    break;
+	}
+	int delay = backoff / 2 + rand_r(&backoffSeed) % (backoff / 2 + 1);
+	long long remaining = connect_time_remaining();
+	if (attempt >= connectRetries || (remaining != ERROR_RETURN &&
+		delay >= remaining)) {
+	    freeaddrinfo(ai);
+	    return (controlCalled) ? CONTROL_MAPPER : ROC_MAPPER_CONNECT;
+	}
+	usleep(delay * 1000);
+	backoff = (backoff * 2 < MAX_BACKOFF) ? backoff * 2 : MAX_BACKOFF;
     }
     freeaddrinfo(ai);
     return (controlCalled) ? CONTROL_NORMAL : ROC_NORMAL;
 }
 
+void enable_connect_policy(int timeout, int retries, int deadline) {
+    connectTimeout = timeout;
+    connectRetries = retries;
+    connectDeadline = (deadline) ? monotonic_nanoseconds() +
+	    deadline * 1000000LL : 0;
+    backoffSeed = getpid() ^ monotonic_nanoseconds();
+}
+
+long long connect_time_remaining(void) {
+    if (!connectDeadline) {
+	return ERROR_RETURN;
+    }
+    long long remaining = (connectDeadline - monotonic_nanoseconds()) /
+	    1000000;
+    return (remaining > 0) ? remaining : 0;
+}
+
+int connect_within(struct addrinfo* ai) {
+    // Bounded by both the per connection timeout and the overall deadline
+    long long wait = connect_time_remaining();
+    if (connectTimeout && (wait == ERROR_RETURN || connectTimeout < wait)) {
+	wait = connectTimeout;
+    }
+    if (!wait) {
+	return ERROR_RETURN; // the deadline has passed
+    }
+    int thisEnd = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+    if (thisEnd == ERROR_RETURN) {
+	return ERROR_RETURN;
+    }
+    if (wait == ERROR_RETURN) {
+	if (connect(thisEnd, (struct sockaddr*)ai->ai_addr,
+		sizeof(struct sockaddr)) == ERROR_RETURN) {
+	    close(thisEnd);
+	    return ERROR_RETURN;
+	}
+	return thisEnd;
+    }
+
+    // Connected without blocking, then waited upon for at most wait
+    int flags = fcntl(thisEnd, F_GETFL);
+    fcntl(thisEnd, F_SETFL, flags | O_NONBLOCK);
+    int connectError = 0;
+    if (connect(thisEnd, (struct sockaddr*)ai->ai_addr,
+	    sizeof(struct sockaddr)) == ERROR_RETURN) {
+	struct pollfd connecting = {thisEnd, POLLOUT, 0};
+	socklen_t errorLength = sizeof(int);
+	if (errno != EINPROGRESS || poll(&connecting, 1, wait) != 1 ||
+		getsockopt(thisEnd, SOL_SOCKET, SO_ERROR, &connectError,
+		&errorLength) == ERROR_RETURN) {
+	    connectError = ERROR_RETURN;
+	}
+    }
+    if (connectError) {
+	close(thisEnd);
+	return ERROR_RETURN;
+    }
+    fcntl(thisEnd, F_SETFL, flags);
+
+    // Each send and receive of the connection is bounded likewise
+    struct timeval ioTimeout = {wait / 1000, wait % 1000 * 1000};
+    setsockopt(thisEnd, SOL_SOCKET, SO_RCVTIMEO, &ioTimeout,
+	    sizeof(struct timeval));
+    setsockopt(thisEnd, SOL_SOCKET, SO_SNDTIMEO, &ioTimeout,
+	    sizeof(struct timeval));
+    return thisEnd;
+}
+
+bool open_streams(int thisEnd, FILE** writeEnd, FILE** readEnd) {
+    int readingEnd = dup(thisEnd);
+    *writeEnd = fdopen(thisEnd, "w");
+    *readEnd = (readingEnd == ERROR_RETURN) ? NULL : fdopen(readingEnd, "r");
+    if (*writeEnd && *readEnd) {
+	return true;
+    }
+
+    // Close whichever stream opened, and the descriptor of any other
+    if (*writeEnd) {
+	fclose(*writeEnd);
+    } else {
+	close(thisEnd);
+    }
+    if (*readEnd) {
+	fclose(*readEnd);
+    } else if (readingEnd != ERROR_RETURN) {
+	close(readingEnd);
+    }
+    *writeEnd = NULL;
+    *readEnd = NULL;
+    return false;
+}
+
 int get_num_connections(void) {
     // Stores maximum number of possible server connections
     FILE* maxConnectionsFile = fopen("/proc/sys/net/core/somaxconn", "r");
@@ -164,3 +361,1024 @@ bool check_invalid_chars(char* stringToCheck) {
 	    character_counter(stringToCheck, '\n') ||
 	    character_counter(stringToCheck, '\r'));
 }
+
+void declare_options(const char** names) {
+    knownOptions = names;
+}
+
+/* Helper function for get_option() and unknown_options(). Takes in a
+ * command line argument. Returns if said argument is an option: it begins
+ * with "--" (but is not "--") and, should the options have been declared
+ * (see declare_options()), names one of them. */
+static bool is_option(char* argument) {
+    size_t prefixLength = strlen(OPTION_PREFIX);
+    if (strncmp(argument, OPTION_PREFIX, prefixLength) ||
+	    !strcmp(argument, OPTION_PREFIX)) {
+	return false;
+    }
+    if (!knownOptions) {
+	return true;
+    }
+    char* name = argument + prefixLength;
+    char* separator = strchr(name, OPTION_VALUE_SEPARATOR);
+    size_t nameLength = (separator) ? separator - name : strlen(name);
+    for (int option = 0; knownOptions[option]; option++) {
+	if (strlen(knownOptions[option]) == nameLength &&
+		!strncmp(knownOptions[option], name, nameLength)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+char* get_option(int* argc, char** argv, const char* name) {
+    size_t prefixLength = strlen(OPTION_PREFIX);
+    size_t nameLength = strlen(name);
+
+    // Options precede all other arguments, stop at the first non-option
+    for (int arg = 1; arg < *argc && is_option(argv[arg]); arg++) {
+	char* option = argv[arg] + prefixLength;
+	if (strncmp(option, name, nameLength) ||
+		(option[nameLength] != '\0' &&
+		option[nameLength] != OPTION_VALUE_SEPARATOR)) {
+	    continue;
+	}
+	char* value = (option[nameLength] == '\0') ? option + nameLength :
+		option + nameLength + 1;
+
+	// Remove the option such that the remaining arguments are indexed
+	// exactly as they would be without any options
+	for (int next = arg; next < *argc - 1; next++) {
+	    argv[next] = argv[next + 1];
+	}
+	(*argc)--;
+	return value;
+    }
+    return NULL;
+}
+
+bool unknown_options(int* argc, char** argv) {
+    if (*argc > 1 && !strcmp(argv[1], OPTION_PREFIX)) {
+	for (int next = 1; next < *argc - 1; next++) {
+	    argv[next] = argv[next + 1];
+	}
+	(*argc)--;
+	return false;
+    }
+    return *argc > 1 && is_option(argv[1]);
+}
+
+bool option_to_int(char* value, int min, int max, int* result) {
+    char* valueErrors;
+    long converted = strtol(value, &valueErrors, 10);
+    if (strtol_invalid(value, valueErrors) || converted < min ||
+	    converted > max) {
+	return false;
+    }
+    *result = (int)converted;
+    return true;
+}
+
+bool is_control_command(char* command) {
+    if (!strcmp(command, "log")) {
+	return true;
+    }
+    size_t prefixLength = strlen(CONTROL_COMMAND_PREFIX);
+    if (strncmp(command, CONTROL_COMMAND_PREFIX, prefixLength)) {
+	return false;
+    }
+    command += prefixLength;
+    return !strcmp(command, "stats") || !strcmp(command, "lockprof") ||
+	    !strcmp(command, "memory") || !strncmp(command, "top ", 4) ||
+	    !strncmp(command, "visits ", 7);
+}
+
+uint32_t hash_id(const char* id) {
+    uint32_t hash = 2166136261u; // FNV offset basis
+    for (int character = 0; id[character] != '\0'; character++) {
+	hash ^= (unsigned char)id[character];
+	hash *= 16777619u; // FNV prime
+    }
+
+    // FNV alone scatters similar short strings (e.g. "2310#1", "2310#2")
+    // poorly, so finish with the MurmurHash3 mixing step
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+uint32_t filter_bit(const char* id, int hash, uint32_t numBits) {
+    // Double hashing: the ith hash steps i times from the first by a second
+    // (odd, hence reaching every bit) hash derived from it
+    uint32_t first = hash_id(id);
+    uint32_t step = ((first >> 17) | (first << 15)) * 0x9e3779b1u;
+    return (first + hash * (step | 1)) & (numBits - 1);
+}
+
+bool filter_may_contain(const unsigned char* bits, uint32_t numBits,
+	const char* id) {
+    for (int hash = 0; hash < FILTER_HASHES; hash++) {
+	uint32_t bit = filter_bit(id, hash, numBits);
+	if (!(bits[bit / 8] & (1 << (bit % 8)))) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+char** parse_port_list(char* portList, int* numPorts) {
+    *numPorts = character_counter(portList, PORT_LIST_SEPARATOR[0]) + 1;
+    char** ports = (char**)malloc(*numPorts * sizeof(char*));
+    char* listCopy = strdup(portList);
+    char* savePointer;
+    int port = 0;
+
+    for (char* token = strtok_r(listCopy, PORT_LIST_SEPARATOR, &savePointer);
+	    token != NULL && port < *numPorts;
+	    token = strtok_r(NULL, PORT_LIST_SEPARATOR, &savePointer)) {
+	int portNumber;
+	if (!option_to_int(token, PORT_MIN, PORT_MAX, &portNumber)) {
+	    break;
+	}
+
+	// Normalised (e.g. 024001 to 24001), such that every client places
+	// a mapper at the same ring points however its port was typed
+	ports[port] = (char*)malloc(PORT_STRING_SIZE * sizeof(char));
+	snprintf(ports[port++], PORT_STRING_SIZE, "%d", portNumber);
+    }
+    free(listCopy);
+
+    // strtok_r() skips empty tokens, hence a port count mismatch also
+    // catches lists such as "2310,,2311"
+    if (port != *numPorts) {
+	free_port_list(ports, port);
+	return NULL;
+    }
+    return ports;
+}
+
+void free_port_list(char** ports, int numPorts) {
+    for (int port = 0; port < numPorts; port++) {
+	free(ports[port]);
+    }
+    free(ports);
+}
+
+/* qsort() comparison function for ring points. */
+static int compare_ring_points(const void* first, const void* second) {
+    uint32_t firstHash = ((const RingPoint*)first)->hash;
+    uint32_t secondHash = ((const RingPoint*)second)->hash;
+    return (firstHash > secondHash) - (firstHash < secondHash);
+}
+
+MapperRing* build_mapper_ring(char* mapperPorts) {
+    int numMappers;
+    char** ports = parse_port_list(mapperPorts, &numMappers);
+    if (!ports) {
+	return NULL;
+    }
+    MapperRing* ring = (MapperRing*)malloc(sizeof(MapperRing));
+    ring->mapperPorts = ports;
+    ring->numMappers = numMappers;
+    ring->numPoints = numMappers * VIRTUAL_NODES;
+    ring->points = (RingPoint*)malloc(ring->numPoints * sizeof(RingPoint));
+
+    // Each virtual node is placed at the hash of "port#node"
+    char pointName[INITIAL_BUFFER_SIZE];
+    for (int mapper = 0; mapper < numMappers; mapper++) {
+	for (int node = 0; node < VIRTUAL_NODES; node++) {
+	    snprintf(pointName, INITIAL_BUFFER_SIZE, "%s#%d", ports[mapper],
+		    node);
+	    ring->points[mapper * VIRTUAL_NODES + node].hash =
+		    hash_id(pointName);
+	    ring->points[mapper * VIRTUAL_NODES + node].mapper = mapper;
+	}
+    }
+    qsort(ring->points, ring->numPoints, sizeof(RingPoint),
+	    compare_ring_points);
+    return ring;
+}
+
+char* route_to_mapper(MapperRing* ring, char* id) {
+    uint32_t hash = hash_id(id);
+
+    // Binary search for the first point at or after the hash
+    int low = 0;
+    int high = ring->numPoints;
+    while (low < high) {
+	int middle = low + (high - low) / 2;
+	if (ring->points[middle].hash < hash) {
+	    low = middle + 1;
+	} else {
+	    high = middle;
+	}
+    }
+    return ring->mapperPorts[ring->points[low % ring->numPoints].mapper];
+}
+
+void free_mapper_ring(MapperRing* ring) {
+    free_port_list(ring->mapperPorts, ring->numMappers);
+    free(ring->points);
+    free(ring);
+}
+
+long long milliseconds_since_epoch(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+long long monotonic_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void stat_add(unsigned long* counter, long amount) {
+    // Statistics are never used to synchronise, so relaxed ordering suffices
+    __atomic_fetch_add(counter, (unsigned long)amount, __ATOMIC_RELAXED);
+}
+
+ServerStats* init_stats(char* entriesName, char** holderNames,
+	int numCommandNames, int numHolderNames, bool profileLock) {
+    ServerStats* stats = (ServerStats*)calloc(1, sizeof(ServerStats));
+    stats->entriesName = entriesName;
+    stats->holderNames = holderNames;
+    stats->numCommandNames = numCommandNames;
+    stats->numHolderNames = numHolderNames;
+    stats->profileLock = profileLock;
+    return stats;
+}
+
+void record_latency(LatencyHistogram* histogram, long long nanoseconds) {
+    long long microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (bucket < NUM_LATENCY_BUCKETS - 1 &&
+	    microseconds >= (1LL << bucket)) {
+	bucket++;
+    }
+    stat_add(&histogram->count, 1);
+    stat_add(&histogram->totalMicroseconds, microseconds);
+    stat_add(histogram->buckets + bucket, 1);
+}
+
+void record_command(ServerStats* stats, int commandType, long long started) {
+    if (commandType < 0 || commandType >= MAX_STAT_COMMANDS) {
+	return;
+    }
+    record_latency(stats->latencies + commandType,
+	    monotonic_nanoseconds() - started);
+    if (tracing && stats->holderNames[commandType]) {
+	trace_end(stats->holderNames[commandType], "process", started);
+    }
+}
+
+long long stats_guard_wait(sem_t* guard, ServerStats* stats, int holder) {
+    long long waiting = monotonic_nanoseconds();
+    sem_wait(guard);
+    long long acquired = monotonic_nanoseconds();
+    if (tracing) {
+	trace_end("lock_acquire", "lock", waiting);
+    }
+    stat_add(&stats->guardAcquisitions, 1);
+    stat_add(&stats->guardWaitNanoseconds, acquired - waiting);
+    if (stats->profileLock && holder >= 0 && holder < MAX_STAT_COMMANDS) {
+	record_latency(stats->lockWaits + holder, acquired - waiting);
+    }
+    return acquired;
+}
+
+void stats_guard_post(sem_t* guard, ServerStats* stats, int holder,
+	long long acquired) {
+    long long held = monotonic_nanoseconds() - acquired;
+    sem_post(guard);
+    stat_add(&stats->guardHoldNanoseconds, held);
+    if (stats->profileLock && holder >= 0 && holder < MAX_STAT_COMMANDS) {
+	record_latency(stats->lockHolds + holder, held);
+    }
+}
+
+/* Helper function for counted_read() and counted_write(). Takes in a
+ * connection's watch and whether bytes were just read. Records the activity
+ * and, if said bytes begin a request, when said request started. */
+static void record_activity(WatchedConnection* watch, bool read) {
+    long long now = monotonic_nanoseconds();
+    __atomic_store_n(&watch->lastActivity, now, __ATOMIC_RELAXED);
+    if (read && !__atomic_load_n(&watch->requestStarted, __ATOMIC_RELAXED)) {
+	__atomic_store_n(&watch->requestStarted, now, __ATOMIC_RELAXED);
+    }
+}
+
+/* fopencookie() read function of counted_fdopen(). */
+static ssize_t counted_read(void* cookie, char* buffer, size_t size) {
+    CountedStream* stream = (CountedStream*)cookie;
+    long long started = trace_begin();
+    ssize_t numRead = read(stream->fd, buffer, size);
+    trace_end("read", "wait", started);
+    if (numRead > 0) {
+	stat_add(stream->byteCounter, numRead);
+	if (stream->watch) {
+	    record_activity(stream->watch, true);
+	}
+    }
+    return numRead;
+}
+
+/* fopencookie() write function of counted_fdopen(). */
+static ssize_t counted_write(void* cookie, const char* buffer, size_t size) {
+    CountedStream* stream = (CountedStream*)cookie;
+    long long started = trace_begin();
+    ssize_t numWritten = write(stream->fd, buffer, size);
+    trace_end("write", "flush", started);
+    if (numWritten > 0) {
+	stat_add(stream->byteCounter, numWritten);
+	if (stream->watch) {
+	    record_activity(stream->watch, false);
+	}
+    }
+    return numWritten;
+}
+
+/* fopencookie() close function of counted_fdopen(). */
+static int counted_close(void* cookie) {
+    CountedStream* stream = (CountedStream*)cookie;
+    int closed = close(stream->fd);
+    free(stream);
+    return closed;
+}
+
+FILE* counted_fdopen(int fd, const char* mode, unsigned long* byteCounter,
+	WatchedConnection* watch) {
+    CountedStream* stream = (CountedStream*)malloc(sizeof(CountedStream));
+    stream->fd = fd;
+    stream->byteCounter = byteCounter;
+    stream->watch = watch;
+    cookie_io_functions_t functions = {counted_read, counted_write, NULL,
+	    counted_close};
+    FILE* counted = fopencookie(stream, mode, functions);
+    if (!counted) {
+	free(stream);
+    }
+    return counted;
+}
+
+FILE* open_listing(FILE* writeEnd, char** buffer, size_t* size) {
+    *buffer = NULL;
+    *size = 0;
+    FILE* listing = open_memstream(buffer, size);
+    return (listing) ? listing : writeEnd;
+}
+
+void send_listing(FILE* listing, char** buffer, size_t* size,
+	FILE* writeEnd) {
+    if (listing != writeEnd) {
+	fclose(listing);
+	fwrite(*buffer, sizeof(char), *size, writeEnd);
+	free(*buffer);
+    }
+    fflush(writeEnd);
+}
+
+void track_memory(char** names, int numCategories) {
+    memoryNames = names;
+    numMemoryCategories = numCategories;
+}
+
+/* Helper function for the tracked allocations. Takes in a counter of tracked
+ * bytes, its high-water mark and the amount to add (which may be negative).
+ * Adds said amount, raising said mark if exceeded. */
+static void account_bytes(unsigned long* bytes, unsigned long* peak,
+	long amount) {
+    unsigned long now = __atomic_add_fetch(bytes, (unsigned long)amount,
+	    __ATOMIC_RELAXED);
+    unsigned long highest = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (now > highest && !__atomic_compare_exchange_n(peak, &highest,
+	    now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void* tracked_malloc(int category, size_t size) {
+    MemoryHeader* header = (MemoryHeader*)malloc(sizeof(MemoryHeader) +
+	    size);
+    if (!header) {
+	return NULL;
+    }
+    header->tracked.size = size;
+    header->tracked.category = category;
+    account_bytes(memoryBytes + category, memoryPeaks + category, size);
+    account_bytes(&trackedBytes, &trackedPeak, size);
+    return header + 1;
+}
+
+void* tracked_calloc(int category, size_t count, size_t size) {
+    void* memory = tracked_malloc(category, count * size);
+    if (memory) {
+	memset(memory, 0, count * size);
+    }
+    return memory;
+}
+
+void* tracked_realloc(int category, void* memory, size_t size) {
+    if (!memory) {
+	return tracked_malloc(category, size);
+    }
+    MemoryHeader* header = (MemoryHeader*)memory - 1;
+    long change = (long)size - (long)header->tracked.size;
+    header = (MemoryHeader*)realloc(header, sizeof(MemoryHeader) + size);
+    if (!header) {
+	return NULL;
+    }
+    header->tracked.size = size;
+    account_bytes(memoryBytes + header->tracked.category,
+	    memoryPeaks + header->tracked.category, change);
+    account_bytes(&trackedBytes, &trackedPeak, change);
+    return header + 1;
+}
+
+char* tracked_strdup(int category, const char* string) {
+    char* copy = (char*)tracked_malloc(category, strlen(string) + 1);
+    if (copy) {
+	strcpy(copy, string);
+    }
+    return copy;
+}
+
+void tracked_free(void* memory) {
+    if (!memory) {
+	return;
+    }
+    MemoryHeader* header = (MemoryHeader*)memory - 1;
+    long size = header->tracked.size;
+    account_bytes(memoryBytes + header->tracked.category,
+	    memoryPeaks + header->tracked.category, -size);
+    account_bytes(&trackedBytes, &trackedPeak, -size);
+    free(header);
+}
+
+void display_memory(FILE* writeEnd) {
+    for (int category = 0; category < numMemoryCategories; category++) {
+	fprintf(writeEnd, "%s:%lu:%lu\n", memoryNames[category],
+		__atomic_load_n(memoryBytes + category, __ATOMIC_RELAXED),
+		__atomic_load_n(memoryPeaks + category, __ATOMIC_RELAXED));
+    }
+    fprintf(writeEnd, "tracked:%lu:%lu\n",
+	    __atomic_load_n(&trackedBytes, __ATOMIC_RELAXED),
+	    __atomic_load_n(&trackedPeak, __ATOMIC_RELAXED));
+
+    // The second field of statm is the resident set, in pages
+    FILE* statm = fopen("/proc/self/statm", "r");
+    unsigned long numPages;
+    if (statm && fscanf(statm, "%*u %lu", &numPages) == 1) {
+	fprintf(writeEnd, "resident:%lu\n",
+		numPages * sysconf(_SC_PAGESIZE));
+    }
+    if (statm) {
+	fclose(statm);
+    }
+}
+
+void init_token_bucket(TokenBucket* bucket, long long now) {
+    bucket->tokens = bucket->rate;
+    bucket->refilled = now;
+}
+
+bool token_bucket_full(TokenBucket* bucket, long long now) {
+    bucket->tokens += (now - bucket->refilled) * (double)bucket->rate /
+	    1000000000LL;
+    if (bucket->tokens > bucket->rate) {
+	bucket->tokens = bucket->rate;
+    }
+    bucket->refilled = now;
+    return bucket->tokens == bucket->rate;
+}
+
+long long take_token(TokenBucket* bucket, long long now) {
+    token_bucket_full(bucket, now);
+    if (bucket->tokens <= -bucket->rate) {
+	return ERROR_RETURN; // over quota
+    }
+    bucket->tokens--;
+
+    // A token owed is repaid once the bucket has refilled past zero
+    return (bucket->tokens >= 0) ? 0 :
+	    (long long)(-bucket->tokens * 1000000000LL / bucket->rate);
+}
+
+void display_stats(ServerStats* stats, FILE* writeEnd) {
+    fprintf(writeEnd, "connections_active:%lu\nconnections_total:%lu\n"
+	    "bytes_in:%lu\nbytes_out:%lu\n%s:%lu\n"
+	    "guard_acquisitions:%lu\nguard_wait_us:%lu\n"
+	    "guard_hold_us:%lu\nreaped_idle:%lu\nreaped_request:%lu\n"
+	    "throttled_lookups:%lu\nthrottled_listings:%lu\n"
+	    "throttle_rejected:%lu\n",
+	    __atomic_load_n(&stats->activeConnections, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->totalConnections, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->bytesIn, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED),
+	    stats->entriesName,
+	    __atomic_load_n(&stats->storedEntries, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->guardAcquisitions, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->guardWaitNanoseconds,
+	    __ATOMIC_RELAXED) / 1000,
+	    __atomic_load_n(&stats->guardHoldNanoseconds,
+	    __ATOMIC_RELAXED) / 1000,
+	    __atomic_load_n(&stats->reapedIdle, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->reapedRequest, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->throttledLookups, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->throttledListings, __ATOMIC_RELAXED),
+	    __atomic_load_n(&stats->throttleRejected, __ATOMIC_RELAXED));
+
+    for (int command = 0; command < stats->numCommandNames; command++) {
+	if (stats->holderNames[command]) {
+	    display_histogram(stats->latencies + command,
+		    stats->holderNames[command], writeEnd);
+	}
+    }
+}
+
+void display_histogram(LatencyHistogram* histogram, char* name,
+	FILE* writeEnd) {
+    unsigned long count = __atomic_load_n(&histogram->count,
+	    __ATOMIC_RELAXED);
+    fprintf(writeEnd, "%s_count:%lu\n%s_mean_us:%lu\n%s_latency_us:", name,
+	    count, name, (count) ? __atomic_load_n(
+	    &histogram->totalMicroseconds, __ATOMIC_RELAXED) / count : 0,
+	    name);
+
+    // e.g. "1=0,2=5,4=1" (5 took between 1 and 2 microseconds)
+    int lastUsed = 0;
+    for (int bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++) {
+	if (__atomic_load_n(histogram->buckets + bucket, __ATOMIC_RELAXED)) {
+	    lastUsed = bucket;
+	}
+    }
+    for (int bucket = 0; bucket <= lastUsed; bucket++) {
+	fprintf(writeEnd, "%s%lld=%lu", (bucket) ? "," : "", 1LL << bucket,
+		__atomic_load_n(histogram->buckets + bucket,
+		__ATOMIC_RELAXED));
+    }
+    fprintf(writeEnd, "\n");
+}
+
+void display_lock_profile(ServerStats* stats, FILE* writeEnd) {
+    fprintf(writeEnd, "enabled:%d\n", stats->profileLock);
+    char name[INITIAL_BUFFER_SIZE];
+    for (int holder = 0; holder < stats->numHolderNames; holder++) {
+	// Only the holders which have taken the lock are of interest
+	if (!stats->holderNames[holder] || !__atomic_load_n(
+		&stats->lockWaits[holder].count, __ATOMIC_RELAXED)) {
+	    continue;
+	}
+	snprintf(name, INITIAL_BUFFER_SIZE, "%s_wait",
+		stats->holderNames[holder]);
+	display_histogram(stats->lockWaits + holder, name, writeEnd);
+	snprintf(name, INITIAL_BUFFER_SIZE, "%s_hold",
+		stats->holderNames[holder]);
+	display_histogram(stats->lockHolds + holder, name, writeEnd);
+    }
+}
+
+bool block_dump_signals(void) {
+    sigset_t dumpSignals;
+    sigemptyset(&dumpSignals);
+    sigaddset(&dumpSignals, SIGUSR1);
+    sigaddset(&dumpSignals, SIGUSR2);
+    return !pthread_sigmask(SIG_BLOCK, &dumpSignals, NULL);
+}
+
+bool start_signal_dumper(ServerStats* stats) {
+    return block_dump_signals() && start_detached(dump_on_signal, stats);
+}
+
+void* dump_on_signal(void* serverStats) {
+    ServerStats* stats = (ServerStats*)serverStats;
+    sigset_t dumpSignals;
+    sigemptyset(&dumpSignals);
+    sigaddset(&dumpSignals, SIGUSR1);
+    sigaddset(&dumpSignals, SIGUSR2);
+
+    // The signals are blocked in every thread, hence only received here
+    // (where it is safe to display, unlike in a signal handler)
+    int signal;
+    while (!sigwait(&dumpSignals, &signal)) {
+	if (signal == SIGUSR1) {
+	    display_lock_profile(stats, stderr);
+	    fprintf(stderr, ".\n");
+	    fflush(stderr);
+	} else if (tracing && !write_trace()) {
+	    fprintf(stderr, "Failed to write trace to %s\n", tracePath);
+	}
+    }
+    return NULL;
+}
+
+void enable_deadlines(int idleTimeout, int requestTimeout) {
+    idleDeadline = idleTimeout * 1000000000LL;
+    requestDeadline = requestTimeout * 1000000000LL;
+}
+
+bool start_reaper(ServerStats* stats) {
+    if (!idleDeadline && !requestDeadline) {
+	return true;
+    }
+    return start_detached(reap_connections, stats);
+}
+
+void* reap_connections(void* serverStats) {
+    ServerStats* stats = (ServerStats*)serverStats;
+    while (true) {
+	sleep(REAPER_INTERVAL);
+	long long now = monotonic_nanoseconds();
+	pthread_mutex_lock(&watchLock);
+	for (WatchedConnection* watch = watchedConnections; watch;
+		watch = watch->next) {
+	    if (watch->reaped) {
+		continue;
+	    }
+	    long long requestStarted = __atomic_load_n(&watch->requestStarted,
+		    __ATOMIC_RELAXED);
+	    if (requestDeadline && requestStarted &&
+		    now - requestStarted > requestDeadline) {
+		stat_add(&stats->reapedRequest, 1);
+	    } else if (idleDeadline && now - __atomic_load_n(
+		    &watch->lastActivity, __ATOMIC_RELAXED) > idleDeadline) {
+		stat_add(&stats->reapedIdle, 1);
+	    } else {
+		continue;
+	    }
+	    // The connection's own thread is left to close it (whilst it is
+	    // watched, its file descriptor cannot have been reused)
+	    watch->reaped = true;
+	    shutdown(watch->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&watchLock);
+    }
+    return NULL;
+}
+
+WatchedConnection* watch_connection(WatchedConnection* watch, int fd) {
+    watch->fd = fd;
+    watch->lastActivity = monotonic_nanoseconds();
+    watch->requestStarted = 0;
+    watch->watched = false;
+    watch->reaped = false;
+    if (!idleDeadline && !requestDeadline) {
+	return NULL;
+    }
+    pthread_mutex_lock(&watchLock);
+    watch->previous = NULL;
+    watch->next = watchedConnections;
+    if (watchedConnections) {
+	watchedConnections->previous = watch;
+    }
+    watchedConnections = watch;
+    watch->watched = true;
+    pthread_mutex_unlock(&watchLock);
+    return watch;
+}
+
+void unwatch_connection(WatchedConnection* watch) {
+    if (!watch->watched) {
+	return;
+    }
+    pthread_mutex_lock(&watchLock);
+    if (watch->previous) {
+	watch->previous->next = watch->next;
+    } else {
+	watchedConnections = watch->next;
+    }
+    if (watch->next) {
+	watch->next->previous = watch->previous;
+    }
+    watch->watched = false;
+    pthread_mutex_unlock(&watchLock);
+}
+
+void finish_request(WatchedConnection* watch) {
+    __atomic_store_n(&watch->requestStarted, 0, __ATOMIC_RELAXED);
+}
+
+bool enable_capture(char* path, char serverType) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+	return false;
+    }
+    CaptureHeader header;
+    memset(&header, 0, sizeof(CaptureHeader));
+    memcpy(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    header.serverType = serverType;
+    if (fwrite(&header, sizeof(CaptureHeader), 1, file) != 1 ||
+	    fflush(file)) {
+	fclose(file);
+	return false;
+    }
+    captureStart = monotonic_nanoseconds();
+    captureFile = file;
+    return true;
+}
+
+uint32_t capture_connection(void) {
+    if (!captureFile) {
+	return 0;
+    }
+    return __atomic_add_fetch(&captureConnections, 1, __ATOMIC_RELAXED);
+}
+
+/* Helper function for capture_command() and capture_close(). Takes in the
+ * connection, the length of the command (or CAPTURE_CLOSED) and the command
+ * (NULL if closed). Appends the record to the capture. */
+static void capture_record(uint32_t connection, uint32_t length,
+	char* command) {
+    CaptureRecord record;
+    record.connection = connection;
+    record.length = length;
+    pthread_mutex_lock(&captureLock);
+    record.offset = monotonic_nanoseconds() - captureStart;
+    fwrite(&record, sizeof(CaptureRecord), 1, captureFile);
+    if (command) {
+	fwrite(command, sizeof(char), length, captureFile);
+    }
+    fflush(captureFile);
+    pthread_mutex_unlock(&captureLock);
+}
+
+void capture_command(uint32_t connection, char* command) {
+    if (connection) {
+	capture_record(connection, strlen(command), command);
+    }
+}
+
+void capture_close(uint32_t connection) {
+    if (connection) {
+	capture_record(connection, CAPTURE_CLOSED, NULL);
+    }
+}
+
+bool write_frame(FILE* writeEnd, FrameType type, int port, const char* id) {
+    size_t idLength = (id) ? strlen(id) : 0;
+    size_t length = idLength + ((port == ERROR_RETURN) ? 0 : FRAME_PORT_SIZE);
+    if (length > MAX_FRAME_PAYLOAD) {
+	return false;
+    }
+    unsigned char header[FRAME_HEADER_SIZE + FRAME_PORT_SIZE] = {type,
+	    length >> 8, length & 0xFF, (port >> 8) & 0xFF, port & 0xFF};
+    return fwrite(header, sizeof(unsigned char), FRAME_HEADER_SIZE +
+	    ((port == ERROR_RETURN) ? 0 : FRAME_PORT_SIZE), writeEnd) &&
+	    fwrite(id, sizeof(char), idLength, writeEnd) == idLength;
+}
+
+bool read_frame(FILE* readEnd, Frame* frame) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (fread(header, sizeof(unsigned char), FRAME_HEADER_SIZE, readEnd) !=
+	    FRAME_HEADER_SIZE) {
+	return false;
+    }
+    frame->type = header[0];
+    frame->length = (header[1] << 8) | header[2];
+    if (frame->capacity < frame->length + 1) {
+	frame->capacity = frame->length + 1;
+	frame->payload = (char*)realloc(frame->payload, frame->capacity);
+    }
+    if (fread(frame->payload, sizeof(char), frame->length, readEnd) !=
+	    frame->length) {
+	return false;
+    }
+    frame->payload[frame->length] = '\0';
+
+    // Registrations, ports and entries lead with the port
+    frame->port = ERROR_RETURN;
+    frame->id = frame->payload;
+    if (frame->type == FRAME_REGISTER || frame->type == FRAME_PORT ||
+	    frame->type == FRAME_ENTRY) {
+	if (frame->length < FRAME_PORT_SIZE) {
+	    return false;
+	}
+	frame->port = ((unsigned char)frame->payload[0] << 8) |
+		(unsigned char)frame->payload[1];
+	frame->id = frame->payload + FRAME_PORT_SIZE;
+    }
+    // An ID holding a NUL would be silently truncated
+    return strlen(frame->id) == frame->length - (frame->id - frame->payload);
+}
+
+char* frame_to_command(Frame* frame) {
+    char* command = (char*)malloc(frame->length + PORT_STRING_SIZE + 2);
+    switch (frame->type) {
+	case FRAME_QUERY:
+	    sprintf(command, "?%s", frame->id);
+	    return command;
+	case FRAME_REGISTER:
+	    sprintf(command, "!%s:%d", frame->id, frame->port);
+	    return command;
+	case FRAME_LIST:
+	    return strcpy(command, "@");
+	case FRAME_ARRIVAL:
+	    return strcpy(command, frame->id);
+    }
+    free(command);
+    return NULL;
+}
+
+void enable_tracing(char* path) {
+    tracePath = path;
+    tracing = true;
+}
+
+bool tracing_enabled(void) {
+    return tracing;
+}
+
+long long trace_begin(void) {
+    return (tracing) ? monotonic_nanoseconds() : 0;
+}
+
+void trace_end(const char* name, const char* category, long long started) {
+    if (!started) {
+	return; // tracing is disabled
+    }
+    TraceRing* ring = thread_trace_ring();
+    unsigned long numSpans = ring->numSpans;
+    TraceSpan* span = ring->spans + (numSpans % TRACE_RING_SIZE);
+    span->name = name;
+    span->category = category;
+    span->start = started;
+    span->duration = monotonic_nanoseconds() - started;
+    span->threadId = ring->threadId;
+
+    // Publish the span to write_trace() only once it is complete
+    __atomic_store_n(&ring->numSpans, numSpans + 1, __ATOMIC_RELEASE);
+}
+
+/* pthread_key_create() destructor, releasing an exiting thread's ring. */
+static void release_trace_ring(void* ring) {
+    __atomic_store_n(&((TraceRing*)ring)->inUse, false, __ATOMIC_RELEASE);
+}
+
+/* pthread_once() routine creating the key which releases each ring. */
+static void create_trace_ring_key(void) {
+    pthread_key_create(&traceRingKey, release_trace_ring);
+}
+
+TraceRing* thread_trace_ring(void) {
+    if (threadTraceRing) {
+	return threadTraceRing;
+    }
+    pthread_once(&traceRingKeyOnce, create_trace_ring_key);
+
+    // Reuse the ring of an exited thread if possible (its spans are kept)
+    TraceRing* ring = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+	bool released = false;
+	if (__atomic_compare_exchange_n(&ring->inUse, &released, true,
+		false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	    break;
+	}
+    }
+    if (!ring) {
+	ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+	ring->inUse = true;
+	ring->next = __atomic_load_n(&traceRings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&traceRings, &ring->next, ring,
+		true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+    }
+    ring->threadId = syscall(SYS_gettid);
+    threadTraceRing = ring;
+    pthread_setspecific(traceRingKey, ring);
+    return ring;
+}
+
+bool write_trace(void) {
+    FILE* traceFile = fopen(tracePath, "w");
+    if (!traceFile) {
+	return false;
+    }
+    fprintf(traceFile, "{\"traceEvents\":[");
+    bool first = true;
+    TraceRing* ring = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+	unsigned long numSpans = __atomic_load_n(&ring->numSpans,
+		__ATOMIC_ACQUIRE);
+	unsigned long oldest = (numSpans > TRACE_RING_SIZE) ?
+		numSpans - TRACE_RING_SIZE : 0;
+	for (unsigned long index = oldest; index < numSpans; index++) {
+	    TraceSpan span = ring->spans[index % TRACE_RING_SIZE];
+	    fprintf(traceFile, "%s\n{\"name\":\"%s\",\"cat\":\"%s\","
+		    "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+		    "\"pid\":%d,\"tid\":%ld}", (first) ? "" : ",",
+		    span.name, span.category, span.start / 1000.0,
+		    span.duration / 1000.0, getpid(), span.threadId);
+	    first = false;
+	}
+    }
+    fprintf(traceFile, "\n]}\n");
+    return !fclose(traceFile);
+}
+
+bool start_detached(void* (*routine)(void*), void* argument) {
+    pthread_t threadId;
+    pthread_attr_t attributes;
+
+    // Ensure success of all pthread function calls
+    if (pthread_attr_init(&attributes) ||
+	    pthread_attr_setdetachstate(&attributes,
+	    PTHREAD_CREATE_DETACHED) ||
+	    pthread_create(&threadId, &attributes, routine, argument)) {
+	return false;
+    }
+    pthread_attr_destroy(&attributes);
+    return true;
+}
+
+int num_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus < 1) ? 1 : (int)cpus;
+}
+
+bool pin_to_cpu(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+}
+
+/* Helper function for enable_cpu_sets(). Takes in a list of CPUs and ranges
+ * (e.g. 0-3,8) and the set to fill. Fills said set and returns the number of
+ * CPUs in it, or ERROR_RETURN if the list is invalid or names a CPU this
+ * process may not run on. */
+static int parse_cpu_list(char* list, cpu_set_t* cpus) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+	return ERROR_RETURN;
+    }
+    CPU_ZERO(cpus);
+    char* next = list;
+    char* end;
+    do {
+	// strtol() would also accept whitespace and signs, hence a digit
+	// must begin every CPU
+	if (*next < '0' || *next > '9') {
+	    return ERROR_RETURN;
+	}
+	long first = strtol(next, &end, 10);
+	long last = first;
+	if (*end == '-') {
+	    next = end + 1;
+	    if (*next < '0' || *next > '9') {
+		return ERROR_RETURN;
+	    }
+	    last = strtol(next, &end, 10);
+	}
+	if (last < first || last >= CPU_SETSIZE) {
+	    return ERROR_RETURN;
+	}
+	for (long cpu = first; cpu <= last; cpu++) {
+	    if (!CPU_ISSET(cpu, &allowed)) {
+		return ERROR_RETURN;
+	    }
+	    CPU_SET(cpu, cpus);
+	}
+	next = end + 1;
+    } while (*end == ',');
+    return (*end == '\0') ? CPU_COUNT(cpus) : ERROR_RETURN;
+}
+
+bool enable_cpu_sets(char* acceptList, char* workerList) {
+    int acceptCount = (acceptList) ? parse_cpu_list(acceptList, &acceptCpus) :
+	    0;
+    int workerCount = (workerList) ? parse_cpu_list(workerList, &workerCpus) :
+	    0;
+    if (acceptCount == ERROR_RETURN || workerCount == ERROR_RETURN) {
+	return false;
+    }
+    numAcceptCpus = acceptCount;
+    numWorkerCpus = workerCount;
+
+    // Pages are placed on the NUMA node of the CPU which first touches
+    // them, hence the shared data allocated (and first written) by this
+    // thread, and by the workers, lies on the workers' node
+    return !numWorkerCpus || !pthread_setaffinity_np(pthread_self(),
+	    sizeof(cpu_set_t), &workerCpus);
+}
+
+int accept_cpu(int listener, int numListeners) {
+    if (!numAcceptCpus) {
+	return (numListeners > 1) ? listener % num_cpus() : NO_CPU_PINNING;
+    }
+    // Listeners take the accepting CPUs in turn
+    int position = listener % numAcceptCpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET(cpu, &acceptCpus) && !position--) {
+	    return cpu;
+	}
+    }
+    return NO_CPU_PINNING;
+}
+
+bool pin_worker(pthread_attr_t* attributes) {
+    return !numWorkerCpus || !pthread_attr_setaffinity_np(attributes,
+	    sizeof(cpu_set_t), &workerCpus);
+}
@@ -6,12 +6,14 @@
 #include <netdb.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include "errors.h"
 
 /* The get_line() function re-allocates memory if necessary. Hence, whenever
@@ -37,18 +39,306 @@
  * process. */
 #define SHARED_BETWEEN_THREADS 0
 
-/* Takes in an empty space to store the port number. Sets up a server to
- * listen on an ephemeral port and displays said port number. Returns a socket
- * upon success, otherwise returns NULL. NOTE: the socket is created via
- * dynamically allocated memory, and should be free'd if no longer in use. */
+/* Bounds of the number of listeners sharing a server's port (--listeners). */
+#define MIN_LISTENERS 1
+#define MAX_LISTENERS 256
+
+/* Listeners which do not share the port are left free to run on any CPU. */
+#define NO_CPU_PINNING -1
+
+/* Separates the ports of each mapper in a mapper cluster (e.g. 2310,2311). */
+#define PORT_LIST_SEPARATOR ","
+
+/* Each mapper is placed at this many points on the consistent hashing ring,
+ * evening out the share of airport IDs each mapper owns. */
+#define VIRTUAL_NODES 64
+
+/* Largest port number (as a string) plus null terminator. */
+#define PORT_STRING_SIZE 6
+
+/* Prefix of every control command other than log (e.g. ":stats" or ":top
+ * 10"). As ':' is invalid in a plane ID (see check_invalid_chars()), no
+ * plane ID can be taken as a command. */
+#define CONTROL_COMMAND_PREFIX ":"
+
+/* Number of hashes (bits set) per airport ID in a membership filter (see
+ * filter_bit()). */
+#define FILTER_HASHES 7
+
+/* Bits per registered airport of a downloaded filter, which (with
+ * FILTER_HASHES) gives about one false positive per hundred unknown IDs. */
+#define FILTER_BITS_PER_ENTRY 10
+
+/* Bounds of the number of bits of a filter (each a power of two). */
+#define FILTER_MIN_BITS 64
+#define FILTER_MAX_BITS (1 << 20)
+
+/* Point on the consistent hashing ring */
+typedef struct {
+    uint32_t hash;
+    int mapper; // index into the mapper ports
+} RingPoint;
+
+/* Mapper Cluster Representation. Each mapper owns the airport IDs which hash
+ * to the ring points between its points and those of the preceding mapper,
+ * such that adding or removing a mapper only moves the IDs it owns. */
+typedef struct {
+    char** mapperPorts;
+    int numMappers;
+    RingPoint* points; // sorted by hash
+    int numPoints;
+} MapperRing;
+
+/* Number of buckets in each latency histogram. Bucket i counts latencies of
+ * less than 2^i microseconds, the last bucket counts the remainder. */
+#define NUM_LATENCY_BUCKETS 24
+
+/* Most command types (and other holders of the lock) a server's statistics
+ * can distinguish. */
+#define MAX_STAT_COMMANDS 24
+
+/* Most categories of tracked memory (see tracked_malloc()) a server can
+ * distinguish. */
+#define MAX_MEMORY_CATEGORIES 8
+
+/* Header of every tracked allocation, preceding the memory returned, such
+ * that it can be freed (and accounted for) without being given its size.
+ * The union keeps the memory returned aligned as per malloc(). */
+typedef union {
+    struct {
+	size_t size;
+	int category;
+    } tracked;
+    long double alignLongDouble;
+    void* alignPointer;
+    long long alignInteger;
+} MemoryHeader;
+
+/* Latency Histogram (power of two buckets, in microseconds) */
+typedef struct {
+    unsigned long count;
+    unsigned long totalMicroseconds;
+    unsigned long buckets[NUM_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/* Server Statistics. Every counter is only ever updated via stat_add() (an
+ * atomic add), hence threads never need a lock to update or display them.
+ * Command types index the latencies. The lock profile (if enabled) is
+ * indexed by holder: a command type, or some other user of the lock numbered
+ * after the command types. */
+typedef struct {
+    char* entriesName; // e.g. "registry_size"
+    char** holderNames; // command types, then any other holders
+    int numCommandNames;
+    int numHolderNames;
+    unsigned long activeConnections;
+    unsigned long totalConnections;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long storedEntries; // registry (mapper) or log (control) size
+    unsigned long guardAcquisitions;
+    unsigned long guardWaitNanoseconds;
+    unsigned long guardHoldNanoseconds;
+    unsigned long reapedIdle; // connections closed by the reaper
+    unsigned long reapedRequest;
+    unsigned long throttledLookups; // requests delayed (see take_token())
+    unsigned long throttledListings;
+    unsigned long throttleRejected; // connections closed when over quota
+    LatencyHistogram latencies[MAX_STAT_COMMANDS]; // per command type
+    bool profileLock; // as per --lockprof
+    LatencyHistogram lockWaits[MAX_STAT_COMMANDS]; // indexed by holder
+    LatencyHistogram lockHolds[MAX_STAT_COMMANDS];
+} ServerStats;
+
+/* Bounds (in seconds) of the deadlines given via --idle-timeout and
+ * --request-timeout. */
+#define MIN_DEADLINE 1
+#define MAX_DEADLINE 86400
+
+/* Number of seconds between each of the reaper's checks of the deadlines,
+ * hence how late a connection may be closed. */
+#define REAPER_INTERVAL 1
+
+/* Token Bucket (see take_token()). Holds up to rate tokens, i.e. a burst of
+ * one second's worth, refilled continuously at rate tokens per second. */
+typedef struct {
+    double tokens; // negative whilst takers are waiting for their token
+    int rate; // per second
+    long long refilled; // as per monotonic_nanoseconds()
+} TokenBucket;
+
+/* Bounds (in milliseconds) of the backoff between the attempts of a
+ * connection (see enable_connect_policy()). */
+#define MIN_BACKOFF 20
+#define MAX_BACKOFF 1000
+
+/* Watched Connection (see watch_connection()). Its streams record activity
+ * (see counted_fdopen()), which the reaper checks against the deadlines.
+ * Times are as per monotonic_nanoseconds(). */
+typedef struct WatchedConnection {
+    int fd;
+    long long lastActivity; // last byte read or written
+    long long requestStarted; // first byte of the current request, else 0
+    bool watched; // in the reaper's list
+    bool reaped;
+    struct WatchedConnection* previous;
+    struct WatchedConnection* next;
+} WatchedConnection;
+
+/* Byte-counting stream state (see counted_fdopen()) */
+typedef struct {
+    int fd;
+    unsigned long* byteCounter;
+    WatchedConnection* watch; // NULL unless deadlines are enforced
+} CountedStream;
+
+/* Number of spans held by each thread's trace ring. Once full, the oldest
+ * spans are overwritten. */
+#define TRACE_RING_SIZE 4096
+
+/* Timed span of work, as recorded by trace_end() */
+typedef struct {
+    const char* name; // must be a string literal (or otherwise never free'd)
+    const char* category;
+    long long start; // see monotonic_nanoseconds()
+    long long duration;
+    long threadId; // rings are reused, so each span records its thread
+} TraceSpan;
+
+/* Trace Ring. Each thread records spans into its own ring, without locks,
+ * hence only the owning thread ever writes to it. Rings are never free'd:
+ * once a thread exits, its ring is reused by the next thread to trace. */
+typedef struct TraceRing {
+    TraceSpan spans[TRACE_RING_SIZE];
+    unsigned long numSpans; // recorded in total, published after each span
+    long threadId; // of the current owner
+    bool inUse;
+    struct TraceRing* next; // every ring created, see write_trace()
+} TraceRing;
+
+/* First bytes of every capture file (see enable_capture()). */
+#define CAPTURE_MAGIC "2310CAP1"
+#define CAPTURE_MAGIC_SIZE 8
+
+/* Kinds of server a capture was taken from. */
+#define MAPPER_CAPTURE 'M'
+#define CONTROL_CAPTURE 'C'
+
+/* Length of the capture record denoting a connection closed by the client
+ * (no command follows). */
+#define CAPTURE_CLOSED UINT32_MAX
+
+/* Capture File Header. A capture file is this header followed by records,
+ * each a CaptureRecord then length bytes of command (without newline). All
+ * fields are in the byte order of the capturing host. */
+typedef struct {
+    char magic[CAPTURE_MAGIC_SIZE];
+    uint32_t serverType; // MAPPER_CAPTURE or CONTROL_CAPTURE
+    uint32_t reserved;
+} CaptureHeader;
+
+/* Capture Record, one per command received (or connection closed) */
+typedef struct {
+    uint64_t offset; // nanoseconds since the capture began
+    uint32_t connection; // numbered from 1, in the order accepted
+    uint32_t length; // of the command, or CAPTURE_CLOSED
+} CaptureRecord;
+
+/* First byte sent by a client choosing the binary protocol for the rest of
+ * its connection. Text commands (lines) are never expected to begin with
+ * this byte, as it is not ASCII. */
+#define BINARY_MAGIC 0xB2
+
+/* Size of a frame header: the FrameType (1 byte) then the length of the
+ * payload (2 bytes, network byte order). */
+#define FRAME_HEADER_SIZE 3
+
+/* Largest frame payload, as limited by its length field. */
+#define MAX_FRAME_PAYLOAD 65535
+
+/* Size of the port (network byte order) leading the payload of some
+ * frames. */
+#define FRAME_PORT_SIZE 2
+
+/* Binary Protocol Frame Types, each with its payload and text equivalent */
+typedef enum {
+    FRAME_QUERY = 1, // ID, as per ?ID
+    FRAME_REGISTER = 2, // port then ID, as per !ID:port (no reply)
+    FRAME_LIST = 3, // empty, as per @
+    FRAME_ARRIVAL = 4, // plane ID, as per a plane ID sent to a control
+    FRAME_PORT = 5, // port (0 if unknown), the reply to FRAME_QUERY
+    FRAME_ENTRY = 6, // port then ID, one per airport listed
+    FRAME_END = 7, // empty, ends the reply to FRAME_LIST
+    FRAME_INFO = 8, // airport info, the reply to FRAME_ARRIVAL
+    FRAME_PARTIAL = 9 // empty, ends an incomplete reply to FRAME_LIST
+} FrameType;
+
+/* Binary Protocol Frame, as read by read_frame() */
+typedef struct {
+    uint8_t type;
+    uint16_t length; // of the payload
+    int port; // ERROR_RETURN unless the payload begins with a port
+    char* id; // the payload after the port (if any), NUL terminated
+    char* payload;
+    size_t capacity; // of the payload, reused by each read_frame()
+} Frame;
+
+/* Prefix of an optional command line argument (e.g. --port=2310). */
+#define OPTION_PREFIX "--"
+
+/* Separates the name of an optional command line argument from its value. */
+#define OPTION_VALUE_SEPARATOR '='
+
+/* Takes in the port to listen on (0 for an ephemeral port). Sets up a server
+ * to listen on said port and displays the port number, which is stored back
+ * into thisPortNumber. Returns a socket upon success, otherwise returns NULL.
+ * NOTE: the socket is created via dynamically allocated memory, and should be
+ * free'd if no longer in use. */
 int* setup_server(uint16_t* thisPortNumber);
 
+/* Takes in the port to listen on (0 for an ephemeral port) and the number of
+ * listeners required. As per setup_server(), except numListeners sockets are
+ * returned, all bound to the same port via SO_REUSEPORT such that the kernel
+ * spreads incoming connections across them. Returns NULL on error. */
+int* setup_listeners(uint16_t* thisPortNumber, int numListeners);
+
+/* Helper function for setup_listeners(). Takes in the port to listen on (0
+ * for an ephemeral port, in which case the chosen port is stored back) and
+ * whether the port is to be shared with other listeners. Returns the
+ * listening socket, or ERROR_RETURN on error. */
+int open_listener(uint16_t* thisPortNumber, bool sharePort);
+
 /* Takes in a port to connect to, a socket endpoint to communicate with, and a
  * flag to check whether an airport or a plane called this function. Sets up a
  * client connection to the port specified, via the socket end point provided,
- * and returns the appropriate exit code (based on controlCalled). */
+ * and returns the appropriate exit code (based on controlCalled). Failed
+ * attempts are retried as per enable_connect_policy(). */
 int setup_client(char* portToConnectTo, int* thisEnd, bool controlCalled);
 
+/* Takes in the per connection timeout, the number of retries of a failed
+ * connection and the overall deadline from now, both times in milliseconds
+ * (0 for none). Enables said policy for every later setup_client(), such
+ * that each attempt (and each send and receive of the connection made) is
+ * bounded by the timeout and the time left before the deadline, and failed
+ * attempts are retried after a jittered exponential backoff (from
+ * MIN_BACKOFF to MAX_BACKOFF milliseconds) unless the deadline would pass. */
+void enable_connect_policy(int timeout, int retries, int deadline);
+
+/* Returns the milliseconds left before the deadline of the connect policy,
+ * 0 if it has passed, or ERROR_RETURN if there is none. */
+long long connect_time_remaining(void);
+
+/* Helper function for setup_client(). Takes in the address to connect to.
+ * Makes a single attempt, bounded as per the connect policy. Returns the
+ * connected socket, or ERROR_RETURN on error (or once the deadline passed). */
+int connect_within(struct addrinfo* ai);
+
+/* Takes in a connected socket and empty spaces to store its streams. Opens
+ * a stream writing to said socket, and one reading from a duplicate of it.
+ * Returns if both opened, otherwise closes whichever did (and the socket and
+ * its duplicate) and stores NULL in both. */
+bool open_streams(int thisEnd, FILE** writeEnd, FILE** readEnd);
+
 /* Calculates (and returns) the maximum number of server connections allowed
  * by this system. Returns UNSPECIFIED_ERROR on error. */
 int get_num_connections(void);
@@ -74,4 +364,350 @@ int character_counter(char* stringToSearch, char toCount);
  * chars as per the spec (':', '\r', '\n'). */
 bool check_invalid_chars(char* stringToCheck);
 
+/* Takes in the names of every option of the program (NULL terminated).
+ * Declares said options, such that any other argument (even one beginning
+ * with "--", e.g. an airport ID) ends the options rather than being an
+ * unknown option. Without a declaration, every argument beginning with "--"
+ * is an option. */
+void declare_options(const char** names);
+
+/* Takes in the number of command line arguments, the command line arguments,
+ * and the name of an option. Options (given as --name=value or --name) must
+ * precede all other arguments, and end at the first argument which is not
+ * an option (see declare_options()) or at "--". If found, the option is
+ * removed from the command line arguments (and *argc updated) so that the
+ * remaining arguments can be validated as per the spec. Returns the value
+ * of the option ("" if no value was given), or NULL if the option was not
+ * given. */
+char* get_option(int* argc, char** argv, const char* name);
+
+/* Takes in the number of command line arguments and the command line
+ * arguments, after all known options have been removed via get_option().
+ * Removes a "--" (end of options) argument if present. Returns if any
+ * unrecognised options remain. */
+bool unknown_options(int* argc, char** argv);
+
+/* Takes in the value of an option, the bounds of said value, and an empty
+ * space to store the converted value. Returns if the value is a valid
+ * integer within the (inclusive) bounds. */
+bool option_to_int(char* value, int min, int max, int* result);
+
+/* Takes in a line sent to a control. Returns if said line is one of the
+ * control's commands: log, or (after CONTROL_COMMAND_PREFIX) stats,
+ * lockprof, memory, top K or visits ID. Only log is hence never taken as a
+ * plane ID. */
+bool is_control_command(char* command);
+
+/* Takes in a string. Returns the (32 bit FNV-1a, then mixed) hash of said
+ * string. */
+uint32_t hash_id(const char* id);
+
+/* Takes in an airport ID, which of the FILTER_HASHES hashes to take and the
+ * number of bits of a filter (a power of two). Returns the bit of said
+ * filter set for said ID by said hash. NOTE: the number of bits only masks
+ * the result, hence a filter may be halved by OR-ing its two halves. */
+uint32_t filter_bit(const char* id, int hash, uint32_t numBits);
+
+/* Takes in the bits of a filter (bit i in byte i / 8, lowest bit first), the
+ * number of said bits and an airport ID. Returns false if said ID is
+ * certainly not in said filter, else true (it probably is). */
+bool filter_may_contain(const unsigned char* bits, uint32_t numBits,
+	const char* id);
+
+/* Takes in a list of ports separated by PORT_LIST_SEPARATOR, and an empty
+ * space to store the number of ports. Validates each port and returns a
+ * (dynamically allocated) array of said ports, each in decimal without
+ * leading zeros, or NULL if any port is invalid. A single port is a valid
+ * list. */
+char** parse_port_list(char* portList, int* numPorts);
+
+/* Takes in a list of ports (see parse_port_list()) and the number of said
+ * ports. Frees said ports. */
+void free_port_list(char** ports, int numPorts);
+
+/* Takes in the ports of every mapper in a cluster, separated by
+ * PORT_LIST_SEPARATOR. Returns the consistent hashing ring of said mappers,
+ * or NULL if any port is invalid. */
+MapperRing* build_mapper_ring(char* mapperPorts);
+
+/* Takes in a mapper ring and an airport ID. Returns the port of the mapper
+ * which owns said ID (the first ring point at or after the hash of the ID,
+ * wrapping around to the first point). */
+char* route_to_mapper(MapperRing* ring, char* id);
+
+/* Takes in (and frees) a mapper ring. */
+void free_mapper_ring(MapperRing* ring);
+
+/* Returns the current (wall clock) time in milliseconds since the epoch,
+ * such that timestamps can be compared between processes. */
+long long milliseconds_since_epoch(void);
+
+/* Returns the current (monotonic) time in nanoseconds, for measuring
+ * intervals within a process. */
+long long monotonic_nanoseconds(void);
+
+/* Takes in a counter of some server statistics and the amount to add to it
+ * (which may be negative). Atomically adds said amount. */
+void stat_add(unsigned long* counter, long amount);
+
+/* Takes in the names of a server's stored entries and of its lock holders
+ * (see ServerStats), the number of command types and the number of holders
+ * (no more than MAX_STAT_COMMANDS), and whether to profile the lock. Returns
+ * zeroed statistics. */
+ServerStats* init_stats(char* entriesName, char** holderNames,
+	int numCommandNames, int numHolderNames, bool profileLock);
+
+/* Takes in a latency histogram and a latency in nanoseconds. Atomically
+ * records said latency. */
+void record_latency(LatencyHistogram* histogram, long long nanoseconds);
+
+/* Takes in a server's statistics, the type of command processed and the time
+ * (see monotonic_nanoseconds()) processing began. Counts said command and
+ * records its latency. Command types of MAX_STAT_COMMANDS or more are
+ * ignored. */
+void record_command(ServerStats* stats, int commandType, long long started);
+
+/* Takes in a server's lock and statistics, and the holder about to hold said
+ * lock. Waits on said lock, recording the time spent waiting, and returns
+ * the time (see monotonic_nanoseconds()) the lock was acquired. Every
+ * sem_wait() of a server's lock should be made via this function. */
+long long stats_guard_wait(sem_t* guard, ServerStats* stats, int holder);
+
+/* Takes in a server's lock and statistics, the holder of said lock and the
+ * time returned by stats_guard_wait(). Releases said lock, recording the
+ * time it was held. */
+void stats_guard_post(sem_t* guard, ServerStats* stats, int holder,
+	long long acquired);
+
+/* Takes in a file descriptor, the mode to open it with (as per fdopen()), a
+ * counter of some server statistics and the connection's watch (see
+ * watch_connection(), NULL for none). Opens said file descriptor as a stream
+ * which adds every byte read or written to said counter and records said
+ * activity in said watch. NOTE: the stream has no underlying file descriptor
+ * as far as fileno() is concerned. */
+FILE* counted_fdopen(int fd, const char* mode, unsigned long* byteCounter,
+	WatchedConnection* watch);
+
+/* Takes in the stream a listing is destined for, and an empty space for
+ * the buffer (and its size) to hold said listing. Returns a stream writing
+ * to said buffer, such that the listing can be built whilst holding a lock
+ * and sent (see send_listing()) once it is released, or said destination
+ * itself if the buffer could not be allocated. */
+FILE* open_listing(FILE* writeEnd, char** buffer, size_t* size);
+
+/* Takes in a listing (as per open_listing()), its buffer and the size of
+ * said buffer (both pointers, as they are only final once the listing is
+ * closed), and the stream it is destined for. Closes said listing and
+ * writes (then frees) its buffer to said stream. */
+void send_listing(FILE* listing, char** buffer, size_t* size,
+	FILE* writeEnd);
+
+/* Takes in a token bucket (whose rate is set) and the current time (as per
+ * monotonic_nanoseconds()). Initialises said bucket full. */
+void init_token_bucket(TokenBucket* bucket, long long now);
+
+/* Takes in a token bucket and the current time. Refills said bucket, then
+ * returns if it is full, i.e. forgetting it would lose nothing. */
+bool token_bucket_full(TokenBucket* bucket, long long now);
+
+/* Takes in a token bucket and the current time. Takes a token, which may
+ * be owed (such that concurrent takers queue for the tokens to come).
+ * Returns the nanoseconds the taker must wait before using its token, or
+ * ERROR_RETURN (taking no token) if a second's worth is already owed.
+ * NOTE: the caller must serialise the takers of each bucket. */
+long long take_token(TokenBucket* bucket, long long now);
+
+/* Takes in a server's statistics and the stream to display to. Displays the
+ * statistics as name:value lines (command types with a NULL name are
+ * skipped). Histogram lines list the upper bound of each bucket (in
+ * microseconds) and its count, up to the last bucket used. */
+void display_stats(ServerStats* stats, FILE* writeEnd);
+
+/* Takes in a histogram, its name and the stream to display to. Displays the
+ * count, mean and buckets of said histogram as per display_stats(). */
+void display_histogram(LatencyHistogram* histogram, char* name,
+	FILE* writeEnd);
+
+/* Takes in a server's statistics and the stream to display to. Displays
+ * whether the lock is profiled and, for each holder which has taken the
+ * lock, the wait and hold time histograms as per display_stats(). */
+void display_lock_profile(ServerStats* stats, FILE* writeEnd);
+
+/* Takes in the names of the categories of tracked memory and the number of
+ * categories. Names said categories (for display_memory()) for the rest of
+ * the process. */
+void track_memory(char** names, int numCategories);
+
+/* Takes in a category of tracked memory and a size. As per malloc(), except
+ * said size is accounted to said category until the memory is freed (which
+ * must be via tracked_free()). */
+void* tracked_malloc(int category, size_t size);
+
+/* As per calloc(), accounted as per tracked_malloc(). */
+void* tracked_calloc(int category, size_t count, size_t size);
+
+/* Takes in a category of tracked memory, tracked memory (or NULL) and a
+ * size. As per realloc(), accounting the change in size to the category
+ * said memory was allocated with (or to said category, if NULL). */
+void* tracked_realloc(int category, void* memory, size_t size);
+
+/* As per strdup(), accounted as per tracked_malloc(). */
+char* tracked_strdup(int category, const char* string);
+
+/* Takes in tracked memory (or NULL). Frees it, as per free(). */
+void tracked_free(void* memory);
+
+/* Takes in the stream to display to. Displays the bytes of each category of
+ * tracked memory and its high-water mark as name:bytes:peak lines, then
+ * those of all categories (tracked) and the resident set of the process
+ * (resident:bytes), such that untracked memory can be estimated. */
+void display_memory(FILE* writeEnd);
+
+/* Blocks SIGUSR1 and SIGUSR2 in the calling thread, and thus every thread it
+ * goes on to create, such that only the signal dumper receives them. Returns
+ * if the signals were blocked. */
+bool block_dump_signals(void);
+
+/* Takes in a server's statistics. Blocks SIGUSR1 and SIGUSR2 (see
+ * block_dump_signals()) and starts a thread which, whenever SIGUSR1 is
+ * received, displays the lock profile to stderr and, whenever SIGUSR2 is
+ * received, writes the trace (see write_trace()). Must be called before any
+ * other threads are created (unless they were created after
+ * block_dump_signals()). Returns if the thread started. */
+bool start_signal_dumper(ServerStats* stats);
+
+/* Thread routine of start_signal_dumper(). Takes in the server's statistics
+ * and never returns. */
+void* dump_on_signal(void* serverStats);
+
+/* Takes in the read-idle and total-request deadlines, in seconds (0 for
+ * none). Enables said deadlines for the rest of the process, such that
+ * start_reaper() closes any watched connection which exceeds them. */
+void enable_deadlines(int idleTimeout, int requestTimeout);
+
+/* Takes in a server's statistics. Starts the reaper thread (see
+ * reap_connections()) if any deadline is enabled. Returns if the thread
+ * started (or was not needed). */
+bool start_reaper(ServerStats* stats);
+
+/* Thread routine of start_reaper(). Takes in the server's statistics. Every
+ * REAPER_INTERVAL seconds, shuts down each watched connection which has been
+ * idle, or taken to send its current request, for longer than the deadlines
+ * (counting each in said statistics), such that its thread sees end of file
+ * and reclaims it as if the client had closed it. Never returns. */
+void* reap_connections(void* serverStats);
+
+/* Takes in the (uninitialised) watch of a connection and said connection's
+ * file descriptor. Adds said connection to those checked by the reaper.
+ * Returns said watch, to be given to counted_fdopen(), or NULL if no
+ * deadline is enabled. */
+WatchedConnection* watch_connection(WatchedConnection* watch, int fd);
+
+/* Takes in the watch of a connection. Removes said connection from those
+ * checked by the reaper (if it still is), after which its file descriptor
+ * may be closed. Must be called before said watch is free'd. */
+void unwatch_connection(WatchedConnection* watch);
+
+/* Takes in the watch of a connection. Marks the current request as fully
+ * received, such that the request deadline restarts with the next. */
+void finish_request(WatchedConnection* watch);
+
+/* Takes in the path of the capture file and the kind of server capturing
+ * (MAPPER_CAPTURE or CONTROL_CAPTURE). Creates said file and enables capture
+ * of every command received for the rest of the process. Returns if the file
+ * was created. */
+bool enable_capture(char* path, char serverType);
+
+/* Returns the number of a newly accepted connection, as recorded in the
+ * capture, or 0 if capture is disabled. */
+uint32_t capture_connection(void);
+
+/* Takes in the number of a connection (see capture_connection()) and the
+ * command received on it. Appends said command to the capture, unless the
+ * number is 0 (capture disabled). Each record is flushed as it is written,
+ * such that a killed server leaves a complete capture. */
+void capture_command(uint32_t connection, char* command);
+
+/* Takes in the number of a connection. As per capture_command(), except the
+ * record denotes the client closing said connection. */
+void capture_close(uint32_t connection);
+
+/* Takes in the write end of a connection, the type of frame, the port to
+ * lead the payload (ERROR_RETURN for none) and the ID (or info) to follow
+ * it (NULL for none). Writes (but does not flush) said frame. Returns if the
+ * frame was written, i.e. the payload fits and the write succeeded. */
+bool write_frame(FILE* writeEnd, FrameType type, int port, const char* id);
+
+/* Takes in the read end of a connection and a frame (zeroed before its first
+ * use, its payload free'd after its last). Reads the next frame into said
+ * frame. Returns false on end of file, or if the frame is truncated or
+ * lacks the port its type requires. */
+bool read_frame(FILE* readEnd, Frame* frame);
+
+/* Takes in a request frame. Returns the equivalent text command (e.g. for
+ * capture or forwarding), which must be freed, or NULL if the frame is not
+ * a request. */
+char* frame_to_command(Frame* frame);
+
+/* Takes in the path to write the trace to. Enables tracing for the rest of
+ * the process (see trace_begin()). */
+void enable_tracing(char* path);
+
+/* Returns if tracing has been enabled. */
+bool tracing_enabled(void);
+
+/* Begins a span. Returns the current time (see monotonic_nanoseconds()) to
+ * be given to trace_end(), or 0 if tracing is disabled (in which case
+ * trace_end() does nothing, hence tracing costs a single branch when off).
+ * */
+long long trace_begin(void);
+
+/* Takes in the name and category of a span (string literals), and the time
+ * returned by trace_begin(). Records said span in the calling thread's trace
+ * ring, unless tracing is disabled. */
+void trace_end(const char* name, const char* category, long long started);
+
+/* Returns the trace ring of the calling thread, claiming (or creating) one
+ * on first use. */
+TraceRing* thread_trace_ring(void);
+
+/* Writes every span held by the trace rings to the path given to
+ * enable_tracing(), in Chrome trace (JSON) format. Timestamps are from the
+ * monotonic clock, hence traces of each process on the same host line up.
+ * Spans being recorded whilst writing may be skipped. Returns if the trace
+ * was written. */
+bool write_trace(void);
+
+/* Takes in a thread start routine and its argument. Starts said routine in a
+ * detached thread, and returns if the thread was started. */
+bool start_detached(void* (*routine)(void*), void* argument);
+
+/* Returns the number of CPUs currently online (at least 1). */
+int num_cpus(void);
+
+/* Takes in a CPU number. Pins the calling thread to exactly said CPU, such
+ * that threads it creates inherit the same CPU. Returns if the thread was
+ * pinned. */
+bool pin_to_cpu(int cpu);
+
+/* Takes in the CPUs of the accepting threads and of the worker threads
+ * (--accept-cpus and --worker-cpus), each a list of CPUs and ranges (e.g.
+ * 0-3,8) or NULL to leave said threads unpinned. Enables said CPU sets for
+ * accept_cpu() and pin_worker(), and pins the calling thread to the worker
+ * CPUs, such that the threads it creates and the shared data it allocates
+ * (as per first touch) are placed on the workers' NUMA node. Returns if
+ * both lists were valid CPUs of this process. */
+bool enable_cpu_sets(char* acceptList, char* workerList);
+
+/* Takes in a listener and the number of listeners sharing the port. Returns
+ * the CPU said listener is pinned to (see pin_to_cpu()): the next of the
+ * accepting CPUs if enabled, otherwise the next CPU (wrapped to the CPUs
+ * online) if the port is shared, otherwise NO_CPU_PINNING. */
+int accept_cpu(int listener, int numListeners);
+
+/* Takes in the attributes of a worker thread (one per connection) yet to be
+ * created. Restricts said thread to the worker CPUs, if enabled, rather
+ * than the CPU of the listener which accepted it. Returns if successful. */
+bool pin_worker(pthread_attr_t* attributes);
+
 #endif
@@ -9,10 +9,23 @@
 #include <signal.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 #include "errors.h"
 #include "general.h"
 #include "mapper2310.h"
 
+/* Names of each CommandType, then of each LockHolder, as displayed by the
+ * statistics and lock profile. */
+static char* holderNames[] = {NULL, "query", "register", "list", "renew",
+	"list_local", "replicate", "lag", "stats", "lockprof",
+	"bulk_register", "subscribe", "prefix", "range", "bloom", "memory",
+	"delta", "error", "lease_expiry", "peer_snapshot",
+	"replication_snapshot", "replication_apply"};
+
+/* Names of each MapperMemory category, as displayed by the memory command. */
+static char* memoryNames[] = {"airports", "index", "filter", "log",
+	"connections", "budgets"};
+
 int main(int argc, char** argv) {
     // Squash SIGPIPE to prevent issues arising from sudden termination of
     // client(s)
@@ -22,45 +35,242 @@ int main(int argc, char** argv) {
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, NULL);
 
-    uint16_t thisPortNumber;
-    int* serverEnd = setup_server(&thisPortNumber); 
+    // The categories of tracked memory are named once, for the whole process
+    track_memory(memoryNames, NUM_MAPPER_MEMORY);
+
+    MapperConfig config;
+    if (!parse_mapper_options(&argc, argv, &config)) {
+	fprintf(stderr, "Usage: mapper2310 [--port=port] "
+		"[--lease=seconds] [--listeners=count] "
+		"[--peers=port,port,...] [--follow=port] [--lockprof] "
+		"[--trace=file] [--capture=file] [--seed=file] "
+		"[--idle-timeout=seconds] [--request-timeout=seconds] "
+		"[--lookup-rate=count] [--list-rate=count] "
+		"[--accept-cpus=list] [--worker-cpus=list]\n");
+	return UNSPECIFIED_ERROR;
+    }
+
+    uint16_t thisPortNumber = config.port;
+    int* serverEnds = setup_listeners(&thisPortNumber, config.numListeners);
 
     // Check for any errors when setting up the server
-    if (serverEnd == NULL) {
+    if (serverEnds == NULL) {
 	return UNSPECIFIED_ERROR;
     }
+    config.port = thisPortNumber;
+    remove_peer(&config, thisPortNumber);
 
-    handle_connections(*serverEnd); // Communicate with clients
+    // Communicate with clients
+    handle_connections(serverEnds, &config);
 
-    free(serverEnd);
+    free(serverEnds);
     // Should never reach here - mapper should run until killed
     return UNSPECIFIED_ERROR;
 }
 
-void handle_connections(int serverEnd) {
-    int connectionWrite; // file descriptor for accepted socket
+bool parse_mapper_options(int* argc, char** argv, MapperConfig* config) {
+    // A fixed port (--port) allows a restarted mapper to be found by the
+    // controls holding registration sessions
+    config->port = 0;
+    config->leaseDuration = DEFAULT_LEASE_DURATION;
+    config->numListeners = MIN_LISTENERS;
+    config->peerPorts = NULL;
+    config->numPeers = 0;
+    config->primaryPort = get_option(argc, argv, "follow");
+    char* lockProfileOption = get_option(argc, argv, "lockprof");
+    config->profileLock = lockProfileOption != NULL;
+    if (lockProfileOption && lockProfileOption[0] != '\0') {
+	return false; // a flag, which takes no value
+    }
+    char* traceOption = get_option(argc, argv, "trace");
+    if (traceOption) {
+	if (traceOption[0] == '\0') {
+	    return false;
+	}
+	enable_tracing(traceOption);
+    }
+    char* captureOption = get_option(argc, argv, "capture");
+    if (captureOption && (captureOption[0] == '\0' ||
+	    !enable_capture(captureOption, MAPPER_CAPTURE))) {
+	return false;
+    }
+
+    char* portOption = get_option(argc, argv, "port");
+    char* leaseOption = get_option(argc, argv, "lease");
+    char* listenersOption = get_option(argc, argv, "listeners");
+    char* peersOption = get_option(argc, argv, "peers");
+    char* idleOption = get_option(argc, argv, "idle-timeout");
+    char* requestOption = get_option(argc, argv, "request-timeout");
+    int idleTimeout = 0;
+    int requestTimeout = 0;
+    if ((idleOption && !option_to_int(idleOption, MIN_DEADLINE,
+	    MAX_DEADLINE, &idleTimeout)) || (requestOption &&
+	    !option_to_int(requestOption, MIN_DEADLINE, MAX_DEADLINE,
+	    &requestTimeout))) {
+	return false;
+    }
+    enable_deadlines(idleTimeout, requestTimeout);
+
+    // Pinned before the registry is allocated, such that it is placed with
+    // the workers
+    if (!enable_cpu_sets(get_option(argc, argv, "accept-cpus"),
+	    get_option(argc, argv, "worker-cpus"))) {
+	return false;
+    }
+
+    // Requests beyond either rate (per client address) are delayed, or
+    // rejected once a second's worth is owed
+    char* lookupRateOption = get_option(argc, argv, "lookup-rate");
+    char* listingRateOption = get_option(argc, argv, "list-rate");
+    config->lookupRate = 0;
+    config->listingRate = 0;
+    if ((lookupRateOption && !option_to_int(lookupRateOption, MIN_RATE,
+	    MAX_RATE, &config->lookupRate)) || (listingRateOption &&
+	    !option_to_int(listingRateOption, MIN_RATE, MAX_RATE,
+	    &config->listingRate))) {
+	return false;
+    }
+    if ((portOption && !option_to_int(portOption, PORT_MIN, PORT_MAX,
+	    &config->port)) || (leaseOption && !option_to_int(leaseOption,
+	    MIN_LEASE_DURATION, MAX_LEASE_DURATION,
+	    &config->leaseDuration)) || (listenersOption &&
+	    !option_to_int(listenersOption, MIN_LISTENERS, MAX_LISTENERS,
+	    &config->numListeners))) {
+	return false;
+    }
+    if (peersOption && !(config->peerPorts =
+	    parse_port_list(peersOption, &config->numPeers))) {
+	return false;
+    }
+    int primaryPort;
+    if (config->primaryPort && !option_to_int(config->primaryPort,
+	    PORT_MIN, PORT_MAX, &primaryPort)) {
+	return false;
+    }
+
+    // A follower's registry comes from its primary, hence cannot be seeded
+    char* seedOption = get_option(argc, argv, "seed");
+    config->seedEntries = NULL;
+    config->numSeedEntries = 0;
+    if (seedOption && (config->primaryPort || !(config->seedEntries =
+	    read_seed_file(seedOption, &config->numSeedEntries)))) {
+	return false;
+    }
+    return !unknown_options(argc, argv);
+}
+
+void remove_peer(MapperConfig* config, int thisPortNumber) {
+    for (int peer = 0; peer < config->numPeers; peer++) {
+	if (atoi(config->peerPorts[peer]) == thisPortNumber) {
+	    free(config->peerPorts[peer]);
+	    config->peerPorts[peer] =
+		    config->peerPorts[--(config->numPeers)];
+	    peer--; // check the peer moved into this position
+	}
+    }
+}
 
+void handle_connections(int* serverEnds, MapperConfig* config) {
+    int numListeners = config->numListeners;
     sem_t* lock = (sem_t*)malloc(sizeof(sem_t));
-    int numConnections = INITIAL_NUM_CONNECTIONS;
-    ConnectionInfo* connections = init_connections(lock, numConnections);
-    
-    // Used to ensure each thread gets a unique semaphore
-    int currentConnection = 0;
+    ConnectionInfo* connectionTemplate = init_connections(lock, config);
     sem_init(lock, SHARED_BETWEEN_THREADS, 1);
 
-    while (connectionWrite = accept(serverEnd, NULL, NULL),
+    // The seed is registered before any connection is accepted
+    add_airports(connectionTemplate, config->seedEntries,
+	    config->numSeedEntries);
+    for (int entry = 0; entry < config->numSeedEntries; entry++) {
+	free(config->seedEntries[entry]);
+    }
+    free(config->seedEntries);
+
+    // The lock profile is dumped on SIGUSR1 (and the trace on SIGUSR2), which
+    // every thread created from here on must block
+    if ((config->profileLock || tracing_enabled()) &&
+	    !start_signal_dumper(connectionTemplate->stats)) {
+	sem_destroy(lock);
+	free(lock);
+	return;
+    }
+    if (!start_reaper(connectionTemplate->stats)) {
+	sem_destroy(lock);
+	free(lock);
+	return;
+    }
+
+    // A follower's registry only changes via the replication stream, hence
+    // leases are only expired by the primary
+    if (!start_detached((config->primaryPort) ? follow_primary :
+	    expire_leases, connectionTemplate)) {
+	sem_destroy(lock);
+	free(lock);
+	return;
+    }
+
+    // Listeners only need pinning when sharing the port (or given the
+    // accepting CPUs), in which case each takes the next CPU (its connections'
+    // threads inherit said CPU, unless given the worker CPUs)
+    Listener* listeners = (Listener*)malloc(numListeners * sizeof(Listener));
+    for (int listener = 0; listener < numListeners; listener++) {
+	listeners[listener].serverEnd = serverEnds[listener];
+	listeners[listener].cpu = accept_cpu(listener, numListeners);
+	listeners[listener].connectionTemplate = connectionTemplate;
+    }
+    pthread_t* listenerThreads =
+	    (pthread_t*)malloc(numListeners * sizeof(pthread_t));
+    int numStarted = 1;
+    while (numStarted < numListeners && !pthread_create(listenerThreads +
+	    numStarted, NULL, accept_connections, listeners + numStarted)) {
+	numStarted++;
+    }
+    if (numStarted == numListeners) {
+	accept_connections(listeners); // the first listener uses this thread
+    }
+
+    // Once any listener stops, every other listener is stopped (shutdown()
+    // wakes a blocked accept()) and joined before the listeners are freed
+    for (int listener = 0; listener < numListeners; listener++) {
+	shutdown(serverEnds[listener], SHUT_RDWR);
+    }
+    for (int listener = 1; listener < numStarted; listener++) {
+	pthread_join(listenerThreads[listener], NULL);
+    }
+    free(listenerThreads);
+    free(listeners);
+    // The lock is never destroyed, as the (detached) threads of the
+    // connections accepted may still hold it until the process exits
+}
+
+void* accept_connections(void* thisListener) {
+    Listener* listener = (Listener*)thisListener;
+    int connectionWrite; // file descriptor for accepted socket
+
+    // An unpinned listener still accepts, merely without the locality
+    if (listener->cpu != NO_CPU_PINNING && !pin_to_cpu(listener->cpu)) {
+	fprintf(stderr, "Failed to pin a listener to CPU %d\n",
+		listener->cpu);
+    }
+
+    struct sockaddr_in peer;
+    socklen_t peerLength = sizeof(struct sockaddr_in);
+    while (connectionWrite = accept(listener->serverEnd,
+	    (struct sockaddr*)&peer, &peerLength),
 	    connectionWrite >= 0) { // Ensure accept() succeeded
 
-	// If numConnections is exceeded, allocate more memory (-1 for
-	// indexing purposes)
-	if (currentConnection == numConnections - 1) {
-	    numConnections++;
-	    resize_connections(&connections, &numConnections, lock);
-	    if (numConnections == ERROR_RETURN) {
-		return; // realloc() failed in resize_connections()
-	    }
+	// Each thread gets its own copy of the shared connection information
+	// (free'd by each_connection() when the client disconnects)
+	ConnectionInfo* thisConnection = (ConnectionInfo*)tracked_malloc(
+		MAPPER_MEMORY_CONNECTIONS, sizeof(ConnectionInfo));
+	if (!thisConnection) {
+	    close(connectionWrite);
+	    continue; // malloc() failed, drop this connection only
 	}
-	(connections[currentConnection]).connectionWrite = connectionWrite;
+	*thisConnection = *(listener->connectionTemplate);
+	thisConnection->connectionWrite = connectionWrite;
+	thisConnection->budget = (thisConnection->budgets) ?
+		find_client_budget(thisConnection->budgets,
+		peer.sin_addr.s_addr) : NULL;
+	peerLength = sizeof(struct sockaddr_in);
 
 	pthread_t threadId;
 	pthread_attr_t attributes;
@@ -68,59 +278,49 @@ void handle_connections(int serverEnd) {
 	// Ensure success of all pthread function calls
 	if (pthread_attr_init(&attributes) ||
 		pthread_attr_setdetachstate(&attributes,
-		PTHREAD_CREATE_DETACHED) ||
+		PTHREAD_CREATE_DETACHED) || !pin_worker(&attributes) ||
 		pthread_create(&threadId, &attributes, each_connection,
-		connections + currentConnection) ||
+		thisConnection) ||
 		pthread_attr_destroy(&attributes)) {
-	    sem_destroy(lock);
-	    free(lock);
-	    return;
-	}	
-	currentConnection++;
+	    release_client_budget(thisConnection->budgets,
+		    thisConnection->budget);
+	    tracked_free(thisConnection);
+	    return NULL;
+	}
     }
-    sem_destroy(lock);
-    free(lock);
+    return NULL;
 }
 
-ConnectionInfo* init_connections(sem_t* lock, int numConnections) {
-    ConnectionInfo* connections =
-	    (ConnectionInfo*)malloc(numConnections * sizeof(ConnectionInfo));
+ConnectionInfo* init_connections(sem_t* lock, MapperConfig* config) {
+    ConnectionInfo* connection = (ConnectionInfo*)tracked_malloc(
+	    MAPPER_MEMORY_CONNECTIONS, sizeof(ConnectionInfo));
     
     int* numAirports = (int*)malloc(sizeof(int));
     *numAirports = INITIAL_NUM_AIRPORTS;
     Airport** airports = (Airport**)malloc(sizeof(Airport*));
-    *airports = (Airport*)malloc(sizeof(Airport) * (*numAirports));
+    *airports = (Airport*)tracked_malloc(MAPPER_MEMORY_AIRPORTS,
+	    sizeof(Airport) * (*numAirports));
     init_airports(airports);
-    
-    for (int connection = 0; connection < numConnections; connection++) {
-	// all connections should have access to the same array of airports
-	// and the same lock
-	(connections[connection]).airports = airports;
-	(connections[connection]).numAirports = numAirports;
-	(connections[connection]).guard = lock;
-    }
-    return connections;
-}
-
-void resize_connections(ConnectionInfo** connections, int* numConnections,
-	sem_t* lock) {
-    void* moreConnections =
-	    realloc(*connections, (*numConnections) * sizeof(ConnectionInfo));
-    if (!moreConnections) {
-	*numConnections = ERROR_RETURN;
-	return; // realloc() failed
-    }
-    *connections = moreConnections;
-	    
-    // after reallocating memory, provide the new connection with
-    // required information. NOTE: all connections point to the same
-    // airports array, hence we pick any connection (in this case the
-    // first)
-    ((*connections)[*numConnections - 1]).airports =
-	    ((*connections)[0]).airports;
-    ((*connections)[*numConnections - 1]).numAirports =
-	    ((*connections)[0]).numAirports;
-    ((*connections)[*numConnections - 1]).guard = lock;
+
+    // all connections should have access to the same array of airports and
+    // the same lock
+    connection->airports = airports;
+    connection->numAirports = numAirports;
+    connection->guard = lock;
+    connection->config = config;
+    connection->registrationLog = init_registration_log();
+    connection->airportIndex = init_airport_index();
+    connection->airportFilter = init_airport_filter();
+    connection->stats = init_stats("registry_size", holderNames, ERROR + 1,
+	    NUM_LOCK_HOLDERS, config->profileLock);
+    connection->budgets = init_client_budgets(config);
+    connection->budget = NULL;
+    connection->replication = NULL;
+    if (config->primaryPort) {
+	connection->replication =
+		(ReplicationState*)calloc(1, sizeof(ReplicationState));
+    }
+    return connection;
 }
 
 void* each_connection(void* thisConnection) {
@@ -130,51 +330,180 @@ void* each_connection(void* thisConnection) {
     
     // Ensure dup() succeeded
     if (connectionRead == ERROR_RETURN) {
+	close(thisConnectionOriginal->connectionWrite);
+	release_client_budget(thisConnectionOriginal->budgets,
+		thisConnectionOriginal->budget);
+	tracked_free(thisConnectionOriginal);
 	return NULL;
     }
-    FILE* readEnd = fdopen(connectionRead, "r");
-    FILE* writeEnd = fdopen(thisConnectionOriginal->connectionWrite, "w");
+    ServerStats* stats = thisConnectionOriginal->stats;
+    WatchedConnection* watch = watch_connection(
+	    &thisConnectionOriginal->watch, connectionRead);
+    FILE* readEnd = counted_fdopen(connectionRead, "r", &stats->bytesIn,
+	    watch);
+    FILE* writeEnd = counted_fdopen(thisConnectionOriginal->connectionWrite,
+	    "w", &stats->bytesOut, watch);
     
-    // Ensure fdopen() succeeded
+    // Ensure fdopen() succeeded (closing whichever end was opened)
     if (!readEnd || !writeEnd) {
+	unwatch_connection(&thisConnectionOriginal->watch);
+	if (readEnd) {
+	    fclose(readEnd);
+	} else {
+	    close(connectionRead);
+	}
+	if (writeEnd) {
+	    fclose(writeEnd);
+	} else {
+	    close(thisConnectionOriginal->connectionWrite);
+	}
+	release_client_budget(thisConnectionOriginal->budgets,
+		thisConnectionOriginal->budget);
+	tracked_free(thisConnectionOriginal);
 	return NULL;
     }
+    stat_add(&stats->totalConnections, 1);
+    stat_add(&stats->activeConnections, 1);
+    uint32_t connectionId = capture_connection(); // 0 unless capturing
+
+    // A client choosing the binary protocol sends BINARY_MAGIC first,
+    // anything else is the first character of a text command
+    int first = fgetc(readEnd);
+    bool binary = first == BINARY_MAGIC;
+    if (binary) {
+	serve_binary_connection(thisConnectionOriginal, readEnd, &writeEnd,
+		connectionId);
+    } else if (first != EOF) {
+	ungetc(first, readEnd);
+    }
 
     size_t commandLength = INITIAL_BUFFER_SIZE;
     char* command = (char*)malloc(commandLength * sizeof(char));
 
-    while (get_line(&command, &commandLength, readEnd),
-	    strlen(command) != 0) {
+    while (!binary && (get_line(&command, &commandLength, readEnd),
+	    strlen(command) != 0)) {
+	long long started = monotonic_nanoseconds();
+	CommandType commandType = get_command_type(command);
+	if (commandType != BULK_REGISTER) {
+	    finish_request(&thisConnectionOriginal->watch);
+	}
+	if (!throttle_command(thisConnectionOriginal, commandType)) {
+	    break; // over quota, hence the client is disconnected
+	}
+
+	// A bulk registration's entries follow on their own lines, which are
+	// read (and captured) with it before the lock is taken once for all
+	if (commandType == BULK_REGISTER) {
+	    if (!bulk_register(thisConnectionOriginal, command, connectionId,
+		    readEnd, &writeEnd)) {
+		break;
+	    }
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+	capture_command(connectionId, command);
+
+	// A cluster listing gathers the other partitions over the network,
+	// which must never happen whilst holding the lock (two mappers
+	// listing at once would otherwise each wait on the other's lock)
+	if (thisConnectionOriginal->config->numPeers &&
+		commandType == GET_AIRPORTS) {
+	    display_cluster_airports(thisConnectionOriginal, &writeEnd,
+		    false);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+
+	// A replication stream (or subscription) lasts until the follower
+	// disconnects, however long it stays quiet, hence is exempt from the
+	// deadlines
+	if (commandType == REPLICATE || commandType == SUBSCRIBE) {
+	    unwatch_connection(&thisConnectionOriginal->watch);
+	    record_command(stats, commandType, started);
+	    char* version = index(command, ':');
+	    stream_mutations(thisConnectionOriginal, &writeEnd,
+		    (commandType == REPLICATE) ?
+		    strtoul(command + 1, NULL, 10) : 0,
+		    (commandType == REPLICATE) ?
+		    strtoul(version + 1, NULL, 10) : 0,
+		    commandType == SUBSCRIBE);
+	    break;
+	}
+
+	// Followers are read-only, registrations belong to the primary
+	if (thisConnectionOriginal->config->primaryPort &&
+		(commandType == ADD_AIRPORT || commandType == RENEW_LEASE)) {
+	    forward_to_primary(thisConnectionOriginal->config->primaryPort,
+		    command);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+
+	// The filter is copied under the lock, but sent once it is released
+	if (commandType == GET_FILTER) {
+	    display_airport_filter(thisConnectionOriginal, &writeEnd);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+
+	// Statistics (and memory) are atomic counters, reading them needs no
+	// lock
+	if (commandType == GET_STATS || commandType == GET_LOCK_PROFILE ||
+		commandType == GET_MEMORY) {
+	    display_mapper_stats(thisConnectionOriginal, &writeEnd,
+		    commandType);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+
+	// Listings are built in memory whilst holding the lock, and only sent
+	// to the (possibly slow) client once it is released, such that
+	// lookups never queue behind a client reading a listing
+	char* listingBuffer;
+	size_t listingSize;
+	FILE* listing = (is_listing(commandType)) ? open_listing(writeEnd,
+		&listingBuffer, &listingSize) : writeEnd;
+
 	// Apart from the lock, only the airport data is shared, hence only
 	// processing commands (thus consequently manipulating the airport
 	// data) requires the lock as each thread has its own socket
-	sem_wait(thisConnectionOriginal->guard);
+	long long acquired = stats_guard_wait(thisConnectionOriginal->guard,
+		stats, commandType);
 	
-	process_command(command, thisConnectionOriginal, &writeEnd);
+	process_command(command, thisConnectionOriginal, &listing);
 
 	if (*(thisConnectionOriginal->numAirports) == ERROR_RETURN) {
-	    free(command);
-	    fflush(writeEnd);
-	    fclose(writeEnd);
-	    fclose(readEnd);
-	    sem_post(thisConnectionOriginal->guard);
-	    return NULL; // realloc() failed, return prevents segfault
+	    stats_guard_post(thisConnectionOriginal->guard, stats,
+		    commandType, acquired);
+	    break; // realloc() failed, stop to prevent segfault
+	}
+	stats_guard_post(thisConnectionOriginal->guard, stats, commandType,
+		acquired);
+	if (listing != writeEnd) {
+	    send_listing(listing, &listingBuffer, &listingSize, writeEnd);
 	}
-	sem_post(thisConnectionOriginal->guard);
+	record_command(stats, commandType, started);
     }
+    capture_close(connectionId);
     free(command);
+    unwatch_connection(&thisConnectionOriginal->watch);
+    release_client_budget(thisConnectionOriginal->budgets,
+	    thisConnectionOriginal->budget);
     fflush(writeEnd);
     fclose(writeEnd);
     fclose(readEnd); 
+    stat_add(&stats->activeConnections, -1);
+    tracked_free(thisConnectionOriginal);
     return NULL;
 }
 
 void init_airports(Airport** airports) {
     for (int airport = 0; airport < INITIAL_NUM_AIRPORTS; airport++) {
-	((*airports)[airport]).id = (char*)malloc(INITIAL_BUFFER_SIZE *
-		sizeof(char));
+	((*airports)[airport]).id = (char*)tracked_malloc(
+		MAPPER_MEMORY_AIRPORTS, INITIAL_BUFFER_SIZE * sizeof(char));
 	(((*airports)[airport]).id)[0] = '\0';
 	((*airports)[airport]).portNum = INVALID_PORT;
+	((*airports)[airport]).leaseExpiry = PERMANENT_LEASE;
     }
 }
 
@@ -196,21 +525,42 @@ void process_command(char* command, ConnectionInfo* thisConnection,
 	    add_airport(thisConnection, command);
 	    break;
 	case GET_AIRPORTS:
+	case GET_LOCAL_AIRPORTS:
 	    display_airports(thisConnection, writeEnd);
 	    break;
+	case RENEW_LEASE:
+	    renew_lease(thisConnection, command);
+	    break;
+	case GET_LAG:
+	    display_lag(thisConnection, writeEnd);
+	    break;
+	case GET_PREFIX:
+	case GET_RANGE:
+	    display_airport_range(thisConnection, command, writeEnd);
+	    break;
+	case GET_DELTA:
+	    display_airport_delta(thisConnection, command, writeEnd);
+	    break;
+	case REPLICATE: // handled by each_connection() without the lock
+	case GET_STATS: // likewise
+	case GET_LOCK_PROFILE: // likewise
+	case GET_MEMORY: // likewise
+	case BULK_REGISTER: // likewise
+	case SUBSCRIBE: // likewise
+	case GET_FILTER: // likewise
 	case ERROR:
 	    break;
     }
 }
 
-void add_airport(ConnectionInfo* thisConnection, char* command) {
+bool add_airport(ConnectionInfo* thisConnection, char* command) {
     // The ID is given between ! and : (+ 1 to exclude '!')
     char* colonAndPortNum = index(command, ':'); 
     if (colonAndPortNum == NULL) { // Check if index() failed
-	return;
+	return false;
     }
     int idLength = colonAndPortNum - (command + 1);
-    char* idToAdd = (char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
+    char* idToAdd = (char*)malloc((idLength + 1) * sizeof(char));
     idToAdd[0] = '\0';
     strncat(idToAdd, command + 1, idLength);
 
@@ -219,12 +569,17 @@ void add_airport(ConnectionInfo* thisConnection, char* command) {
     char* port = colonAndPortNum + 1;
     char* portErrors;
     int portNumberToAdd = strtol(port, &portErrors, 10);
+    return insert_airport(thisConnection, idToAdd, idLength,
+	    portNumberToAdd);
+}
 
+bool insert_airport(ConnectionInfo* thisConnection, char* idToAdd,
+	int idLength, int portNumberToAdd) {
     // Check if idToAdd already exists
     if (get_port_number(thisConnection, idToAdd) !=
 	    INVALID_PORT) {
 	free(idToAdd);
-	return;
+	return false;
     }
 
     // *(thisConnection->airports) is initialised with INITIAL_NUM_AIRPORTS
@@ -234,89 +589,803 @@ void add_airport(ConnectionInfo* thisConnection, char* command) {
 	    airport++) {
 	if (((*(thisConnection->airports))[airport]).portNum ==
 		INVALID_PORT) {
+	    Airport* thisAirport = *(thisConnection->airports) + airport;
 
-	    strncat(((*(thisConnection->airports))[airport]).id, idToAdd,
-		    idLength);
-	    free(idToAdd);
+	    // As per add_airports(), longer IDs need more than the space
+	    // each airport begins with
+	    if (idLength >= INITIAL_BUFFER_SIZE) {
+		thisAirport->id = (char*)tracked_realloc(
+			MAPPER_MEMORY_AIRPORTS, thisAirport->id,
+			idLength + 1);
+	    }
+	    thisAirport->id[0] = '\0';
+	    strncat(thisAirport->id, idToAdd, idLength);
 
 	    ((*(thisConnection->airports))[airport]).portNum =
 		    portNumberToAdd;
-	    return;
+	    stat_add(&thisConnection->stats->storedEntries, 1);
+	    record_mutation(thisConnection, idToAdd, portNumberToAdd);
+	    free(idToAdd);
+	    return true;
 	}
     }
     // realloc memory for more airports if required
-    resize_and_add_airport(thisConnection, idToAdd, idLength,
+    return resize_and_add_airport(thisConnection, idToAdd, idLength,
 	    portNumberToAdd);
 }
 
-void resize_and_add_airport(ConnectionInfo* thisConnection, char* idToAdd,
+bool resize_and_add_airport(ConnectionInfo* thisConnection, char* idToAdd,
 	int idLength, int portNumberToAdd) {
     (*(thisConnection->numAirports))++;
     
-    void* moreAirports = realloc(*(thisConnection->airports),
+    void* moreAirports = tracked_realloc(MAPPER_MEMORY_AIRPORTS,
+	    *(thisConnection->airports),
 	    (*(thisConnection->numAirports)) * sizeof(Airport));
     
     if (!moreAirports) {
 	// flag this error to avoid segfaults
 	*(thisConnection->numAirports) = ERROR_RETURN;
 	free(idToAdd);
-	return; // realloc failed
+	return false; // realloc failed
     }
     *(thisConnection->airports) = moreAirports;
 
     // After re-allocating memory, add the new airport
     ((*(thisConnection->airports))[*(thisConnection->numAirports) - 1]).id
-	    = (char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
+	    = (char*)tracked_malloc(MAPPER_MEMORY_AIRPORTS,
+	    ((idLength < INITIAL_BUFFER_SIZE) ? INITIAL_BUFFER_SIZE :
+	    idLength + 1) * sizeof(char));
 
     ((*(thisConnection->airports))[*(thisConnection->numAirports) - 1]).id[0]
 	    = '\0';
     
     strncat(((*(thisConnection->airports))[*(thisConnection->numAirports) -
 	    1]).id, idToAdd, idLength);
-    free(idToAdd);
     
     ((*(thisConnection->airports))[*(thisConnection->numAirports) -
 	    1]).portNum = portNumberToAdd; 
+    ((*(thisConnection->airports))[*(thisConnection->numAirports) -
+	    1]).leaseExpiry = PERMANENT_LEASE;
+    stat_add(&thisConnection->stats->storedEntries, 1);
+    record_mutation(thisConnection, idToAdd, portNumberToAdd);
+    free(idToAdd);
+    return true;
+}
+
+int add_airports(ConnectionInfo* thisConnection, char** registrations,
+	int numRegistrations) {
+    if (numRegistrations == 0) {
+	return 0;
+    }
+    long long acquired = stats_guard_wait(thisConnection->guard,
+	    thisConnection->stats, BULK_REGISTER);
+
+    // Grow once for the whole batch (rather than once per airport, as per
+    // resize_and_add_airport()), each new airport set to the sentinel values
+    // denoting available space
+    int numAirports = *(thisConnection->numAirports);
+    Airport* moreAirports = tracked_realloc(MAPPER_MEMORY_AIRPORTS,
+	    *(thisConnection->airports),
+	    (numAirports + numRegistrations) * sizeof(Airport));
+    int added = 0;
+    if (moreAirports) {
+	*(thisConnection->airports) = moreAirports;
+
+	// Only the space whose ID could be allocated is reserved, the
+	// registrations beyond it are not added
+	int numReserved = 0;
+	while (numReserved < numRegistrations) {
+	    Airport* reserved = moreAirports + numAirports + numReserved;
+	    reserved->id = (char*)tracked_malloc(MAPPER_MEMORY_AIRPORTS,
+		    INITIAL_BUFFER_SIZE * sizeof(char));
+	    if (!reserved->id) {
+		break;
+	    }
+	    reserved->id[0] = '\0';
+	    reserved->portNum = INVALID_PORT;
+	    reserved->leaseExpiry = PERMANENT_LEASE;
+	    numReserved++;
+	}
+	*(thisConnection->numAirports) += numReserved;
+
+	// Index the registered IDs once, then fill the reserved space in
+	// order, rather than add_airport() searching every airport twice
+	// (for the ID, then for space) per registration
+	int numSlots = 1;
+	while (numSlots < 2 * (numAirports + numRegistrations)) {
+	    numSlots *= 2;
+	}
+	char** registered = (char**)calloc(numSlots, sizeof(char*));
+	if (!registered) {
+	    numReserved = 0; // the reserved space is left available
+	}
+	for (int airport = 0; numReserved && airport < numAirports;
+		airport++) {
+	    if (moreAirports[airport].id[0] != '\0') {
+		index_airport_id(registered, numSlots,
+			moreAirports[airport].id);
+	    }
+	}
+	for (int registration = 0; added < numReserved &&
+		registration < numRegistrations; registration++) {
+	    // The ID is given between ! and : (+ 1 to exclude '!')
+	    char* command = registrations[registration];
+	    char* colonAndPortNum = index(command, ':');
+	    Airport* thisAirport = moreAirports + numAirports + added;
+	    int idLength = colonAndPortNum - (command + 1);
+	    if (idLength >= INITIAL_BUFFER_SIZE) {
+		char* longerId = (char*)tracked_realloc(
+			MAPPER_MEMORY_AIRPORTS, thisAirport->id,
+			idLength + 1);
+		if (!longerId) {
+		    continue; // not added, as per a failed add_airport()
+		}
+		thisAirport->id = longerId;
+	    }
+	    thisAirport->id[0] = '\0';
+	    strncat(thisAirport->id, command + 1, idLength);
+	    if (!index_airport_id(registered, numSlots, thisAirport->id)) {
+		thisAirport->id[0] = '\0';
+		continue; // already registered
+	    }
+	    thisAirport->portNum = strtol(colonAndPortNum + 1, NULL, 10);
+	    stat_add(&thisConnection->stats->storedEntries, 1);
+	    record_mutation(thisConnection, thisAirport->id,
+		    thisAirport->portNum);
+	    added++;
+	}
+	free(registered);
+    }
+    stats_guard_post(thisConnection->guard, thisConnection->stats,
+	    BULK_REGISTER, acquired);
+    return added;
+}
+
+bool index_airport_id(char** index, int numSlots, char* id) {
+    // Linear probing from the ID's hash
+    uint32_t slot = hash_id(id) & (numSlots - 1);
+    while (index[slot]) {
+	if (!strcmp(index[slot], id)) {
+	    return false;
+	}
+	slot = (slot + 1) & (numSlots - 1);
+    }
+    index[slot] = id;
+    return true;
+}
+
+bool bulk_register(ConnectionInfo* thisConnection, char* command,
+	uint32_t connectionId, FILE* readEnd, FILE** writeEnd) {
+    int numEntries = atoi(command + 1);
+    int numRegistrations = 0;
+
+    // Should the registrations not fit in memory, the entries are still
+    // read (keeping the connection in step) but none are added
+    char** registrations = (char**)malloc(numEntries * sizeof(char*));
+    if (!registrations) {
+	fprintf(stderr, "Failed to hold %d registrations\n", numEntries);
+    }
+
+    // The batch is captured as a single command (entries included), such
+    // that it is replayed as one
+    size_t batchLength = strlen(command);
+    char* batch = (connectionId) ? strdup(command) : NULL;
+    size_t entryLength = INITIAL_BUFFER_SIZE;
+    char* entry = (char*)malloc(entryLength * sizeof(char));
+    bool complete = true;
+    for (int index = 0; index < numEntries; index++) {
+	if (!get_line(&entry, &entryLength, readEnd)) {
+	    complete = false;
+	    break;
+	}
+	if (batch) {
+	    batch = (char*)realloc(batch, batchLength + strlen(entry) + 2);
+	    batchLength += sprintf(batch + batchLength, "\n%s", entry);
+	}
+
+	// Each entry is validated as the equivalent '!' command, invalid
+	// entries are skipped (as an invalid '!' would be)
+	char* registration = (char*)malloc(strlen(entry) + 2);
+	sprintf(registration, "!%s", entry);
+	if (registrations && get_command_type(registration) == ADD_AIRPORT) {
+	    registrations[numRegistrations++] = registration;
+	} else {
+	    free(registration);
+	}
+    }
+    free(entry);
+    if (complete) {
+	finish_request(&thisConnection->watch); // the entries are the request
+	if (batch) {
+	    capture_command(connectionId, batch);
+	}
+	int added = (thisConnection->config->primaryPort) ?
+		forward_bulk_to_primary(thisConnection->config->primaryPort,
+		registrations, numRegistrations) :
+		add_airports(thisConnection, registrations, numRegistrations);
+	fprintf(*writeEnd, "%d\n", added);
+	fflush(*writeEnd);
+    }
+    free(batch);
+    for (int registration = 0; registration < numRegistrations;
+	    registration++) {
+	free(registrations[registration]);
+    }
+    free(registrations);
+    return complete;
+}
+
+int forward_bulk_to_primary(char* primaryPort, char** registrations,
+	int numRegistrations) {
+    int primaryEnd;
+    if (setup_client(primaryPort, &primaryEnd, false) != ROC_NORMAL) {
+	return 0; // the registrations are lost, as per forward_to_primary()
+    }
+    FILE* toWrite;
+    FILE* toRead;
+    if (!open_streams(primaryEnd, &toWrite, &toRead)) {
+	return 0;
+    }
+    fprintf(toWrite, "*%d\n", numRegistrations);
+    for (int registration = 0; registration < numRegistrations;
+	    registration++) {
+	fprintf(toWrite, "%s\n", registrations[registration] + 1);
+    }
+    fflush(toWrite);
+
+    size_t replyLength = INITIAL_BUFFER_SIZE;
+    char* reply = (char*)malloc(replyLength * sizeof(char));
+    int added = get_line(&reply, &replyLength, toRead) ? atoi(reply) : 0;
+    free(reply);
+    fclose(toRead);
+    fclose(toWrite);
+    return added;
+}
+
+char** read_seed_file(char* path, int* numRegistrations) {
+    FILE* seed = fopen(path, "r");
+    if (!seed) {
+	return NULL;
+    }
+    *numRegistrations = 0;
+    int capacity = INITIAL_NUM_AIRPORTS;
+    char** registrations = (char**)malloc(capacity * sizeof(char*));
+    size_t entryLength = INITIAL_BUFFER_SIZE;
+    char* entry = (char*)malloc(entryLength * sizeof(char));
+    bool valid = registrations && entry;
+    while (valid && get_line(&entry, &entryLength, seed)) {
+	if (entry[0] == '\0') {
+	    continue;
+	}
+	if (*numRegistrations == capacity) {
+	    char** moreRegistrations = (char**)realloc(registrations,
+		    2 * capacity * sizeof(char*));
+	    if (!moreRegistrations) {
+		valid = false;
+		break;
+	    }
+	    registrations = moreRegistrations;
+	    capacity *= 2;
+	}
+	char* registration = (char*)malloc(strlen(entry) + 2);
+	if (!registration) {
+	    valid = false;
+	    break;
+	}
+	sprintf(registration, "!%s", entry);
+	registrations[(*numRegistrations)++] = registration;
+	valid = get_command_type(registration) == ADD_AIRPORT;
+    }
+    free(entry);
+    fclose(seed);
+    if (!valid) {
+	for (int registration = 0; registration < *numRegistrations;
+		registration++) {
+	    free(registrations[registration]);
+	}
+	free(registrations);
+	return NULL;
+    }
+    return registrations;
+}
+
+void renew_lease(ConnectionInfo* thisConnection, char* command) {
+    // The ID is given between ~ and : (+ 1 to exclude '~')
+    char* colonAndPortNum = index(command, ':');
+    if (colonAndPortNum == NULL) { // Check if index() failed
+	return;
+    }
+    char* id = strndup(command + 1, colonAndPortNum - (command + 1));
+    int portNumber = strtol(colonAndPortNum + 1, NULL, 10);
+
+    int airport = find_airport(thisConnection, id);
+    if (airport == ERROR_RETURN) {
+	// Register as per '!' (add_airport() skips the leading character)
+	add_airport(thisConnection, command);
+	airport = find_airport(thisConnection, id);
+    } else if (((*(thisConnection->airports))[airport]).leaseExpiry ==
+	    PERMANENT_LEASE) {
+	airport = ERROR_RETURN; // permanent registrations cannot be leased
+    }
+    free(id);
+    if (airport == ERROR_RETURN) {
+	return;
+    }
+
+    // The control may have restarted on a different port
+    if (((*(thisConnection->airports))[airport]).portNum != portNumber) {
+	((*(thisConnection->airports))[airport]).portNum = portNumber;
+	record_mutation(thisConnection,
+		((*(thisConnection->airports))[airport]).id, portNumber);
+    }
+    ((*(thisConnection->airports))[airport]).leaseExpiry =
+	    time(NULL) + thisConnection->config->leaseDuration;
+}
+
+void* expire_leases(void* connectionInfo) {
+    ConnectionInfo* connection = (ConnectionInfo*)connectionInfo;
+    while (true) {
+	sleep(LEASE_CHECK_INTERVAL);
+	long long acquired = stats_guard_wait(connection->guard,
+		connection->stats, LEASE_EXPIRY);
+	time_t now = time(NULL);
+	for (int airport = 0; airport < *(connection->numAirports);
+		airport++) {
+	    Airport* thisAirport = *(connection->airports) + airport;
+	    if (thisAirport->leaseExpiry != PERMANENT_LEASE &&
+		    thisAirport->leaseExpiry <= now) {
+		remove_airport(connection, airport);
+	    }
+	}
+	stats_guard_post(connection->guard, connection->stats, LEASE_EXPIRY,
+		acquired);
+    }
+    return NULL;
+}
+
+void remove_airport(ConnectionInfo* thisConnection, int airport) {
+    Airport* thisAirport = *(thisConnection->airports) + airport;
+    stat_add(&thisConnection->stats->storedEntries, -1);
+    record_mutation(thisConnection, thisAirport->id, INVALID_PORT);
+
+    // Reset to the sentinel values denoting available space
+    thisAirport->id[0] = '\0';
+    thisAirport->portNum = INVALID_PORT;
+    thisAirport->leaseExpiry = PERMANENT_LEASE;
 }
 
 void display_airports(ConnectionInfo* thisConnection, FILE** writeEnd) {
-    sort_airports(thisConnection);
-    for (int airport = 0; airport < *(thisConnection->numAirports);
-	    airport++) {
-	if (((*(thisConnection->airports))[airport]).id[0] != '\0') {
-	    fprintf(*writeEnd, "%s:%d\n",
-		    ((*(thisConnection->airports))[airport]).id,
-		    ((*(thisConnection->airports))[airport].portNum));
-	    fflush(*writeEnd);
+    // The ordered index is already sorted, hence no airports are moved
+    for (IndexNode* node = thisConnection->airportIndex->head->next[0];
+	    node; node = node->next[0]) {
+	fprintf(*writeEnd, "%s:%d\n", node->id, node->portNum);
+    }
+    fflush(*writeEnd);
+}
+
+void write_airport_frames(ConnectionInfo* thisConnection, FILE** writeEnd) {
+    for (IndexNode* node = thisConnection->airportIndex->head->next[0];
+	    node; node = node->next[0]) {
+	write_frame(*writeEnd, FRAME_ENTRY, node->portNum, node->id);
+    }
+    write_frame(*writeEnd, FRAME_END, ERROR_RETURN, NULL);
+}
+
+bool is_listing(CommandType commandType) {
+    return commandType == GET_AIRPORTS || commandType == GET_LOCAL_AIRPORTS
+	    || commandType == GET_PREFIX || commandType == GET_RANGE ||
+	    commandType == GET_DELTA;
+}
+
+ClientBudgets* init_client_budgets(MapperConfig* config) {
+    if (!config->lookupRate && !config->listingRate) {
+	return NULL;
+    }
+    ClientBudgets* budgets = (ClientBudgets*)tracked_calloc(
+	    MAPPER_MEMORY_BUDGETS, 1, sizeof(ClientBudgets));
+    budgets->lookupRate = config->lookupRate;
+    budgets->listingRate = config->listingRate;
+    pthread_mutex_init(&budgets->budgetLock, NULL);
+    return budgets;
+}
+
+ClientBudget* find_client_budget(ClientBudgets* budgets, in_addr_t address) {
+    long long now = monotonic_nanoseconds();
+    pthread_mutex_lock(&budgets->budgetLock);
+    ClientBudget** slot = budgets->slots + (ntohl(address) %
+	    CLIENT_BUDGET_SLOTS);
+    ClientBudget* budget = NULL;
+    while (*slot) {
+	ClientBudget* candidate = *slot;
+	if (candidate->address == address) {
+	    budget = candidate;
+	} else if (!candidate->numConnections &&
+		token_bucket_full(&candidate->lookups, now) &&
+		token_bucket_full(&candidate->listings, now)) {
+	    // A full budget is no different to a new one, hence forgotten
+	    *slot = candidate->next;
+	    tracked_free(candidate);
+	    continue;
 	}
+	slot = &candidate->next;
     }
+    if (!budget) {
+	budget = (ClientBudget*)tracked_malloc(MAPPER_MEMORY_BUDGETS,
+		sizeof(ClientBudget));
+	budget->address = address;
+	budget->lookups.rate = budgets->lookupRate;
+	budget->listings.rate = budgets->listingRate;
+	init_token_bucket(&budget->lookups, now);
+	init_token_bucket(&budget->listings, now);
+	budget->numConnections = 0;
+	budget->next = NULL;
+	*slot = budget;
+    }
+    budget->numConnections++;
+    pthread_mutex_unlock(&budgets->budgetLock);
+    return budget;
 }
 
-void sort_airports(ConnectionInfo* thisConnection) {
-    for (int airport = 0; airport < *(thisConnection->numAirports);
-	    airport++) {
+void release_client_budget(ClientBudgets* budgets, ClientBudget* budget) {
+    if (!budget) {
+	return;
+    }
+    pthread_mutex_lock(&budgets->budgetLock);
+    budget->numConnections--;
+    pthread_mutex_unlock(&budgets->budgetLock);
+}
+
+bool throttle_command(ConnectionInfo* thisConnection,
+	CommandType commandType) {
+    ClientBudget* budget = thisConnection->budget;
+    if (!budget) {
+	return true;
+    }
+    TokenBucket* bucket = NULL;
+    unsigned long* throttled = NULL;
+    if (commandType == GET_PORT_NUMBER) {
+	bucket = &budget->lookups;
+	throttled = &thisConnection->stats->throttledLookups;
+    } else if (is_listing(commandType) || commandType == GET_FILTER) {
+	bucket = &budget->listings;
+	throttled = &thisConnection->stats->throttledListings;
+    }
+    if (!bucket || !bucket->rate) {
+	return true; // unlimited
+    }
+    pthread_mutex_lock(&thisConnection->budgets->budgetLock);
+    long long wait = take_token(bucket, monotonic_nanoseconds());
+    pthread_mutex_unlock(&thisConnection->budgets->budgetLock);
+    if (wait == ERROR_RETURN) {
+	stat_add(&thisConnection->stats->throttleRejected, 1);
+	return false;
+    }
+    if (wait) {
+	// Delayed without holding any lock, until its token is due
+	stat_add(throttled, 1);
+	struct timespec delay = {wait / 1000000000LL, wait % 1000000000LL};
+	nanosleep(&delay, NULL);
+    }
+    return true;
+}
+
+void serve_binary_connection(ConnectionInfo* thisConnection, FILE* readEnd,
+	FILE** writeEnd, uint32_t connectionId) {
+    ServerStats* stats = thisConnection->stats;
+    Frame frame;
+    memset(&frame, 0, sizeof(Frame));
+    while (read_frame(readEnd, &frame)) {
+	finish_request(&thisConnection->watch);
+	long long started = monotonic_nanoseconds();
+	char* command = (connectionId) ? frame_to_command(&frame) : NULL;
+	if (command) {
+	    capture_command(connectionId, command); // as its text equivalent
+	    free(command);
+	}
+	CommandType commandType = get_frame_type(&frame);
+	if (commandType == ERROR) {
+	    record_command(stats, commandType, started);
+	    continue; // frames are length prefixed, so skip to the next
+	}
+	if (!throttle_command(thisConnection, commandType)) {
+	    break; // over quota, hence the client is disconnected
+	}
+
+	// As per each_connection(), cluster listings and registrations on a
+	// follower happen without the lock
+	if (commandType == GET_AIRPORTS && thisConnection->config->numPeers) {
+	    display_cluster_airports(thisConnection, writeEnd, true);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+	if (commandType == ADD_AIRPORT &&
+		thisConnection->config->primaryPort) {
+	    char* command = frame_to_command(&frame);
+	    forward_to_primary(thisConnection->config->primaryPort, command);
+	    free(command);
+	    record_command(stats, commandType, started);
+	    continue;
+	}
+
+	char* listingBuffer;
+	size_t listingSize;
+	FILE* listing = (is_listing(commandType)) ? open_listing(*writeEnd,
+		&listingBuffer, &listingSize) : *writeEnd;
+	long long acquired = stats_guard_wait(thisConnection->guard, stats,
+		commandType);
+	if (commandType == GET_PORT_NUMBER) {
+	    write_frame(*writeEnd, FRAME_PORT,
+		    get_port_number(thisConnection, frame.id), NULL);
+	} else if (commandType == ADD_AIRPORT) {
+	    insert_airport(thisConnection, strdup(frame.id),
+		    strlen(frame.id), frame.port);
+	} else {
+	    write_airport_frames(thisConnection, &listing);
+	}
+	bool failed = *(thisConnection->numAirports) == ERROR_RETURN;
+	stats_guard_post(thisConnection->guard, stats, commandType,
+		acquired);
 
-	// Compare each element with the succeeding elements and work to the
-	// end of the array
-	for (int nextAirport = airport + 1;
-		nextAirport < *(thisConnection->numAirports); nextAirport++) {
-	    
-	    // strcmp() returns a positive int if, in terms of lexicographic
-	    // order, the first argument should come after the second
-	    // argument. Swap this ordering if this is the case 
-	    if (strcmp(((*(thisConnection->airports))[airport]).id,
-		    ((*(thisConnection->airports))[nextAirport]).id) > 0) {
-		
-		// standard swap with temporary variable
-		Airport toSwap = (*(thisConnection->airports))[airport];
-		
-		(*(thisConnection->airports))[airport] =
-			(*(thisConnection->airports))[nextAirport];
-		
-		(*(thisConnection->airports))[nextAirport] = toSwap;
+	// Unlike text replies, frames (and listings) are flushed once the
+	// lock is released
+	if (listing != *writeEnd) {
+	    send_listing(listing, &listingBuffer, &listingSize, *writeEnd);
+	}
+	fflush(*writeEnd);
+	record_command(stats, commandType, started);
+	if (failed) {
+	    break; // realloc() failed, stop to prevent segfault
+	}
+    }
+    free(frame.payload);
+}
+
+CommandType get_frame_type(Frame* frame) {
+    switch (frame->type) {
+	case FRAME_QUERY:
+	    return GET_PORT_NUMBER;
+	case FRAME_LIST:
+	    return (frame->length == 0) ? GET_AIRPORTS : ERROR;
+	case FRAME_REGISTER:
+	    // The ID is stored (and listed as text) as per '!', hence must be
+	    // valid as text and fit the airport's ID
+	    if (frame->id[0] != '\0' && !check_invalid_chars(frame->id) &&
+		    strlen(frame->id) < INITIAL_BUFFER_SIZE &&
+		    frame->port >= PORT_MIN && frame->port <= PORT_MAX) {
+		return ADD_AIRPORT;
 	    }
+    }
+    return ERROR;
+}
+
+AirportIndex* init_airport_index(void) {
+    AirportIndex* airportIndex = (AirportIndex*)tracked_malloc(
+	    MAPPER_MEMORY_INDEX, sizeof(AirportIndex));
+    airportIndex->head = (IndexNode*)tracked_calloc(MAPPER_MEMORY_INDEX, 1,
+	    sizeof(IndexNode) +
+	    INDEX_MAX_LEVELS * sizeof(IndexNode*));
+    airportIndex->head->numLevels = INDEX_MAX_LEVELS;
+    airportIndex->numLevels = 1;
+    airportIndex->seed = time(NULL);
+    return airportIndex;
+}
+
+IndexNode* seek_airport_index(AirportIndex* airportIndex, char* id,
+	IndexNode** previous) {
+    // Descend from the highest level, moving right whilst the next ID is
+    // still less than the ID sought
+    IndexNode* node = airportIndex->head;
+    for (int level = airportIndex->numLevels - 1; level >= 0; level--) {
+	while (node->next[level] && strcmp(node->next[level]->id, id) < 0) {
+	    node = node->next[level];
+	}
+	if (previous) {
+	    previous[level] = node;
+	}
+    }
+    return node->next[0];
+}
+
+int update_airport_index(AirportIndex* airportIndex, char* id,
+	int portNum) {
+    IndexNode* previous[INDEX_MAX_LEVELS];
+    IndexNode* node = seek_airport_index(airportIndex, id, previous);
+    bool found = node && !strcmp(node->id, id);
+
+    if (found && portNum != INVALID_PORT) {
+	node->portNum = portNum;
+    } else if (found) {
+	for (int level = 0; level < node->numLevels; level++) {
+	    previous[level]->next[level] = node->next[level];
+	}
+	tracked_free(node->id);
+	tracked_free(node);
+	return -1;
+    } else if (portNum != INVALID_PORT) {
+	// Each node reaches one level higher with probability one half
+	int numLevels = 1;
+	int bits = rand_r(&airportIndex->seed);
+	while (numLevels < INDEX_MAX_LEVELS && (bits & 1)) {
+	    numLevels++;
+	    bits >>= 1;
+	}
+	for (int level = airportIndex->numLevels; level < numLevels;
+		level++) {
+	    previous[level] = airportIndex->head;
+	}
+	if (numLevels > airportIndex->numLevels) {
+	    airportIndex->numLevels = numLevels;
+	}
+	node = (IndexNode*)tracked_malloc(MAPPER_MEMORY_INDEX,
+		sizeof(IndexNode) + numLevels * sizeof(IndexNode*));
+	node->id = tracked_strdup(MAPPER_MEMORY_INDEX, id);
+	node->portNum = portNum;
+	node->numLevels = numLevels;
+	for (int level = 0; level < numLevels; level++) {
+	    node->next[level] = previous[level]->next[level];
+	    previous[level]->next[level] = node;
+	}
+	return 1;
+    }
+    return 0;
+}
+
+AirportFilter* init_airport_filter(void) {
+    AirportFilter* airportFilter = (AirportFilter*)tracked_malloc(
+	    MAPPER_MEMORY_FILTER, sizeof(AirportFilter));
+    airportFilter->counters = (unsigned char*)tracked_calloc(
+	    MAPPER_MEMORY_FILTER, FILTER_MAX_BITS,
+	    sizeof(unsigned char));
+    airportFilter->bits = (unsigned char*)tracked_calloc(
+	    MAPPER_MEMORY_FILTER, FILTER_MAX_BITS / 8,
+	    sizeof(unsigned char));
+    airportFilter->numEntries = 0;
+    return airportFilter;
+}
+
+void update_airport_filter(AirportFilter* airportFilter, char* id,
+	int change) {
+    for (int hash = 0; hash < FILTER_HASHES; hash++) {
+	uint32_t bit = filter_bit(id, hash, FILTER_MAX_BITS);
+	unsigned char* counter = airportFilter->counters + bit;
+	// A saturated counter no longer knows how many IDs it counts
+	if (*counter != UCHAR_MAX) {
+	    *counter += change;
+	}
+	if (*counter) {
+	    airportFilter->bits[bit / 8] |= 1 << (bit % 8);
+	} else {
+	    airportFilter->bits[bit / 8] &= ~(1 << (bit % 8));
+	}
+    }
+    airportFilter->numEntries += change;
+}
+
+void display_airport_filter(ConnectionInfo* thisConnection,
+	FILE** writeEnd) {
+    long long acquired = stats_guard_wait(thisConnection->guard,
+	    thisConnection->stats, GET_FILTER);
+    AirportFilter* airportFilter = thisConnection->airportFilter;
+    uint32_t numBits = FILTER_MIN_BITS;
+    while (numBits < FILTER_MAX_BITS &&
+	    numBits < airportFilter->numEntries * FILTER_BITS_PER_ENTRY) {
+	numBits *= 2;
+    }
+    unsigned char* allBits = (unsigned char*)malloc(FILTER_MAX_BITS / 8);
+    memcpy(allBits, airportFilter->bits, FILTER_MAX_BITS / 8);
+    stats_guard_post(thisConnection->guard, thisConnection->stats,
+	    GET_FILTER, acquired);
+
+    // Folding (see filter_bit()) keeps every bit set, hence every ID. As
+    // numBits is a multiple of eight, each byte folds onto a whole byte.
+    unsigned char* bits = (unsigned char*)calloc(numBits / 8,
+	    sizeof(unsigned char));
+    for (uint32_t byte = 0; byte < FILTER_MAX_BITS / 8; byte++) {
+	bits[byte & (numBits / 8 - 1)] |= allBits[byte];
+    }
+    free(allBits);
+
+    fprintf(*writeEnd, "%u:%d:", numBits, FILTER_HASHES);
+    for (uint32_t byte = 0; byte < numBits / 8; byte++) {
+	fprintf(*writeEnd, "%02x", bits[byte]);
+    }
+    fprintf(*writeEnd, "\n");
+    fflush(*writeEnd);
+    free(bits);
+}
+
+void display_airport_range(ConnectionInfo* thisConnection, char* command,
+	FILE** writeEnd) {
+    // A prefix is the range of IDs beginning with it, which (unlike a
+    // range) needs no upper bound to be found in the index
+    char* low = strdup(command + 1);
+    char* high = NULL;
+    size_t prefixLength = 0;
+    if (command[0] == '[') {
+	high = index(low, ':');
+	*high++ = '\0'; // split low from high
+    } else {
+	prefixLength = strlen(low);
+    }
+
+    for (IndexNode* node = seek_airport_index(thisConnection->airportIndex,
+	    low, NULL); node; node = node->next[0]) {
+	if ((high) ? high[0] != '\0' && strcmp(node->id, high) >= 0 :
+		strncmp(node->id, low, prefixLength) != 0) {
+	    break;
+	}
+	fprintf(*writeEnd, "%s:%d\n", node->id, node->portNum);
+    }
+    fflush(*writeEnd);
+    free(low);
+}
+
+void display_airport_delta(ConnectionInfo* thisConnection, char* command,
+	FILE** writeEnd) {
+    unsigned long epoch = strtoul(command + 1, NULL, 10);
+    unsigned long since = strtoul(index(command, ':') + 1, NULL, 10);
+    RegistrationLog* registrationLog = thisConnection->registrationLog;
+    pthread_mutex_lock(&registrationLog->logLock);
+    unsigned long version = registrationLog->nextSequence - 1;
+    unsigned long oldestLogged = (registrationLog->nextSequence >
+	    REGISTRATION_LOG_SIZE) ? registrationLog->nextSequence -
+	    REGISTRATION_LOG_SIZE : 1;
+
+    // As per stream_mutations(), a client of another epoch, ahead of the
+    // registry or behind the log is sent a snapshot instead
+    if (epoch != registrationLog->epoch || since > version ||
+	    since + 1 < oldestLogged) {
+	pthread_mutex_unlock(&registrationLog->logLock);
+	fprintf(*writeEnd, "=%lu:%lu\n", registrationLog->epoch, version);
+	for (IndexNode* node = thisConnection->airportIndex->head->next[0];
+		node; node = node->next[0]) {
+	    fprintf(*writeEnd, "+%s:%d\n", node->id, node->portNum);
+	}
+	fprintf(*writeEnd, ".\n");
+	fflush(*writeEnd);
+	return;
+    }
+
+    // Mutations are only recorded whilst the mapper's lock is held, hence
+    // the IDs copied cannot be freed before this delta is displayed
+    int numChanges = version - since;
+    Mutation* changes = (Mutation*)malloc((numChanges + 1) *
+	    sizeof(Mutation));
+    for (int change = 0; change < numChanges; change++) {
+	changes[change] = registrationLog->mutations[(since + 1 + change) %
+		REGISTRATION_LOG_SIZE];
+    }
+    pthread_mutex_unlock(&registrationLog->logLock);
+
+    // Each ID's changes are adjacent once sorted, the last being its latest
+    qsort(changes, numChanges, sizeof(Mutation), compare_mutations);
+    fprintf(*writeEnd, ">%lu:%lu\n", registrationLog->epoch, version);
+    for (int change = 0; change < numChanges; change++) {
+	if (change + 1 < numChanges &&
+		!strcmp(changes[change].id, changes[change + 1].id)) {
+	    continue; // superseded
 	}
+	if (changes[change].portNum == INVALID_PORT) {
+	    fprintf(*writeEnd, "-%s\n", changes[change].id);
+	} else {
+	    fprintf(*writeEnd, "+%s:%d\n", changes[change].id,
+		    changes[change].portNum);
+	}
+    }
+    fprintf(*writeEnd, ".\n");
+    fflush(*writeEnd);
+    free(changes);
+}
+
+int compare_mutations(const void* first, const void* second) {
+    const Mutation* firstMutation = (const Mutation*)first;
+    const Mutation* secondMutation = (const Mutation*)second;
+    int difference = strcmp(firstMutation->id, secondMutation->id);
+    if (difference) {
+	return difference;
     }
+    return (firstMutation->sequence > secondMutation->sequence) -
+	    (firstMutation->sequence < secondMutation->sequence);
 }
 
 int get_port_number(ConnectionInfo* thisConnection, char* idOfPort) {
@@ -329,6 +1398,600 @@ int get_port_number(ConnectionInfo* thisConnection, char* idOfPort) {
     return INVALID_PORT; // if no such airport exists
 }
 
+char** snapshot_airports(ConnectionInfo* thisConnection, int* numEntries) {
+    long long acquired = stats_guard_wait(thisConnection->guard,
+	    thisConnection->stats, PEER_SNAPSHOT);
+    char** entries = (char**)malloc((*(thisConnection->numAirports) + 1) *
+	    sizeof(char*));
+    *numEntries = 0;
+    for (IndexNode* node = thisConnection->airportIndex->head->next[0];
+	    node; node = node->next[0]) {
+	entries[*numEntries] = (char*)malloc(strlen(node->id) +
+		PORT_STRING_SIZE + 1);
+	sprintf(entries[(*numEntries)++], "%s:%d", node->id, node->portNum);
+    }
+    stats_guard_post(thisConnection->guard, thisConnection->stats,
+	    PEER_SNAPSHOT, acquired);
+    return entries;
+}
+
+char** fetch_peer_airports(char* peerPort, int* numEntries) {
+    int peerEnd;
+    *numEntries = 0;
+    if (setup_client(peerPort, &peerEnd, false) != ROC_NORMAL) {
+	fprintf(stderr, "Failed to list airports of mapper %s\n", peerPort);
+	return NULL;
+    }
+    FILE* toWrite;
+    FILE* toRead;
+    if (!open_streams(peerEnd, &toWrite, &toRead)) {
+	fprintf(stderr, "Failed to list airports of mapper %s\n", peerPort);
+	return NULL;
+    }
+
+    // The listing is not terminated, so close the writing side and let the
+    // peer close the connection once it has listed its airports
+    fprintf(toWrite, "@local\n");
+    fflush(toWrite);
+    shutdown(peerEnd, SHUT_WR);
+
+    int capacity = INITIAL_NUM_AIRPORTS;
+    char** entries = (char**)malloc(capacity * sizeof(char*));
+    size_t entryLength = INITIAL_BUFFER_SIZE;
+    char* entry = (char*)malloc(entryLength * sizeof(char));
+    bool complete = entries && entry;
+    while (complete && get_line(&entry, &entryLength, toRead)) {
+	if (*numEntries == capacity) {
+	    char** moreEntries = (char**)realloc(entries,
+		    capacity * RESIZING_FACTOR * sizeof(char*));
+	    if (!moreEntries) {
+		complete = false;
+		break;
+	    }
+	    entries = moreEntries;
+	    capacity *= RESIZING_FACTOR;
+	}
+	if (!(entries[*numEntries] = strdup(entry))) {
+	    complete = false;
+	    break;
+	}
+	(*numEntries)++;
+    }
+    free(entry);
+    fclose(toRead);
+    fclose(toWrite);
+    if (!complete) {
+	fprintf(stderr, "Failed to list airports of mapper %s\n", peerPort);
+	for (int fetched = 0; entries && fetched < *numEntries; fetched++) {
+	    free(entries[fetched]);
+	}
+	free(entries);
+	*numEntries = 0;
+	return NULL;
+    }
+    return entries;
+}
+
+int compare_listing_ids(const char* first, const char* second) {
+    // Entries are ID:port and IDs never contain ':', hence treat ':' as the
+    // end of each ID (comparing entire entries would order "A!" before "A")
+    size_t firstLength = strcspn(first, ":");
+    size_t secondLength = strcspn(second, ":");
+    int difference = memcmp(first, second, (firstLength < secondLength) ?
+	    firstLength : secondLength);
+    if (difference) {
+	return difference;
+    }
+    return (firstLength > secondLength) - (firstLength < secondLength);
+}
+
+void display_cluster_airports(ConnectionInfo* thisConnection,
+	FILE** writeEnd, bool binary) {
+    // The first listing is this mapper's own, the rest are its peers'
+    int numListings = thisConnection->config->numPeers + 1;
+    char*** listings = (char***)malloc(numListings * sizeof(char**));
+    int* sizes = (int*)malloc(numListings * sizeof(int));
+    int* positions = (int*)calloc(numListings, sizeof(int));
+
+    listings[0] = snapshot_airports(thisConnection, sizes);
+    bool complete = true;
+    for (int peer = 0; peer < thisConnection->config->numPeers; peer++) {
+	listings[peer + 1] = fetch_peer_airports(
+		thisConnection->config->peerPorts[peer], sizes + peer + 1);
+	complete = complete && listings[peer + 1];
+    }
+
+    // Each listing is already sorted, hence repeatedly display the smallest
+    // of the entries at the front of each listing
+    while (true) {
+	int smallest = ERROR_RETURN;
+	for (int listing = 0; listing < numListings; listing++) {
+	    if (positions[listing] < sizes[listing] &&
+		    (smallest == ERROR_RETURN || compare_listing_ids(
+		    listings[listing][positions[listing]],
+		    listings[smallest][positions[smallest]]) < 0)) {
+		smallest = listing;
+	    }
+	}
+	if (smallest == ERROR_RETURN) {
+	    break; // every listing has been displayed
+	}
+	char* entry = listings[smallest][positions[smallest]++];
+	if (binary) {
+	    // Entries are ID:port, hence the port follows the last ':'
+	    char* colonAndPortNum = strrchr(entry, ':');
+	    *colonAndPortNum = '\0';
+	    write_frame(*writeEnd, FRAME_ENTRY, atoi(colonAndPortNum + 1),
+		    entry);
+	} else {
+	    fprintf(*writeEnd, "%s\n", entry);
+	}
+    }
+    // The client is told (rather than left to assume the listing whole)
+    // when the airports of any peer are missing
+    if (binary) {
+	write_frame(*writeEnd, (complete) ? FRAME_END : FRAME_PARTIAL,
+		ERROR_RETURN, NULL);
+    } else if (!complete) {
+	fprintf(*writeEnd, "%s\n", PARTIAL_LISTING);
+    }
+    fflush(*writeEnd);
+
+    for (int listing = 0; listing < numListings; listing++) {
+	for (int entry = 0; entry < sizes[listing]; entry++) {
+	    free(listings[listing][entry]);
+	}
+	free(listings[listing]);
+    }
+    free(listings);
+    free(sizes);
+    free(positions);
+}
+
+RegistrationLog* init_registration_log(void) {
+    RegistrationLog* registrationLog = (RegistrationLog*)tracked_malloc(
+	    MAPPER_MEMORY_LOG, sizeof(RegistrationLog));
+    registrationLog->mutations = (Mutation*)tracked_calloc(MAPPER_MEMORY_LOG,
+	    REGISTRATION_LOG_SIZE, sizeof(Mutation));
+    registrationLog->nextSequence = 1;
+    registrationLog->epoch = (unsigned long)milliseconds_since_epoch();
+    pthread_mutex_init(&registrationLog->logLock, NULL);
+    pthread_cond_init(&registrationLog->newMutation, NULL);
+    return registrationLog;
+}
+
+void record_mutation(ConnectionInfo* thisConnection, char* id, int portNum) {
+    // Only registrations and removals change the filter, not new ports
+    int change = update_airport_index(thisConnection->airportIndex, id,
+	    portNum);
+    if (change) {
+	update_airport_filter(thisConnection->airportFilter, id, change);
+    }
+    RegistrationLog* registrationLog = thisConnection->registrationLog;
+    pthread_mutex_lock(&registrationLog->logLock);
+
+    // Overwrite the oldest mutation in the ring
+    Mutation* mutation = registrationLog->mutations +
+	    (registrationLog->nextSequence % REGISTRATION_LOG_SIZE);
+    tracked_free(mutation->id);
+    mutation->id = tracked_strdup(MAPPER_MEMORY_LOG, id);
+    mutation->portNum = portNum;
+    mutation->sequence = registrationLog->nextSequence++;
+    mutation->timestamp = milliseconds_since_epoch();
+
+    pthread_cond_broadcast(&registrationLog->newMutation);
+    pthread_mutex_unlock(&registrationLog->logLock);
+}
+
+unsigned long stream_snapshot(ConnectionInfo* thisConnection,
+	FILE** writeEnd, bool subscriber) {
+    // The version must match the airports exactly, hence read both under
+    // the lock (mutations are only recorded whilst it is held)
+    long long acquired = stats_guard_wait(thisConnection->guard,
+	    thisConnection->stats, REPLICATION_SNAPSHOT);
+    pthread_mutex_lock(&thisConnection->registrationLog->logLock);
+    unsigned long version = thisConnection->registrationLog->nextSequence - 1;
+    pthread_mutex_unlock(&thisConnection->registrationLog->logLock);
+
+    // The airports are copied (as ID:port), such that they are written to
+    // the (possibly slow) client without holding the lock
+    char** entries = (char**)malloc((*(thisConnection->numAirports) + 1) *
+	    sizeof(char*));
+    int numEntries = 0;
+    for (int airport = 0; airport < *(thisConnection->numAirports);
+	    airport++) {
+	Airport* thisAirport = *(thisConnection->airports) + airport;
+	if (thisAirport->portNum != INVALID_PORT) {
+	    entries[numEntries] = (char*)malloc(strlen(thisAirport->id) +
+		    PORT_STRING_SIZE + 1);
+	    sprintf(entries[numEntries++], "%s:%d", thisAirport->id,
+		    thisAirport->portNum);
+	}
+    }
+    stats_guard_post(thisConnection->guard, thisConnection->stats,
+	    REPLICATION_SNAPSHOT, acquired);
+
+    long long now = milliseconds_since_epoch();
+    if (subscriber) {
+	fprintf(*writeEnd, "=%lu\n", version);
+    } else {
+	fprintf(*writeEnd, "=%lu:%lu:%d\n",
+		thisConnection->registrationLog->epoch, version, numEntries);
+    }
+    for (int entry = 0; entry < numEntries; entry++) {
+	if (subscriber) {
+	    fprintf(*writeEnd, "+%s\n", entries[entry]);
+	} else {
+	    fprintf(*writeEnd, "+%lu:%lld:%s\n", version, now, entries[entry]);
+	}
+	free(entries[entry]);
+    }
+    free(entries);
+    fflush(*writeEnd);
+    return version;
+}
+
+void stream_mutations(ConnectionInfo* thisConnection, FILE** writeEnd,
+	unsigned long epoch, unsigned long version, bool subscriber) {
+    RegistrationLog* registrationLog = thisConnection->registrationLog;
+    unsigned long nextToSend = version + 1;
+
+    // Subscribers always begin with a snapshot, as do followers whose
+    // version was numbered in another epoch (the same version of another
+    // epoch may hold entirely different airports)
+    bool snapshotRequired = subscriber || epoch != registrationLog->epoch;
+
+    // The mutations not yet sent are the client's backlog, which for a
+    // subscriber is bounded more tightly than the log itself
+    unsigned long maxBacklog = (subscriber) ? SUBSCRIBER_BACKLOG :
+	    REGISTRATION_LOG_SIZE;
+    while (!ferror(*writeEnd)) {
+	pthread_mutex_lock(&registrationLog->logLock);
+	unsigned long oldestLogged = (registrationLog->nextSequence >
+		maxBacklog) ? registrationLog->nextSequence - maxBacklog : 1;
+
+	// A snapshot is also needed if the follower is further behind than
+	// the log reaches (or claims to be ahead of it)
+	if (snapshotRequired || nextToSend < oldestLogged ||
+		nextToSend > registrationLog->nextSequence) {
+	    snapshotRequired = false;
+	    pthread_mutex_unlock(&registrationLog->logLock);
+	    nextToSend = stream_snapshot(thisConnection, writeEnd,
+		    subscriber) + 1;
+	    continue;
+	}
+
+	if (nextToSend == registrationLog->nextSequence) {
+	    // Nothing new, wait for a mutation (or send a heartbeat)
+	    struct timespec deadline;
+	    clock_gettime(CLOCK_REALTIME, &deadline);
+	    deadline.tv_sec += REPLICATION_HEARTBEAT_INTERVAL;
+	    if (pthread_cond_timedwait(&registrationLog->newMutation,
+		    &registrationLog->logLock, &deadline) &&
+		    nextToSend == registrationLog->nextSequence) {
+		pthread_mutex_unlock(&registrationLog->logLock);
+		if (subscriber) {
+		    fprintf(*writeEnd, "#%lu\n", nextToSend - 1);
+		} else {
+		    fprintf(*writeEnd, "#%lu:%lu:%lld\n",
+			    registrationLog->epoch, nextToSend - 1,
+			    milliseconds_since_epoch());
+		}
+		fflush(*writeEnd);
+		continue;
+	    }
+	    pthread_mutex_unlock(&registrationLog->logLock);
+	    continue;
+	}
+
+	// Copy the pending mutations, such that they are written to the
+	// (possibly slow) follower without holding the log's lock
+	int numPending = registrationLog->nextSequence - nextToSend;
+	Mutation* pending = (Mutation*)malloc(numPending * sizeof(Mutation));
+	for (int mutation = 0; mutation < numPending; mutation++) {
+	    pending[mutation] = registrationLog->mutations[(nextToSend +
+		    mutation) % REGISTRATION_LOG_SIZE];
+	    pending[mutation].id = strdup(pending[mutation].id);
+	}
+	nextToSend = registrationLog->nextSequence;
+	pthread_mutex_unlock(&registrationLog->logLock);
+
+	for (int mutation = 0; mutation < numPending; mutation++) {
+	    if (subscriber && pending[mutation].portNum == INVALID_PORT) {
+		fprintf(*writeEnd, "-%s\n", pending[mutation].id);
+	    } else if (subscriber) {
+		fprintf(*writeEnd, "+%s:%d\n", pending[mutation].id,
+			pending[mutation].portNum);
+	    } else if (pending[mutation].portNum == INVALID_PORT) {
+		fprintf(*writeEnd, "-%lu:%lld:%s\n",
+			pending[mutation].sequence,
+			pending[mutation].timestamp, pending[mutation].id);
+	    } else {
+		fprintf(*writeEnd, "+%lu:%lld:%s:%d\n",
+			pending[mutation].sequence,
+			pending[mutation].timestamp, pending[mutation].id,
+			pending[mutation].portNum);
+	    }
+	    free(pending[mutation].id);
+	}
+	free(pending);
+	fflush(*writeEnd);
+    }
+}
+
+void* follow_primary(void* connectionInfo) {
+    ConnectionInfo* connection = (ConnectionInfo*)connectionInfo;
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+
+    while (true) {
+	int primaryEnd;
+	FILE* toWrite;
+	FILE* toRead;
+	if (setup_client(connection->config->primaryPort, &primaryEnd,
+		false) == ROC_NORMAL &&
+		open_streams(primaryEnd, &toWrite, &toRead)) {
+	    // Resume from the version already applied
+	    long long acquired = stats_guard_wait(connection->guard,
+		    connection->stats, REPLICATION_APPLY);
+	    fprintf(toWrite, ">%lu:%lu\n",
+		    connection->replication->primaryEpoch,
+		    connection->replication->appliedSequence);
+	    connection->replication->connected = true;
+	    stats_guard_post(connection->guard, connection->stats,
+		    REPLICATION_APPLY, acquired);
+	    fflush(toWrite);
+
+	    // A line from another epoch means the primary restarted under
+	    // this stream (as does a snapshot cut short), so reconnect (and
+	    // be sent a snapshot)
+	    bool inStep = true;
+	    while (inStep && get_line(&line, &lineLength, toRead)) {
+		if (line[0] == '=') {
+		    inStep = receive_snapshot(connection, line, toRead);
+		    continue;
+		}
+		acquired = stats_guard_wait(connection->guard,
+			connection->stats, REPLICATION_APPLY);
+		inStep = apply_replicated_line(connection, line);
+		stats_guard_post(connection->guard, connection->stats,
+			REPLICATION_APPLY, acquired);
+	    }
+	    acquired = stats_guard_wait(connection->guard, connection->stats,
+		    REPLICATION_APPLY);
+	    connection->replication->connected = false;
+	    stats_guard_post(connection->guard, connection->stats,
+		    REPLICATION_APPLY, acquired);
+	    fclose(toRead);
+	    fclose(toWrite);
+	}
+	sleep(FOLLOW_RETRY_INTERVAL);
+    }
+    free(line);
+    return NULL;
+}
+
+bool receive_snapshot(ConnectionInfo* thisConnection, char* header,
+	FILE* readEnd) {
+    char* countStart = index(header, ':');
+    countStart = (countStart) ? index(countStart + 1, ':') : NULL;
+    int numEntries;
+    if (!countStart || !option_to_int(countStart + 1, 0, INT_MAX,
+	    &numEntries)) {
+	return false; // malformed, hence resynchronise
+    }
+
+    // The airports are read without the lock, such that a slow primary
+    // never stalls the follower's clients
+    char** entries = (char**)malloc((numEntries + 1) * sizeof(char*));
+    int numRead = 0;
+    bool complete = entries != NULL;
+    while (complete && numRead < numEntries) {
+	size_t entryLength = INITIAL_BUFFER_SIZE;
+	char* entry = (char*)malloc(entryLength * sizeof(char));
+	if (!entry || !get_line(&entry, &entryLength, readEnd)) {
+	    free(entry);
+	    complete = false;
+	    break;
+	}
+	entries[numRead++] = entry;
+    }
+    if (complete) {
+	long long acquired = stats_guard_wait(thisConnection->guard,
+		thisConnection->stats, REPLICATION_APPLY);
+	complete = apply_snapshot(thisConnection, header, entries,
+		numEntries);
+	stats_guard_post(thisConnection->guard, thisConnection->stats,
+		REPLICATION_APPLY, acquired);
+    }
+    for (int entry = 0; entry < numRead; entry++) {
+	free(entries[entry]);
+    }
+    free(entries);
+    return complete;
+}
+
+bool apply_snapshot(ConnectionInfo* thisConnection, char* header,
+	char** entries, int numEntries) {
+    // Every airport (of the snapshot and the registry) is indexed at most
+    // once, as per add_airports()
+    int numSlots = 1;
+    while (numSlots < 2 * (numEntries + *(thisConnection->numAirports))) {
+	numSlots *= 2;
+    }
+    char** snapshotIds = (char**)calloc(numSlots, sizeof(char*));
+    if (!snapshotIds) {
+	return false;
+    }
+
+    // Each entry is +sequence:time:ID:port, whose ID is terminated in place
+    for (int entry = 0; entry < numEntries; entry++) {
+	char* id = index(entries[entry], ':');
+	id = (id) ? index(id + 1, ':') : NULL;
+	char* port = (id) ? index(id + 1, ':') : NULL;
+	if (entries[entry][0] != '+' || !port) {
+	    entries[entry][0] = '\0'; // malformed, hence skipped
+	    continue;
+	}
+	*port = '\0';
+	index_airport_id(snapshotIds, numSlots, id + 1);
+    }
+
+    // Only the airports absent from the snapshot are removed, and those
+    // present are merely updated, such that no airport the primary holds
+    // ever appears removed to this follower's clients
+    for (int airport = 0; airport < *(thisConnection->numAirports);
+	    airport++) {
+	Airport* thisAirport = *(thisConnection->airports) + airport;
+	if (thisAirport->portNum != INVALID_PORT &&
+		index_airport_id(snapshotIds, numSlots, thisAirport->id)) {
+	    remove_airport(thisConnection, airport);
+	}
+    }
+    free(snapshotIds);
+    for (int entry = 0; entry < numEntries; entry++) {
+	if (entries[entry][0] != '\0') {
+	    char* id = index(index(entries[entry], ':') + 1, ':') + 1;
+	    set_airport(thisConnection, id,
+		    strtol(id + strlen(id) + 1, NULL, 10));
+	}
+    }
+
+    // The header is =epoch:version:count
+    ReplicationState* replication = thisConnection->replication;
+    replication->primaryEpoch = strtoul(header + 1, NULL, 10);
+    replication->primarySequence = strtoul(index(header, ':') + 1, NULL,
+	    10);
+    replication->appliedSequence = replication->primarySequence;
+    replication->lastContact = milliseconds_since_epoch();
+    return true;
+}
+
+bool apply_replicated_line(ConnectionInfo* thisConnection, char* line) {
+    ReplicationState* replication = thisConnection->replication;
+    char* timestampStart = index(line, ':');
+    unsigned long sequence = strtoul(line + 1, NULL, 10);
+    replication->lastContact = milliseconds_since_epoch();
+
+    // Heartbeats lead with the epoch of the primary
+    if (line[0] == '#' && timestampStart) {
+	if (sequence != replication->primaryEpoch) {
+	    return false;
+	}
+	sequence = strtoul(timestampStart + 1, NULL, 10);
+	timestampStart = index(timestampStart + 1, ':');
+    }
+    if (!timestampStart) {
+	return true; // malformed line
+    }
+    long long timestamp = strtoll(timestampStart + 1, NULL, 10);
+    char* id = index(timestampStart + 1, ':');
+
+    if (line[0] == '#') {
+	replication->primarySequence = sequence;
+	return true;
+    }
+    if (!id || (line[0] != '+' && line[0] != '-')) {
+	return true; // malformed line
+    }
+    id++;
+    if (line[0] == '+') {
+	char* port = index(id, ':');
+	if (!port) {
+	    return true;
+	}
+	*port = '\0'; // terminate the ID
+	set_airport(thisConnection, id, strtol(port + 1, NULL, 10));
+    } else {
+	int airport = find_airport(thisConnection, id);
+	if (airport != ERROR_RETURN) {
+	    remove_airport(thisConnection, airport);
+	}
+    }
+    if (sequence > replication->primarySequence) {
+	replication->primarySequence = sequence;
+    }
+    replication->appliedSequence = sequence;
+    replication->applyDelay = replication->lastContact - timestamp;
+    return true;
+}
+
+void set_airport(ConnectionInfo* thisConnection, char* id, int portNum) {
+    int airport = find_airport(thisConnection, id);
+    if (airport == ERROR_RETURN) {
+	// Register as per '!' (add_airport() skips the leading character)
+	char* command = (char*)malloc(strlen(id) + PORT_STRING_SIZE + 2);
+	sprintf(command, "!%s:%d", id, portNum);
+	add_airport(thisConnection, command);
+	free(command);
+    } else if (((*(thisConnection->airports))[airport]).portNum != portNum) {
+	((*(thisConnection->airports))[airport]).portNum = portNum;
+	record_mutation(thisConnection, id, portNum);
+    }
+}
+
+void forward_to_primary(char* primaryPort, char* command) {
+    int primaryEnd;
+    if (setup_client(primaryPort, &primaryEnd, false) != ROC_NORMAL) {
+	return; // the registration is lost, as if sent to a dead mapper
+    }
+    FILE* toWrite = fdopen(primaryEnd, "w");
+    if (!toWrite) {
+	close(primaryEnd);
+	return;
+    }
+    fprintf(toWrite, "%s\n", command);
+    fclose(toWrite);
+}
+
+void display_lag(ConnectionInfo* thisConnection, FILE** writeEnd) {
+    ReplicationState* replication = thisConnection->replication;
+    if (!replication) {
+	// The primary is never behind itself
+	pthread_mutex_lock(&thisConnection->registrationLog->logLock);
+	unsigned long version =
+		thisConnection->registrationLog->nextSequence - 1;
+	pthread_mutex_unlock(&thisConnection->registrationLog->logLock);
+	fprintf(*writeEnd, "role:primary\nprimary:%lu\napplied:%lu\n"
+		"behind:0\n.\n", version, version);
+    } else {
+	fprintf(*writeEnd, "role:follower\nconnected:%d\nprimary:%lu\n"
+		"applied:%lu\nbehind:%lu\napply_delay_ms:%lld\n"
+		"last_contact_ms:%lld\n.\n", replication->connected,
+		replication->primarySequence, replication->appliedSequence,
+		replication->primarySequence - replication->appliedSequence,
+		replication->applyDelay, (replication->lastContact) ?
+		milliseconds_since_epoch() - replication->lastContact : -1);
+    }
+    fflush(*writeEnd);
+}
+
+void display_mapper_stats(ConnectionInfo* thisConnection, FILE** writeEnd,
+	CommandType commandType) {
+    if (commandType == GET_LOCK_PROFILE) {
+	display_lock_profile(thisConnection->stats, *writeEnd);
+    } else if (commandType == GET_MEMORY) {
+	display_memory(*writeEnd);
+    } else {
+	display_stats(thisConnection->stats, *writeEnd);
+    }
+    fprintf(*writeEnd, ".\n");
+    fflush(*writeEnd);
+}
+
+int find_airport(ConnectionInfo* thisConnection, char* idOfPort) {
+    for (int airport = 0; airport < *(thisConnection->numAirports);
+	    airport++) {
+	if (((*(thisConnection->airports))[airport]).portNum !=
+		INVALID_PORT &&
+		!strcmp(((*(thisConnection->airports))[airport]).id,
+		idOfPort)) {
+	    return airport;
+	}
+    }
+    return ERROR_RETURN; // if no such airport exists
+}
+
 CommandType get_command_type(char* command) {
     // Ensures that an ID and/or port is actually provided
     if (strlen(command) > 1) {
@@ -336,12 +1999,13 @@ CommandType get_command_type(char* command) {
 	if (command[0] == '?' && !check_invalid_chars(command + 1)) {
 	    return GET_PORT_NUMBER;
 	}
-	if (command[0] == '!') {
-	    // The ID is given between ! and :
+	// Registrations ('!') and leased registrations ('~') share a format
+	if (command[0] == '!' || command[0] == '~') {
+	    // The ID is given between ! (or ~) and :
 	    char* colonAndPortNum = index(command, ':'); 
 	    if (colonAndPortNum != NULL) { // Check if index() failed
 		int idLength = colonAndPortNum - (command + 1);
-		char* id = (char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
+		char* id = (char*)malloc((idLength + 1) * sizeof(char));
 		id[0] = '\0';
 		strncat(id, command + 1, idLength);
 
@@ -358,13 +2022,68 @@ CommandType get_command_type(char* command) {
 			portNumber <= PORT_MAX &&
 			portNumber >= PORT_MIN) {
 		    free(id);
-		    return ADD_AIRPORT;
+		    return (command[0] == '!') ? ADD_AIRPORT : RENEW_LEASE;
 		}
+		free(id);
 	    }
 	}
     }
     if (!strcmp(command, "@")) {
 	return GET_AIRPORTS;
     }
+    if (!strcmp(command, "@local")) {
+	return GET_LOCAL_AIRPORTS;
+    }
+    // Mirrors request the changes since the epoch and version they hold
+    // (@epoch:version)
+    if (command[0] == '@' && is_epoch_and_version(command + 1)) {
+	return GET_DELTA;
+    }
+    if (!strcmp(command, "lag")) {
+	return GET_LAG;
+    }
+    if (!strcmp(command, "stats")) {
+	return GET_STATS;
+    }
+    if (!strcmp(command, "lockprof")) {
+	return GET_LOCK_PROFILE;
+    }
+    if (!strcmp(command, "memory")) {
+	return GET_MEMORY;
+    }
+    if (!strcmp(command, "subscribe")) {
+	return SUBSCRIBE;
+    }
+    if (!strcmp(command, "bloom")) {
+	return GET_FILTER;
+    }
+    // Prefix listings give the prefix (^prefix) and range listings the
+    // bounds ([low:high), any of which may be empty
+    if (command[0] == '^' && !check_invalid_chars(command + 1)) {
+	return GET_PREFIX;
+    }
+    if (command[0] == '[' && character_counter(command, ':') == 1 &&
+	    !character_counter(command, '\r')) {
+	return GET_RANGE;
+    }
+    // Followers request mutations after the epoch and version they hold
+    // (>epoch:version)
+    if (command[0] == '>' && is_epoch_and_version(command + 1)) {
+	return REPLICATE;
+    }
+    // Bulk registrations give the number of entries which follow (*count)
+    int numEntries;
+    if (command[0] == '*' && strspn(command + 1, "0123456789") ==
+	    strlen(command + 1) && option_to_int(command + 1, 1,
+	    MAX_BULK_ENTRIES, &numEntries)) {
+	return BULK_REGISTER;
+    }
     return ERROR;
 }
+
+bool is_epoch_and_version(char* token) {
+    char* version = index(token, ':');
+    return version && version > token && version[1] != '\0' &&
+	    strspn(token, "0123456789") == (size_t)(version - token) &&
+	    strspn(version + 1, "0123456789") == strlen(version + 1);
+}
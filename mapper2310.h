@@ -12,6 +12,9 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <netinet/in.h>
 #include "errors.h"
 #include "general.h"
 
@@ -19,27 +22,211 @@
  * start, and reallocate memory if more airports are to be stored. */
 #define INITIAL_NUM_AIRPORTS 10
 
-/* The mapper will store connection information for each client. Let us allow
- * information of upto 15 connections to be stored initially, and reallocate
- * memory if more connections are made. */
-#define INITIAL_NUM_CONNECTIONS 15
-
 /* Initialise port numbers of airports to 0. Set to valid port after added by
  * user. */
 #define INVALID_PORT 0
 
+/* Airports registered via '!' never expire. Those registered via '~' hold a
+ * lease which must be renewed (by repeating the '~' command) before it
+ * expires. */
+#define PERMANENT_LEASE 0
+
+/* Unless given via --lease, leased airports expire 15 seconds after their
+ * last renewal. */
+#define DEFAULT_LEASE_DURATION 15
+
+/* Bounds (in seconds) of the lease duration given via --lease. */
+#define MIN_LEASE_DURATION 1
+#define MAX_LEASE_DURATION 86400
+
+/* Number of seconds between checks for expired leases. */
+#define LEASE_CHECK_INTERVAL 1
+
+/* Number of the most recent mutations (registrations and removals) kept in
+ * the registration log. A follower further behind than this is sent a
+ * snapshot of the registry instead. */
+#define REGISTRATION_LOG_SIZE 4096
+
+/* Number of mutations a subscriber (see stream_mutations()) may fall behind
+ * by. A slower subscriber is sent a fresh snapshot instead, hence each
+ * subscriber's backlog is bounded and registrations never wait on it. */
+#define SUBSCRIBER_BACKLOG 1024
+
+/* Number of seconds a replication stream may be idle before a heartbeat is
+ * sent, such that followers can report how recently they heard from the
+ * primary. */
+#define REPLICATION_HEARTBEAT_INTERVAL 1
+
+/* Number of seconds a follower waits before reconnecting to its primary. */
+#define FOLLOW_RETRY_INTERVAL 1
+
+/* Number of levels of the ordered index's skip list (see AirportIndex).
+ * Each level links about half the nodes of the level below, hence this
+ * suffices for far more airports than a mapper can hold. */
+#define INDEX_MAX_LEVELS 32
+
+/* Bounds (in requests per second, per client address) of the rates given via
+ * --lookup-rate and --list-rate. */
+#define MIN_RATE 1
+#define MAX_RATE 1000000
+
+/* Number of slots of the table of client budgets (see ClientBudgets). */
+#define CLIENT_BUDGET_SLOTS 256
+
+/* Upper bound of the number of entries of a bulk registration ('*'). */
+#define MAX_BULK_ENTRIES 100000
+
+/* Last line of a cluster listing missing the airports of any mapper. As it
+ * holds no ':', it cannot be mistaken for an ID:port entry. */
+#define PARTIAL_LISTING "partial"
+
+/* Categories of the mapper's tracked memory (see tracked_malloc()) */
+typedef enum {
+    MAPPER_MEMORY_AIRPORTS = 0, // the airports and their IDs
+    MAPPER_MEMORY_INDEX = 1,
+    MAPPER_MEMORY_FILTER = 2,
+    MAPPER_MEMORY_LOG = 3,
+    MAPPER_MEMORY_CONNECTIONS = 4, // each connection's information
+    MAPPER_MEMORY_BUDGETS = 5,
+    NUM_MAPPER_MEMORY = 6
+} MapperMemory;
+
 /* Client Commands Types */
 typedef enum {
     GET_PORT_NUMBER = 1,
     ADD_AIRPORT = 2,
     GET_AIRPORTS = 3,
-    ERROR = 4
+    RENEW_LEASE = 4,
+    GET_LOCAL_AIRPORTS = 5,
+    REPLICATE = 6,
+    GET_LAG = 7,
+    GET_STATS = 8,
+    GET_LOCK_PROFILE = 9,
+    BULK_REGISTER = 10,
+    SUBSCRIBE = 11,
+    GET_PREFIX = 12,
+    GET_RANGE = 13,
+    GET_FILTER = 14,
+    GET_MEMORY = 15,
+    GET_DELTA = 16,
+    ERROR = 17
 } CommandType;
 
+/* Holders of the lock other than commands (which are identified by their
+ * CommandType), as distinguished by the lock profile (--lockprof) */
+typedef enum {
+    LEASE_EXPIRY = ERROR + 1, // expire_leases()
+    PEER_SNAPSHOT = ERROR + 2, // snapshot_airports()
+    REPLICATION_SNAPSHOT = ERROR + 3, // stream_snapshot()
+    REPLICATION_APPLY = ERROR + 4, // follow_primary()
+    NUM_LOCK_HOLDERS = ERROR + 5
+} LockHolder;
+
+/* Mapper Configuration (as per the command line options) */
+typedef struct {
+    int port; // 0 for an ephemeral port
+    int leaseDuration; // seconds
+    int numListeners;
+    char** peerPorts; // other mappers in the cluster, excluding this one
+    int numPeers;
+    char* primaryPort; // NULL unless following a primary (read replica)
+    bool profileLock; // as per --lockprof
+    char** seedEntries; // registrations (as per '!') loaded via --seed
+    int numSeedEntries;
+    int lookupRate; // per client address per second, 0 for unlimited
+    int listingRate;
+} MapperConfig;
+
+/* Client Budget. The token buckets shared by every connection from a single
+ * client address: one for lookups ('?') and one for the (far costlier)
+ * listings ('@', '^', '[' and bloom). */
+typedef struct ClientBudget {
+    in_addr_t address;
+    TokenBucket lookups;
+    TokenBucket listings;
+    int numConnections; // forgotten once none remain and both are full
+    struct ClientBudget* next; // in the same slot
+} ClientBudget;
+
+/* Table of the client budgets, hashed by address. Only accessed whilst
+ * holding budgetLock (never together with the mapper's lock). */
+typedef struct {
+    ClientBudget* slots[CLIENT_BUDGET_SLOTS];
+    int lookupRate;
+    int listingRate;
+    pthread_mutex_t budgetLock;
+} ClientBudgets;
+
+/* Registration Log Entry. Records a registration (or a change of port) or,
+ * if portNum is INVALID_PORT, the removal of an airport. */
+typedef struct {
+    char* id;
+    uint16_t portNum;
+    unsigned long sequence;
+    long long timestamp; // milliseconds since the epoch when committed
+} Mutation;
+
+/* Registration Log Representation. Holds the most recent mutations of the
+ * registry in a ring, each numbered by sequence. The sequence of the latest
+ * mutation is the version of the registry. Sequences restart with the
+ * mapper, hence a version is only meaningful alongside the epoch it was
+ * numbered in. NOTE: mutations are recorded whilst the mapper's lock is
+ * held, but readers only need logLock. */
+typedef struct {
+    Mutation* mutations; // ring, indexed by sequence % REGISTRATION_LOG_SIZE
+    unsigned long nextSequence; // the first mutation is numbered 1
+    unsigned long epoch; // start time (in milliseconds), never 0
+    pthread_mutex_t logLock;
+    pthread_cond_t newMutation;
+} RegistrationLog;
+
+/* Replication State of a follower (read replica). Only accessed whilst the
+ * mapper's lock is held. */
+typedef struct {
+    unsigned long primaryEpoch; // epoch of the primary, 0 before a snapshot
+    unsigned long primarySequence; // latest sequence known at the primary
+    unsigned long appliedSequence; // latest sequence applied locally
+    long long applyDelay; // milliseconds from commit to local application
+    long long lastContact; // milliseconds since the epoch
+    bool connected;
+} ReplicationState;
+
+/* Ordered Index Node. Holds its own copy of an airport's ID and port, and
+ * the next node (in lexicographic order of ID) at each of its levels. */
+typedef struct IndexNode {
+    char* id;
+    uint16_t portNum;
+    int numLevels;
+    struct IndexNode* next[]; // numLevels entries
+} IndexNode;
+
+/* Ordered Index of the airports (a skip list), kept in step with every
+ * mutation of the registry (see update_airport_index()), such that prefix
+ * and range listings cost in proportion to their matches rather than to the
+ * registry. NOTE: only accessed whilst the mapper's lock is held. */
+typedef struct {
+    IndexNode* head; // sentinel (no ID) with INDEX_MAX_LEVELS levels
+    int numLevels; // in use by any node
+    unsigned int seed; // of the levels drawn, as per rand_r()
+} AirportIndex;
+
+/* Membership Filter of the registered airport IDs: a counting Bloom filter
+ * of FILTER_MAX_BITS counters, such that removals can be undone. Counters
+ * saturate (and then stay) at UCHAR_MAX. The filter's bits (set where a
+ * counter is non-zero) are kept packed alongside, such that displaying the
+ * filter need not walk every counter. NOTE: only accessed whilst the
+ * mapper's lock is held. */
+typedef struct {
+    unsigned char* counters;
+    unsigned char* bits; // FILTER_MAX_BITS bits, eight per byte
+    unsigned long numEntries;
+} AirportFilter;
+
 /* Airport representation */
 typedef struct {
     char* id;
     uint16_t portNum;
+    time_t leaseExpiry; // PERMANENT_LEASE unless registered via '~'
 } Airport;
 
 /* Connection Information Representation */
@@ -47,11 +234,40 @@ typedef struct {
     Airport** airports;
     int* numAirports;
     sem_t* guard;
+    MapperConfig* config; // identical for every connection
+    RegistrationLog* registrationLog;
+    AirportIndex* airportIndex;
+    AirportFilter* airportFilter;
+    ServerStats* stats;
+    ReplicationState* replication; // NULL unless following a primary
+    ClientBudgets* budgets; // NULL unless rate limited
+    ClientBudget* budget; // of this connection's client address
     int connectionWrite;
+    WatchedConnection watch; // each connection's own (see each_connection())
 } ConnectionInfo;
 
-/* Takes in the listening socket. Accepts connections and acts as entry point
- * for client-server communication. This function should ideally never return
+/* Listener Representation. Each listener accepts connections on its own
+ * socket (all sharing the mapper's port) from its own thread. */
+typedef struct {
+    int serverEnd;
+    int cpu; // as per accept_cpu()
+    ConnectionInfo* connectionTemplate;
+} Listener;
+
+/* Takes in the number of command line arguments, the command line arguments
+ * and an empty configuration. Populates said configuration from the options
+ * given (see get_option()), and returns if every option was valid. */
+bool parse_mapper_options(int* argc, char** argv, MapperConfig* config);
+
+/* Takes in the configuration and this mapper's port. Removes said port from
+ * the peers, such that every mapper in a cluster may be given the same list
+ * of ports. */
+void remove_peer(MapperConfig* config, int thisPortNumber);
+
+/* Takes in the listening sockets (all bound to the same port) and the
+ * configuration (for the number of said sockets). Accepts connections on
+ * every socket (see accept_connections()) and acts as entry point for
+ * client-server communication. This function should ideally never return
  * as it will continuously accept connections, thus running until killed. It
  * may return prematurely should any error(s) arise, at which point the
  * program will terminate.
@@ -69,13 +285,12 @@ typedef struct {
  * called said function and what the function should do in the given case)
  * were explored, and overall it was deemed to be better design to keep these
  * functions separate. */
-void handle_connections(int serverEnd);
+void handle_connections(int* serverEnds, MapperConfig* config);
 
-/* Takes in the connection information representations, the number of said
- * representations, and the thread lock. If required, reallocates more memory
- * to store more connection information representations. */
-void resize_connections(ConnectionInfo** connections, int* numConnections,
-	sem_t* lock);
+/* Takes in a listener. Pins the calling thread to the listener's CPU (if
+ * any), then accepts connections on the listener's socket, handing each to
+ * its own thread (see each_connection()). Returns only on error. */
+void* accept_connections(void* thisListener);
 
 /* Takes in a connection's information representation. Listens to a specific
  * client for any commands and processes them accordingly.
@@ -106,38 +321,355 @@ void process_command(char* command, ConnectionInfo* thisConnection,
  * appropriate type. */
 CommandType get_command_type(char* command);
 
-/* Takes in the thread lock and the initial number of connection information
- * representations. Allocates memory for each connection information
- * representation and returns said representations. */
-ConnectionInfo* init_connections(sem_t* lock, int numConnections);
+/* Takes in the part of a command following its prefix. Returns if said part
+ * is an epoch and a version of the registry (epoch:version), as given by
+ * followers ('>') and mirrors ('@'). */
+bool is_epoch_and_version(char* token);
+
+/* Takes in the thread lock and the configuration. Allocates the shared
+ * airports and returns a connection information representation to be copied
+ * for each connection. NOTE: every accepted connection receives its own copy
+ * (free'd by each_connection() once the client disconnects), as registration
+ * sessions hold their connection (and thus their thread) open indefinitely
+ * and must never be left pointing at reallocated memory. */
+ConnectionInfo* init_connections(sem_t* lock, MapperConfig* config);
 
 /* Takes in the airports. Allocates memory for each airport representation. */
 void init_airports(Airport** airports);
 
 /* Takes in this connection's information representation, and the command to
  * add a new airport. Adds said airport and reallocates memory in case more
- * than *(thisConnection->numAirports) airports are to be stored. */
-void add_airport(ConnectionInfo* thisConnection, char* command);
+ * than *(thisConnection->numAirports) airports are to be stored. Returns if
+ * the airport was added (i.e. was not already registered). */
+bool add_airport(ConnectionInfo* thisConnection, char* command);
+
+/* Helper function for add_airport(). Takes in this connection's information
+ * representation, the id of the airport to be added (malloc'd, free'd by
+ * this function), the length of said id and the port number of the airport.
+ * Adds said airport unless already registered, returning if it was added. */
+bool insert_airport(ConnectionInfo* thisConnection, char* idToAdd,
+	int idLength, int portNumberToAdd);
 
 /* Helper function for add_airport(). Takes in this connection's information
  * representation, the id of the airport to be added, the length of the id to
  * be added, and the port number of the airport to be added. Reallocates more
- * memory to store the new airport and adds said airport. */
-void resize_and_add_airport(ConnectionInfo* thisConnection, char* idToAdd,
+ * memory to store the new airport and adds said airport. Returns if the
+ * reallocation succeeded. */
+bool resize_and_add_airport(ConnectionInfo* thisConnection, char* idToAdd,
 	int idLength, int portNumberToAdd);
 
+/* Takes in this connection's information representation, the registrations
+ * (each as per '!', i.e. !ID:port, already validated) and the number of said
+ * registrations. Adds every airport not already registered under a single
+ * acquisition of the lock, reserving the space for all of them at once and
+ * finding duplicates via a hash index (see index_airport_id()) rather than
+ * searching the airports for each. Returns the number of airports added.
+ * NOTE: the lock must NOT be held by the caller. */
+int add_airports(ConnectionInfo* thisConnection, char** registrations,
+	int numRegistrations);
+
+/* Takes in an open addressed hash index of airport IDs, its number of slots
+ * (a power of two, never full) and an airport ID. Inserts said ID unless
+ * already present and returns if it was inserted. */
+bool index_airport_id(char** index, int numSlots, char* id);
+
+/* Takes in this connection's information representation, the bulk
+ * registration command ('*' followed by the number of entries), the number
+ * of the connection (see capture_connection()) and both ends of the network
+ * communication. Reads said number of ID:port entries, then registers the
+ * valid ones (see add_airports()), or forwards them to the primary if
+ * following one. Replies with the number of airports added. Returns false if
+ * the client disconnected before sending every entry (none are added). */
+bool bulk_register(ConnectionInfo* thisConnection, char* command,
+	uint32_t connectionId, FILE* readEnd, FILE** writeEnd);
+
+/* Takes in the port of the primary, the registrations (as per
+ * add_airports()) and the number of said registrations. Sends said
+ * registrations to the primary as one bulk registration and returns the
+ * number of airports it added (0 if it could not be reached). */
+int forward_bulk_to_primary(char* primaryPort, char** registrations,
+	int numRegistrations);
+
+/* Takes in the path of a seed file (one ID:port per line, blank lines
+ * ignored) and an empty space to store the number of registrations. Returns
+ * each entry as a registration (as per add_airports()), or NULL if the file
+ * cannot be read, holds an invalid entry or does not fit in memory. */
+char** read_seed_file(char* path, int* numRegistrations);
+
+/* Takes in this connection's information representation, and the command to
+ * register or renew a leased airport ('~' followed by ID:port). Adds said
+ * airport if required, otherwise updates its port. In either case the lease
+ * is extended by the lease duration. Airports registered permanently (via
+ * '!') are left untouched. */
+void renew_lease(ConnectionInfo* thisConnection, char* command);
+
+/* Takes in this connection's information representation and the index of an
+ * airport. Removes said airport (recording the removal), freeing its space
+ * for new airports. NOTE: the lock must be held by the caller. */
+void remove_airport(ConnectionInfo* thisConnection, int airport);
+
+/* Takes in a connection information representation (for access to the
+ * shared airports). Periodically removes every airport whose lease has
+ * expired, freeing its space for new airports. Never returns. */
+void* expire_leases(void* connectionInfo);
+
 /* Takes in this connection's information representation, and the write end of
  * the network communication. Displays the airports in lexicographic order of
- * the airport IDs (after being sorted). */
+ * the airport IDs (as per the ordered index). */
 void display_airports(ConnectionInfo* thisConnection, FILE** writeEnd);
 
-/* Takes in this connection's information representation. Sorts the airports
- * in lexicographic order of the airport IDs. */
-void sort_airports(ConnectionInfo* thisConnection);
+/* As per display_airports(), except each airport is written as a FRAME_ENTRY
+ * followed by a FRAME_END (see write_frame()), without flushing. */
+void write_airport_frames(ConnectionInfo* thisConnection, FILE** writeEnd);
+
+/* Takes in a command type. Returns if said command lists airports, hence is
+ * built whilst holding the lock but sent once it is released (see
+ * open_listing()). */
+bool is_listing(CommandType commandType);
+
+/* Takes in the mapper's configuration. Returns an empty table of client
+ * budgets, or NULL if neither --lookup-rate nor --list-rate was given. */
+ClientBudgets* init_client_budgets(MapperConfig* config);
+
+/* Takes in the table of client budgets and a client's address. Returns the
+ * budget of said address (created full if there is none), counting one more
+ * connection to it. Budgets of other addresses in the same slot which are
+ * no longer needed are forgotten along the way. */
+ClientBudget* find_client_budget(ClientBudgets* budgets, in_addr_t address);
+
+/* Takes in the table of client budgets and a budget (NULL for none), whose
+ * connection is closing. Counts one less connection to said budget. */
+void release_client_budget(ClientBudgets* budgets, ClientBudget* budget);
+
+/* Takes in this connection's information representation and the type of the
+ * command received. Takes a token from said connection's client budget for
+ * lookups or listings (other commands are not limited), waiting (without
+ * the lock) until it is due. Returns false if said client is over quota,
+ * in which case the command must not be served. */
+bool throttle_command(ConnectionInfo* thisConnection,
+	CommandType commandType);
+
+/* Takes in this connection's information representation, both ends of the
+ * network communication (the binary magic already read) and the number of
+ * the connection (see capture_connection()). Serves frames (see
+ * read_frame()) until the client disconnects: queries, registrations and
+ * listings, as per their text equivalents. Frames of any other type, or
+ * with an invalid ID or port, are ignored as invalid text commands are. */
+void serve_binary_connection(ConnectionInfo* thisConnection, FILE* readEnd,
+	FILE** writeEnd, uint32_t connectionId);
+
+/* Takes in a frame. Validates the frame and returns the type of the
+ * equivalent text command (ERROR if invalid). */
+CommandType get_frame_type(Frame* frame);
+
+/* Allocates and returns an empty ordered index. */
+AirportIndex* init_airport_index(void);
+
+/* Takes in an ordered index, an ID and an empty space for the last node
+ * preceding said ID at each level (NULL if not needed). Returns the first
+ * node whose ID is not less than said ID, or NULL if there is none. */
+IndexNode* seek_airport_index(AirportIndex* airportIndex, char* id,
+	IndexNode** previous);
+
+/* Takes in an ordered index, an airport ID and its (new) port, or
+ * INVALID_PORT if said airport was removed. Inserts, updates or removes
+ * said airport's node accordingly. Returns 1 if the airport was inserted, -1
+ * if removed, else 0. */
+int update_airport_index(AirportIndex* airportIndex, char* id,
+	int portNum);
+
+/* Allocates and returns an empty membership filter. */
+AirportFilter* init_airport_filter(void);
+
+/* Takes in a membership filter, an airport ID and 1 if said airport was
+ * registered, or -1 if removed. Counts said ID in (or out of) said filter,
+ * setting (or clearing) the bits of the counters which become non-zero (or
+ * zero). */
+void update_airport_filter(AirportFilter* airportFilter, char* id,
+	int change);
+
+/* Takes in this connection's information representation and the write end
+ * of the network communication. Displays the membership filter, folded to
+ * FILTER_BITS_PER_ENTRY bits per airport (as a power of two, between
+ * FILTER_MIN_BITS and FILTER_MAX_BITS), as a single line:
+ *     numBits:FILTER_HASHES:bits
+ * where the bits are in hex, two digits per byte (see filter_may_contain()).
+ * The lock is only held to copy the packed bits, which are folded once it
+ * is released. NOTE: the lock must NOT be held by the caller. */
+void display_airport_filter(ConnectionInfo* thisConnection,
+	FILE** writeEnd);
+
+/* Takes in this connection's information representation, a prefix ('^ID')
+ * or range ('[low:high') command and the write end of the network
+ * communication. Displays, in lexicographic order of ID, the airports whose
+ * IDs begin with said prefix, or lie from low (inclusive) up to high
+ * (exclusive), where an empty low or high leaves the range unbounded. NOTE:
+ * the lock must be held by the caller. */
+void display_airport_range(ConnectionInfo* thisConnection, char* command,
+	FILE** writeEnd);
+
+/* Takes in this connection's information representation, a delta command
+ * ('@epoch:version', the version the client already holds, 0:0 for none)
+ * and the write end of the network communication. Displays the epoch and
+ * version of the registry and the airports changed since said version, in
+ * lexicographic order of ID and each only once (as its latest change).
+ * Should said version be of another epoch (i.e. from before the mapper
+ * restarted), older than the registration log reaches or newer than the
+ * registry, every airport is displayed instead. Only this mapper's own
+ * airports are included. NOTE: the lock must be held by the caller. Delta
+ * lines are:
+ *     >epoch:version           changes follow
+ *     =epoch:version           snapshot follows, replacing all airports
+ *     +ID:port                 airport registered (or port changed)
+ *     -ID                      airport removed
+ *     .                        end of the delta
+ */
+void display_airport_delta(ConnectionInfo* thisConnection, char* command,
+	FILE** writeEnd);
+
+/* Takes in two mutations. Returns the order of said mutations by ID, and by
+ * sequence for the same ID (as per qsort()). */
+int compare_mutations(const void* first, const void* second);
 
 /* Takes in this connection's information representation, and the airport ID
  * of the port number in question. Returns the port number of the airport
  * requested. If no such airport exists, returns INVALID_PORT. */
 int get_port_number(ConnectionInfo* thisConnection, char* idOfPort);
 
+/* Takes in this connection's information representation and an empty space
+ * to store the number of entries. Returns a copy of each airport as ID:port,
+ * in order (as per the ordered index, under the lock), such that the copy
+ * can be used once the lock is released. */
+char** snapshot_airports(ConnectionInfo* thisConnection, int* numEntries);
+
+/* Takes in the port of another mapper in the cluster and an empty space to
+ * store the number of entries. Requests (and returns) the airports owned by
+ * said mapper as ID:port, in order. Returns NULL (with an error) if the
+ * mapper could not be reached or its airports do not fit in memory. */
+char** fetch_peer_airports(char* peerPort, int* numEntries);
+
+/* Takes in two listing entries (ID:port). Compares said entries by ID only,
+ * as per strcmp(). */
+int compare_listing_ids(const char* first, const char* second);
+
+/* Takes in this connection's information representation, the write end of
+ * the network communication and whether to write frames (as per
+ * write_airport_frames()) rather than text. Displays the airports of every
+ * mapper in the cluster, merged in lexicographic order of the airport IDs.
+ * Should any mapper fail to be listed, the listing ends with a line holding
+ * PARTIAL_LISTING (or a FRAME_PARTIAL in place of the FRAME_END). NOTE: the
+ * lock must NOT be held by the caller. */
+void display_cluster_airports(ConnectionInfo* thisConnection,
+	FILE** writeEnd, bool binary);
+
+/* Allocates and returns an empty registration log, in a fresh epoch. */
+RegistrationLog* init_registration_log(void);
+
+/* Takes in this connection's information representation, an airport ID and
+ * its (new) port, or INVALID_PORT if said airport was removed. Records the
+ * mutation in the registration log (and the ordered index and membership
+ * filter) and wakes every replication stream. NOTE: the lock must be held by
+ * the caller. */
+void record_mutation(ConnectionInfo* thisConnection, char* id, int portNum);
+
+/* Takes in this connection's information representation, the write end of
+ * the network communication, the epoch and version the follower already
+ * holds (0 for none) and whether the client is a subscriber rather than a
+ * follower. Sends the follower every mutation after said version (or a
+ * snapshot of the registry, if said mutations are no longer logged or were
+ * numbered in another epoch, i.e. before this mapper restarted) and then
+ * each mutation as it is committed, until the follower disconnects. NOTE:
+ * the lock must NOT be held by the caller. Replication stream lines are:
+ *     =epoch:version:count     snapshot of count airports follows, as
+ *                              +version:time:ID:port lines, replacing all
+ *                              airports
+ *     +sequence:time:ID:port   airport registered (or port changed)
+ *     -sequence:time:ID        airport removed
+ *     #epoch:sequence:time     heartbeat, sequence is the primary's version
+ * A subscriber always begins with a snapshot, is sent a fresh one whenever
+ * it falls SUBSCRIBER_BACKLOG mutations behind, and receives:
+ *     =version                 snapshot follows, replacing all airports
+ *     +ID:port                 airport registered (or port changed)
+ *     -ID                      airport removed
+ *     #version                 heartbeat
+ */
+void stream_mutations(ConnectionInfo* thisConnection, FILE** writeEnd,
+	unsigned long epoch, unsigned long version, bool subscriber);
+
+/* Takes in this connection's information representation, the write end of
+ * the network communication and whether the client is a subscriber. Sends a
+ * snapshot of the registry (in the format of said client, as per
+ * stream_mutations()) and returns the version of said snapshot. The lock is
+ * only held to copy the registry, not whilst sending it. NOTE: the lock must
+ * NOT be held by the caller. */
+unsigned long stream_snapshot(ConnectionInfo* thisConnection,
+	FILE** writeEnd, bool subscriber);
+
+/* Takes in a connection information representation (for access to the
+ * shared airports). Follows the primary mapper: connects, requests every
+ * mutation after the epoch and version applied so far (>epoch:version) and
+ * applies each mutation as it arrives, reconnecting whenever the connection
+ * is lost (or the primary turns out to have restarted). Never returns. */
+void* follow_primary(void* connectionInfo);
+
+/* Takes in this connection's information representation, the header of a
+ * snapshot within the replication stream (see stream_mutations()) and the
+ * read end of said stream. Reads the snapshot's airports without the lock,
+ * then applies them (see apply_snapshot()) under a single hold of the lock.
+ * Returns false if the stream ended (or the header was malformed) before
+ * the snapshot was applied, such that the follower must resynchronise, else
+ * true. NOTE: the lock must NOT be held by the caller. */
+bool receive_snapshot(ConnectionInfo* thisConnection, char* header,
+	FILE* readEnd);
+
+/* Takes in this connection's information representation, the header of a
+ * snapshot, its airports (as +sequence:time:ID:port lines, which are
+ * modified in place) and the number of said airports. Replaces the registry
+ * with said airports, removing only those absent from the snapshot and
+ * updating the rest, such that no airport held by the primary is ever
+ * missing from this follower. Returns false if memory ran out before the
+ * registry was changed, else true. NOTE: the lock must be held by the
+ * caller. */
+bool apply_snapshot(ConnectionInfo* thisConnection, char* header,
+	char** entries, int numEntries);
+
+/* Takes in this connection's information representation and a line of the
+ * replication stream (see stream_mutations()), other than a snapshot (see
+ * receive_snapshot()). Applies said line to the registry. Returns false if
+ * said line is from another epoch of the primary than the one applied, such
+ * that the follower must resynchronise, else true. NOTE: the lock must be
+ * held by the caller. */
+bool apply_replicated_line(ConnectionInfo* thisConnection, char* line);
+
+/* Takes in this connection's information representation, an airport ID and
+ * port. Adds said airport, or updates its port if it already exists. NOTE:
+ * the lock must be held by the caller. */
+void set_airport(ConnectionInfo* thisConnection, char* id, int portNum);
+
+/* Takes in the port of the primary and a registration command ('!' or '~').
+ * Passes said command on to the primary, as a follower's registry is only
+ * ever changed by the replication stream. */
+void forward_to_primary(char* primaryPort, char* command);
+
+/* Takes in this connection's information representation and the write end of
+ * the network communication. Displays the replication lag of this mapper
+ * (the primary and applied versions, how many mutations behind, the delay
+ * in applying the latest mutation and the time since the primary was last
+ * heard from), terminated by '.'. NOTE: the lock must be held by the
+ * caller. */
+void display_lag(ConnectionInfo* thisConnection, FILE** writeEnd);
+
+/* Takes in this connection's information representation, a stream to write
+ * to and the command (stats, lockprof or memory). Displays the mapper's
+ * statistics (see display_stats()), lock profile (see
+ * display_lock_profile()) or memory (see display_memory()) followed by a
+ * line containing a single '.'. NOTE: the lock is not required. */
+void display_mapper_stats(ConnectionInfo* thisConnection, FILE** writeEnd,
+	CommandType commandType);
+
+/* Takes in this connection's information representation, and an airport ID.
+ * Returns the index of said airport within the airports, or ERROR_RETURN if
+ * no such airport exists. */
+int find_airport(ConnectionInfo* thisConnection, char* idOfPort);
+
 #endif
@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "errors.h"
+#include "general.h"
+#include "mapper2310.h"
+#include "control2310.h"
+#include "microbench2310.h"
+
+int main(int argc, char** argv) {
+    // Only benchmarks whose name begins with the filter (if any) are run
+    char* filter = (argc > FILTER_ARG) ? argv[FILTER_ARG] : "";
+    int lineSizes[] = {8, 78, 1000, 100000};
+    int airportSizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    int sortSizes[] = {10, 100, 1000, 3000};
+    int growthSizes[] = {100, 1000, 10000};
+    int idSizes[] = {8, 32, 64};
+    MicroBench benches[64];
+    int numBenches = 0;
+
+    for (int size = 0; size < sizeof(lineSizes) / sizeof(int); size++) {
+	benches[numBenches++] = (MicroBench){"get_line", lineSizes[size],
+		LINES_PER_RUN, setup_lines, read_lines, teardown_lines};
+	benches[numBenches++] = (MicroBench){"check_invalid_chars",
+		lineSizes[size], CHECKS_PER_RUN, setup_string,
+		check_strings, teardown_string};
+	benches[numBenches++] = (MicroBench){"character_counter",
+		lineSizes[size], CHECKS_PER_RUN, setup_string,
+		count_characters, teardown_string};
+    }
+    for (int size = 0; size < sizeof(airportSizes) / sizeof(int); size++) {
+	benches[numBenches++] = (MicroBench){"get_port_number",
+		airportSizes[size], LOOKUPS_PER_RUN, setup_airports,
+		lookup_airports, teardown_airports};
+	benches[numBenches++] = (MicroBench){"prefix_listing",
+		airportSizes[size], LOOKUPS_PER_RUN, setup_airport_index,
+		list_prefixes, teardown_airport_index};
+	benches[numBenches++] = (MicroBench){"delta_listing",
+		airportSizes[size], 1, setup_airport_delta, list_delta,
+		teardown_airport_delta};
+    }
+    for (int size = 0; size < sizeof(sortSizes) / sizeof(int); size++) {
+	benches[numBenches++] = (MicroBench){"sort_plane_ids",
+		sortSizes[size], 1, setup_plane_ids, sort_bench_plane_ids,
+		teardown_plane_ids};
+    }
+    for (int size = 0; size < sizeof(growthSizes) / sizeof(int); size++) {
+	benches[numBenches++] = (MicroBench){"add_plane_id",
+		growthSizes[size], growthSizes[size], setup_empty_plane_ids,
+		add_plane_ids, teardown_plane_ids};
+    }
+
+    for (int size = 0; size < sizeof(idSizes) / sizeof(int); size++) {
+	benches[numBenches++] = (MicroBench){"text_encode", idSizes[size],
+		MESSAGES_PER_RUN, setup_encoder, encode_text_registrations,
+		teardown_protocol};
+	benches[numBenches++] = (MicroBench){"binary_encode", idSizes[size],
+		MESSAGES_PER_RUN, setup_encoder, encode_binary_registrations,
+		teardown_protocol};
+	benches[numBenches++] = (MicroBench){"text_decode", idSizes[size],
+		MESSAGES_PER_RUN, setup_text_registrations,
+		decode_text_registrations, teardown_protocol};
+	benches[numBenches++] = (MicroBench){"binary_decode", idSizes[size],
+		MESSAGES_PER_RUN, setup_binary_registrations,
+		decode_binary_registrations, teardown_protocol};
+    }
+
+    for (int bench = 0; bench < numBenches; bench++) {
+	if (!strncmp(benches[bench].name, filter, strlen(filter))) {
+	    measure(benches + bench);
+	}
+    }
+    if (!strncmp("wire_bytes", filter, strlen(filter))) {
+	for (int size = 0; size < sizeof(idSizes) / sizeof(int); size++) {
+	    report_wire_bytes(idSizes[size]);
+	}
+    }
+    return 0;
+}
+
+double now_in_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NANOSECONDS + now.tv_nsec;
+}
+
+void measure(MicroBench* bench) {
+    double times[REPETITIONS];
+    for (int run = 0; run < WARM_UP_RUNS + REPETITIONS; run++) {
+	bench->setup(bench);
+	double start = now_in_nanoseconds();
+	bench->run(bench);
+	double elapsed = now_in_nanoseconds() - start;
+	bench->teardown(bench);
+
+	// Warm-up runs fill the caches (and the allocator) and are discarded
+	if (run >= WARM_UP_RUNS) {
+	    times[run - WARM_UP_RUNS] = elapsed / bench->operationsPerRun;
+	}
+    }
+    summarise(times, REPETITIONS, bench->name, bench->size);
+}
+
+/* qsort() comparison function for times. */
+static int compare_times(const void* first, const void* second) {
+    double difference = *(const double*)first - *(const double*)second;
+    return (difference > 0) - (difference < 0);
+}
+
+void summarise(double* times, int numTimes, char* name, int size) {
+    qsort(times, numTimes, sizeof(double), compare_times);
+    double mean = 0;
+    for (int time = 0; time < numTimes; time++) {
+	mean += times[time] / numTimes;
+    }
+    double variance = 0;
+    for (int time = 0; time < numTimes; time++) {
+	variance += (times[time] - mean) * (times[time] - mean) / numTimes;
+    }
+
+    // Displayed as "key value" lines, as per bench2310
+    printf("%s_%d_min_ns %.1f\n", name, size, times[0]);
+    printf("%s_%d_median_ns %.1f\n", name, size, times[numTimes / 2]);
+    printf("%s_%d_mean_ns %.1f\n", name, size, mean);
+    printf("%s_%d_stddev_ns %.1f\n", name, size, sqrt(variance));
+    printf("%s_%d_max_ns %.1f\n", name, size, times[numTimes - 1]);
+    fflush(stdout);
+}
+
+char* bench_id(int number) {
+    char* id = (char*)malloc(INITIAL_BUFFER_SIZE * sizeof(char));
+    sprintf(id, "airport%08d", number);
+    return id;
+}
+
+void setup_lines(MicroBench* bench) {
+    LineState* state = (LineState*)malloc(sizeof(LineState));
+    size_t inputLength = (size_t)LINES_PER_RUN * (bench->size + 1);
+    state->input = (char*)malloc(inputLength);
+    memset(state->input, 'a', inputLength);
+    for (int line = 1; line <= LINES_PER_RUN; line++) {
+	state->input[(size_t)line * (bench->size + 1) - 1] = '\n';
+    }
+    state->source = fmemopen(state->input, inputLength, "r");
+
+    // The buffer starts at the size each server uses
+    state->lineLength = INITIAL_BUFFER_SIZE;
+    state->line = (char*)malloc(state->lineLength * sizeof(char));
+    bench->state = state;
+}
+
+void read_lines(MicroBench* bench) {
+    LineState* state = (LineState*)bench->state;
+    while (get_line(&state->line, &state->lineLength, state->source)) {
+	;
+    }
+}
+
+void teardown_lines(MicroBench* bench) {
+    LineState* state = (LineState*)bench->state;
+    fclose(state->source);
+    free(state->input);
+    free(state->line);
+    free(state);
+}
+
+void setup_string(MicroBench* bench) {
+    char* string = (char*)malloc(bench->size + 1);
+    for (int character = 0; character < bench->size; character++) {
+	string[character] = 'a' + character % 26;
+    }
+    string[bench->size] = '\0';
+    bench->state = string;
+}
+
+void check_strings(MicroBench* bench) {
+    for (int check = 0; check < CHECKS_PER_RUN; check++) {
+	if (check_invalid_chars((char*)bench->state)) {
+	    fprintf(stderr, "Benchmark string is invalid\n");
+	}
+    }
+}
+
+void count_characters(MicroBench* bench) {
+    for (int check = 0; check < CHECKS_PER_RUN; check++) {
+	if (character_counter((char*)bench->state, ':')) {
+	    fprintf(stderr, "Benchmark string contains ':'\n");
+	}
+    }
+}
+
+void teardown_string(MicroBench* bench) {
+    free(bench->state);
+}
+
+void setup_airports(MicroBench* bench) {
+    AirportState* state = (AirportState*)malloc(sizeof(AirportState));
+    state->numAirports = bench->size;
+    state->airports = (Airport*)malloc(bench->size * sizeof(Airport));
+
+    // Created in reverse order, as a registry is rarely registered sorted
+    for (int airport = 0; airport < bench->size; airport++) {
+	state->airports[airport].id = bench_id(bench->size - airport);
+	state->airports[airport].portNum = PORT_MIN + airport % (PORT_MAX - 1);
+	state->airports[airport].leaseExpiry = PERMANENT_LEASE;
+    }
+    memset(&state->connection, 0, sizeof(ConnectionInfo));
+    state->connection.airports = &state->airports;
+    state->connection.numAirports = &state->numAirports;
+
+    // IDs 1 to size exist, 0 does not
+    state->lookups = (char**)malloc(LOOKUPS_PER_RUN * sizeof(char*));
+    state->lookups[0] = bench_id(0);
+    for (int lookup = 1; lookup < LOOKUPS_PER_RUN; lookup++) {
+	state->lookups[lookup] = bench_id(1 + (long)(bench->size - 1) *
+		(lookup - 1) / (LOOKUPS_PER_RUN - 2));
+    }
+    bench->state = state;
+}
+
+void lookup_airports(MicroBench* bench) {
+    AirportState* state = (AirportState*)bench->state;
+    for (int lookup = 0; lookup < LOOKUPS_PER_RUN; lookup++) {
+	if ((get_port_number(&state->connection, state->lookups[lookup]) ==
+		INVALID_PORT) != (lookup == 0)) {
+	    fprintf(stderr, "Benchmark lookup failed\n");
+	}
+    }
+}
+
+void teardown_airports(MicroBench* bench) {
+    AirportState* state = (AirportState*)bench->state;
+    for (int airport = 0; airport < state->numAirports; airport++) {
+	free(state->airports[airport].id);
+    }
+    for (int lookup = 0; lookup < LOOKUPS_PER_RUN; lookup++) {
+	free(state->lookups[lookup]);
+    }
+    free(state->lookups);
+    free(state->airports);
+    free(state);
+}
+
+void setup_airport_index(MicroBench* bench) {
+    IndexState* state = (IndexState*)malloc(sizeof(IndexState));
+    memset(&state->connection, 0, sizeof(ConnectionInfo));
+    state->connection.airportIndex = init_airport_index();
+    for (int airport = 1; airport <= bench->size; airport++) {
+	char* id = bench_id(airport);
+	update_airport_index(state->connection.airportIndex, id,
+		PORT_MIN + airport % (PORT_MAX - 1));
+	free(id);
+    }
+
+    // Dropping the last digit of an ID gives the prefix of ten IDs
+    state->prefixes = (char**)malloc(LOOKUPS_PER_RUN * sizeof(char*));
+    for (int lookup = 0; lookup < LOOKUPS_PER_RUN; lookup++) {
+	char* id = bench_id((long)(bench->size - 10) * lookup /
+		(LOOKUPS_PER_RUN - 1) + 10);
+	id[strlen(id) - 1] = '\0';
+	state->prefixes[lookup] = (char*)malloc(strlen(id) + 2);
+	sprintf(state->prefixes[lookup], "^%s", id);
+	free(id);
+    }
+    state->sink = fopen("/dev/null", "w");
+    bench->state = state;
+}
+
+void list_prefixes(MicroBench* bench) {
+    IndexState* state = (IndexState*)bench->state;
+    for (int lookup = 0; lookup < LOOKUPS_PER_RUN; lookup++) {
+	display_airport_range(&state->connection, state->prefixes[lookup],
+		&state->sink);
+    }
+}
+
+void teardown_airport_index(MicroBench* bench) {
+    IndexState* state = (IndexState*)bench->state;
+    IndexNode* node = state->connection.airportIndex->head;
+    while (node) {
+	IndexNode* next = node->next[0];
+	tracked_free(node->id); // NULL for the head
+	tracked_free(node);
+	node = next;
+    }
+    tracked_free(state->connection.airportIndex);
+    for (int lookup = 0; lookup < LOOKUPS_PER_RUN; lookup++) {
+	free(state->prefixes[lookup]);
+    }
+    free(state->prefixes);
+    fclose(state->sink);
+    free(state);
+}
+
+void setup_airport_delta(MicroBench* bench) {
+    setup_airport_index(bench);
+    IndexState* state = (IndexState*)bench->state;
+    state->connection.airportFilter = init_airport_filter();
+    state->connection.registrationLog = init_registration_log();
+
+    // The changes are spread evenly across the airports
+    for (int change = 0; change < CHANGES_PER_DELTA; change++) {
+	char* id = bench_id((long)(bench->size - 1) * change /
+		(CHANGES_PER_DELTA - 1) + 1);
+	record_mutation(&state->connection, id, PORT_MIN + change);
+	free(id);
+    }
+}
+
+void list_delta(MicroBench* bench) {
+    IndexState* state = (IndexState*)bench->state;
+    char command[INITIAL_BUFFER_SIZE];
+    sprintf(command, "@%lu:0", state->connection.registrationLog->epoch);
+    display_airport_delta(&state->connection, command, &state->sink);
+}
+
+void teardown_airport_delta(MicroBench* bench) {
+    IndexState* state = (IndexState*)bench->state;
+    RegistrationLog* registrationLog = state->connection.registrationLog;
+    for (int mutation = 0; mutation < REGISTRATION_LOG_SIZE; mutation++) {
+	tracked_free(registrationLog->mutations[mutation].id);
+    }
+    tracked_free(registrationLog->mutations);
+    pthread_mutex_destroy(&registrationLog->logLock);
+    pthread_cond_destroy(&registrationLog->newMutation);
+    tracked_free(registrationLog);
+    tracked_free(state->connection.airportFilter->counters);
+    tracked_free(state->connection.airportFilter);
+    teardown_airport_index(bench);
+}
+
+void setup_plane_ids(MicroBench* bench) {
+    PlaneState* state = (PlaneState*)malloc(sizeof(PlaneState));
+    state->numPlaneIds = bench->size;
+    state->planeIds = (char**)tracked_malloc(CONTROL_MEMORY_PLANE_IDS,
+	    bench->size * sizeof(char*));
+
+    // In reverse order, such that every plane ID is out of place (tracked,
+    // as the control's plane IDs are)
+    for (int planeId = 0; planeId < bench->size; planeId++) {
+	char* id = bench_id(bench->size - planeId);
+	state->planeIds[planeId] = tracked_strdup(CONTROL_MEMORY_PLANE_IDS,
+		id);
+	free(id);
+    }
+    memset(&state->plane, 0, sizeof(ConnectingPlane));
+    state->plane.planeIds = &state->planeIds;
+    state->plane.numPlaneIds = &state->numPlaneIds;
+    bench->state = state;
+}
+
+void setup_empty_plane_ids(MicroBench* bench) {
+    PlaneState* state = (PlaneState*)malloc(sizeof(PlaneState));
+
+    // As per init_connecting_planes()
+    state->numPlaneIds = INITIAL_NUM_PLANE_IDS;
+    state->planeIds = (char**)tracked_malloc(CONTROL_MEMORY_PLANE_IDS,
+	    state->numPlaneIds * sizeof(char*));
+    for (int planeId = 0; planeId < state->numPlaneIds; planeId++) {
+	state->planeIds[planeId] = (char*)tracked_malloc(
+		CONTROL_MEMORY_PLANE_IDS, INITIAL_BUFFER_SIZE * sizeof(char));
+	state->planeIds[planeId][0] = '\0';
+    }
+    memset(&state->plane, 0, sizeof(ConnectingPlane));
+    state->plane.planeIds = &state->planeIds;
+    state->plane.numPlaneIds = &state->numPlaneIds;
+    state->plane.visits = init_visit_counts(); // counted by add_plane_id()
+    bench->state = state;
+}
+
+void sort_bench_plane_ids(MicroBench* bench) {
+    PlaneState* state = (PlaneState*)bench->state;
+    sort_plane_ids(state->planeIds, state->numPlaneIds);
+}
+
+void add_plane_ids(MicroBench* bench) {
+    PlaneState* state = (PlaneState*)bench->state;
+    char planeId[INITIAL_BUFFER_SIZE];
+    for (int plane = 0; plane < bench->size; plane++) {
+	sprintf(planeId, "plane%d", plane);
+	add_plane_id(&state->plane, planeId);
+    }
+}
+
+/* Helper function for teardown_plane_ids(). Takes in (and frees) the visit
+ * counts counted by add_plane_id(), which the control never frees. */
+static void free_visit_counts(VisitCounts* visits) {
+    for (int slot = 0; slot < visits->numSlots; slot++) {
+	if (visits->slots[slot]) {
+	    tracked_free(visits->slots[slot]->planeId);
+	    tracked_free(visits->slots[slot]);
+	}
+    }
+    while (visits->highest) {
+	VisitBucket* lower = visits->highest->lower;
+	tracked_free(visits->highest);
+	visits->highest = lower;
+    }
+    tracked_free(visits->slots);
+    tracked_free(visits);
+}
+
+void teardown_plane_ids(MicroBench* bench) {
+    PlaneState* state = (PlaneState*)bench->state;
+    for (int planeId = 0; planeId < state->numPlaneIds; planeId++) {
+	tracked_free(state->planeIds[planeId]);
+    }
+    tracked_free(state->planeIds);
+    if (state->plane.visits) {
+	free_visit_counts(state->plane.visits);
+    }
+    free(state);
+}
+
+void setup_encoder(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)calloc(1, sizeof(ProtocolState));
+    state->id = (char*)malloc(bench->size + 1);
+    memset(state->id, 'a', bench->size);
+    state->id[bench->size] = '\0';
+
+    // Room for every registration in either format
+    state->bufferSize = (size_t)MESSAGES_PER_RUN * (bench->size +
+	    FRAME_HEADER_SIZE + PORT_STRING_SIZE + 2);
+    state->buffer = (char*)malloc(state->bufferSize);
+    state->stream = fmemopen(state->buffer, state->bufferSize, "w");
+    bench->state = state;
+}
+
+/* Helper function for the decoding benchmarks. Takes in a benchmark and
+ * whether to encode as frames. Encodes the registrations to be decoded and
+ * reopens the buffer for reading. */
+static void setup_registrations(MicroBench* bench, bool binary) {
+    setup_encoder(bench);
+    if (binary) {
+	encode_binary_registrations(bench);
+    } else {
+	encode_text_registrations(bench);
+    }
+    ProtocolState* state = (ProtocolState*)bench->state;
+    long encoded = ftell(state->stream);
+    fclose(state->stream);
+    state->stream = fmemopen(state->buffer, encoded, "r");
+
+    // The line buffer starts at the size each server uses
+    state->lineLength = INITIAL_BUFFER_SIZE;
+    state->line = (char*)malloc(state->lineLength * sizeof(char));
+}
+
+void setup_text_registrations(MicroBench* bench) {
+    setup_registrations(bench, false);
+}
+
+void setup_binary_registrations(MicroBench* bench) {
+    setup_registrations(bench, true);
+}
+
+void encode_text_registrations(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)bench->state;
+    for (int message = 0; message < MESSAGES_PER_RUN; message++) {
+	fprintf(state->stream, "!%s:%d\n", state->id, BENCH_PORT);
+    }
+    fflush(state->stream);
+}
+
+void encode_binary_registrations(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)bench->state;
+    for (int message = 0; message < MESSAGES_PER_RUN; message++) {
+	write_frame(state->stream, FRAME_REGISTER, BENCH_PORT, state->id);
+    }
+    fflush(state->stream);
+}
+
+void decode_text_registrations(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)bench->state;
+    while (get_line(&state->line, &state->lineLength, state->stream)) {
+	if (get_command_type(state->line) != ADD_AIRPORT) {
+	    fprintf(stderr, "Benchmark registration is invalid\n");
+	}
+    }
+}
+
+void decode_binary_registrations(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)bench->state;
+    while (read_frame(state->stream, &state->frame)) {
+	if (get_frame_type(&state->frame) != ADD_AIRPORT) {
+	    fprintf(stderr, "Benchmark registration is invalid\n");
+	}
+    }
+}
+
+void teardown_protocol(MicroBench* bench) {
+    ProtocolState* state = (ProtocolState*)bench->state;
+    fclose(state->stream);
+    free(state->id);
+    free(state->buffer);
+    free(state->line);
+    free(state->frame.payload);
+    free(state);
+}
+
+void report_wire_bytes(int size) {
+    char* id = (char*)malloc(size + 1);
+    memset(id, 'a', size);
+    id[size] = '\0';
+    char* buffer;
+    size_t bufferSize;
+    FILE* stream = open_memstream(&buffer, &bufferSize);
+
+    // Text first (each line as sent), then the equivalent frames
+    long text[4];
+    long binary[4];
+    fprintf(stream, "?%s\n", id);
+    fflush(stream);
+    text[0] = bufferSize;
+    fprintf(stream, "%d\n", BENCH_PORT);
+    fflush(stream);
+    text[1] = bufferSize - text[0];
+    fprintf(stream, "!%s:%d\n", id, BENCH_PORT);
+    fflush(stream);
+    text[2] = bufferSize - text[0] - text[1];
+    fprintf(stream, "%s\nbenchinfo\n", id);
+    fflush(stream);
+    text[3] = bufferSize - text[0] - text[1] - text[2];
+
+    long before = bufferSize;
+    write_frame(stream, FRAME_QUERY, ERROR_RETURN, id);
+    fflush(stream);
+    binary[0] = bufferSize - before;
+    write_frame(stream, FRAME_PORT, BENCH_PORT, NULL);
+    fflush(stream);
+    binary[1] = bufferSize - before - binary[0];
+    write_frame(stream, FRAME_REGISTER, BENCH_PORT, id);
+    fflush(stream);
+    binary[2] = bufferSize - before - binary[0] - binary[1];
+    write_frame(stream, FRAME_ARRIVAL, ERROR_RETURN, id);
+    write_frame(stream, FRAME_INFO, ERROR_RETURN, "benchinfo");
+    fflush(stream);
+    binary[3] = bufferSize - before - binary[0] - binary[1] - binary[2];
+
+    char* messages[] = {"query", "port", "registration", "arrival"};
+    for (int message = 0; message < sizeof(messages) / sizeof(char*);
+	    message++) {
+	printf("wire_bytes_%s_%d_text %ld\n", messages[message], size,
+		text[message]);
+	printf("wire_bytes_%s_%d_binary %ld\n", messages[message], size,
+		binary[message]);
+    }
+    fflush(stdout);
+    fclose(stream);
+    free(buffer);
+    free(id);
+}
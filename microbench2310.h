@@ -0,0 +1,173 @@
+#ifndef MICROBENCH_2310_H
+#define MICROBENCH_2310_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "general.h"
+#include "mapper2310.h"
+#include "control2310.h"
+
+/* Number of untimed runs of each benchmark before it is measured. */
+#define WARM_UP_RUNS 3
+
+/* Number of timed runs of each benchmark summarised. */
+#define REPETITIONS 15
+
+/* Used to index argv for the (optional) benchmark name prefix. */
+#define FILTER_ARG 1
+
+/* Number of nanoseconds in a second. */
+#define NANOSECONDS 1000000000.0
+
+/* Number of lines read by each run of the get_line() benchmark. */
+#define LINES_PER_RUN 1000
+
+/* Number of strings checked by each run of the character benchmarks. */
+#define CHECKS_PER_RUN 1000
+
+/* Number of IDs looked up by each run of the get_port_number() benchmark
+ * (spread evenly across the airports, plus one absent ID). */
+#define LOOKUPS_PER_RUN 16
+
+/* Number of airports changed (since the version given) for each run of the
+ * delta listing benchmark, whatever the size of the registry. */
+#define CHANGES_PER_DELTA 16
+
+/* Number of registrations encoded (or decoded) by each run of the protocol
+ * benchmarks. */
+#define MESSAGES_PER_RUN 1000
+
+/* Port of every registration (and reply) of the protocol benchmarks. */
+#define BENCH_PORT 2310
+
+/* A single microbenchmark at a given size. Each (warm-up or timed) run
+ * calls setup, then run (the only part timed), then teardown. */
+typedef struct MicroBench {
+    char* name;
+    int size;
+    int operationsPerRun; // reported times are per operation
+    void (*setup)(struct MicroBench* bench);
+    void (*run)(struct MicroBench* bench);
+    void (*teardown)(struct MicroBench* bench);
+    void* state; // owned by setup and teardown
+} MicroBench;
+
+/* State of the get_line() benchmark */
+typedef struct {
+    char* input; // LINES_PER_RUN lines, each of size characters
+    FILE* source;
+    char* line;
+    size_t lineLength;
+} LineState;
+
+/* State of the mapper benchmarks */
+typedef struct {
+    Airport* airports;
+    int numAirports;
+    ConnectionInfo connection;
+    char** lookups; // LOOKUPS_PER_RUN IDs
+} AirportState;
+
+/* State of the ordered index (and delta listing) benchmarks */
+typedef struct {
+    ConnectionInfo connection; // its ordered index (and registration log)
+    char** prefixes; // LOOKUPS_PER_RUN prefixes ('^ID'), ten IDs each
+    FILE* sink; // where the listings are displayed
+} IndexState;
+
+/* State of the control benchmarks */
+typedef struct {
+    char** planeIds;
+    int numPlaneIds;
+    ConnectingPlane plane;
+} PlaneState;
+
+/* State of the text and binary protocol benchmarks */
+typedef struct {
+    char* id; // size characters
+    char* buffer; // MESSAGES_PER_RUN registrations (to be) encoded
+    size_t bufferSize;
+    FILE* stream; // over the buffer
+    char* line; // text decoding
+    size_t lineLength;
+    Frame frame; // binary decoding
+} ProtocolState;
+
+/* Returns the current (monotonic) time in nanoseconds. */
+double now_in_nanoseconds(void);
+
+/* Takes in a benchmark. Warms up, times each repetition of said benchmark
+ * and displays the summary of the time per operation. */
+void measure(MicroBench* bench);
+
+/* Takes in the times per operation of each repetition and the number of
+ * repetitions, and the name and size of the benchmark. Sorts said times and
+ * displays their minimum, median, mean, standard deviation and maximum. */
+void summarise(double* times, int numTimes, char* name, int size);
+
+/* Takes in the integer to be used. Returns the airport (or plane) ID used by
+ * the benchmarks for said integer, which must be freed. */
+char* bench_id(int number);
+
+/* get_line() benchmark: reads LINES_PER_RUN lines of size characters. */
+void setup_lines(MicroBench* bench);
+void read_lines(MicroBench* bench);
+void teardown_lines(MicroBench* bench);
+
+/* check_invalid_chars() and character_counter() benchmarks: check a valid
+ * string of size characters CHECKS_PER_RUN times. */
+void setup_string(MicroBench* bench);
+void check_strings(MicroBench* bench);
+void count_characters(MicroBench* bench);
+void teardown_string(MicroBench* bench);
+
+/* get_port_number() benchmark: size airports are created directly (in
+ * reverse order), bypassing add_airport(). */
+void setup_airports(MicroBench* bench);
+void lookup_airports(MicroBench* bench);
+void teardown_airports(MicroBench* bench);
+
+/* display_airport_range() benchmark: the ordered index of size airports is
+ * built via update_airport_index(), then LOOKUPS_PER_RUN prefixes (each of
+ * ten airports) are listed. */
+void setup_airport_index(MicroBench* bench);
+void list_prefixes(MicroBench* bench);
+void teardown_airport_index(MicroBench* bench);
+
+/* display_airport_delta() benchmark: as per the ordered index benchmark,
+ * then CHANGES_PER_DELTA airports change port via record_mutation(), and
+ * the delta since before said changes is listed. */
+void setup_airport_delta(MicroBench* bench);
+void list_delta(MicroBench* bench);
+void teardown_airport_delta(MicroBench* bench);
+
+/* sort_plane_ids() and add_plane_id() benchmarks: size plane IDs are
+ * created directly (in reverse order), or added one by one from empty. */
+void setup_plane_ids(MicroBench* bench);
+void setup_empty_plane_ids(MicroBench* bench);
+void sort_bench_plane_ids(MicroBench* bench);
+void add_plane_ids(MicroBench* bench);
+void teardown_plane_ids(MicroBench* bench);
+
+/* Protocol benchmarks: encode (as the client does) or decode and validate
+ * (as the server does) MESSAGES_PER_RUN registrations of an ID of size
+ * characters, as text (!ID:port) or as frames (see write_frame()). */
+void setup_encoder(MicroBench* bench);
+void setup_text_registrations(MicroBench* bench);
+void setup_binary_registrations(MicroBench* bench);
+void encode_text_registrations(MicroBench* bench);
+void encode_binary_registrations(MicroBench* bench);
+void decode_text_registrations(MicroBench* bench);
+void decode_binary_registrations(MicroBench* bench);
+void teardown_protocol(MicroBench* bench);
+
+/* Takes in the size of the ID. Displays the bytes on the wire of a query,
+ * its reply, a registration and an arrival (with its reply) of said ID, as
+ * text and as frames. */
+void report_wire_bytes(int size);
+
+#endif
@@ -13,6 +13,11 @@
 #include "general.h"
 #include "roc2310.h"
 
+/* Names of the roc's options, as declared (see declare_options()) such that
+ * a plane ID may begin with "--". */
+static const char* optionNames[] = {"trace", "filter-cache", "filter-ttl",
+	"timeout", "retries", "deadline", NULL};
+
 int main(int argc, char** argv) {
     // Squash SIGPIPE to prevent issues arising from sudden termination of
     // client(s)
@@ -22,24 +27,58 @@ int main(int argc, char** argv) {
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, NULL);
 
+    // Spans of the flight are written on exit, as per --trace. Unknown
+    // destinations fail without a mapper query, as per --filter-cache
+    declare_options(optionNames);
+    char* traceOption = get_option(&argc, argv, "trace");
+    char* filterCacheOption = get_option(&argc, argv, "filter-cache");
+    char* filterTtlOption = get_option(&argc, argv, "filter-ttl");
+    FilterCache filterCache = {filterCacheOption, DEFAULT_FILTER_TTL, NULL,
+	    0};
+    if ((traceOption && traceOption[0] == '\0') || (filterCacheOption &&
+	    filterCacheOption[0] == '\0') || (filterTtlOption &&
+	    (!filterCacheOption || !option_to_int(filterTtlOption,
+	    MIN_FILTER_TTL, MAX_FILTER_TTL, &filterCache.ttl)))) {
+	return roc_error_message(ROC_ARGS);
+    }
+
+    // Every connection (to mappers and controls alike) is bounded by
+    // --timeout, retried as per --retries, and abandoned after --deadline
+    char* timeoutOption = get_option(&argc, argv, "timeout");
+    char* retriesOption = get_option(&argc, argv, "retries");
+    char* deadlineOption = get_option(&argc, argv, "deadline");
+    int timeout = 0, retries = 0, deadline = 0;
+    if ((timeoutOption && !option_to_int(timeoutOption, MIN_CONNECT_TIMEOUT,
+	    MAX_CONNECT_TIMEOUT, &timeout)) || (retriesOption &&
+	    !option_to_int(retriesOption, 0, MAX_CONNECT_RETRIES, &retries)) ||
+	    (deadlineOption && !option_to_int(deadlineOption,
+	    MIN_CONNECT_TIMEOUT, MAX_CONNECT_TIMEOUT, &deadline)) ||
+	    unknown_options(&argc, argv)) {
+	return roc_error_message(ROC_ARGS);
+    }
+    enable_connect_policy(timeout, retries, deadline);
+    if (traceOption) {
+	enable_tracing(traceOption);
+    }
+
     if (argc < MIN_NUM_COMMAND_LINE_ARGS) {
 	return roc_error_message(ROC_ARGS);
     }
 
     // ID should not have any invalid chars and roc should not be called log
-    // as this is a command for the control
-    if (check_invalid_chars(argv[ID]) || !strcmp(argv[ID], "log")) {
+    // (or any other command for the control)
+    if (check_invalid_chars(argv[ID]) || is_control_command(argv[ID])) {
 	exit(UNSPECIFIED_ERROR);
     }
 
     // Only validate mapper if destinations are present
+    // (the mapper may be a cluster, given as a list of ports)
     if (argc > MIN_NUM_COMMAND_LINE_ARGS && strcmp(argv[MAPPER_PORT], "-")) {
-	char* mapperPortErrors;
-	int mapperPort = strtol(argv[MAPPER_PORT], &mapperPortErrors, 10);
-	if (strtol_invalid(argv[MAPPER_PORT], mapperPortErrors) ||
-		mapperPort < PORT_MIN || mapperPort > PORT_MAX) {
+	MapperRing* mappers = build_mapper_ring(argv[MAPPER_PORT]);
+	if (!mappers) {
 	    return roc_error_message(ROC_INVALID_MAPPER);
 	}
+	free_mapper_ring(mappers);
     }
 
     // Roc can fly to 0 or more destinations, hence the following
@@ -53,18 +92,31 @@ int main(int argc, char** argv) {
     }
 
     // Pass in the mapper port (or -) as well as the destinations
+    if (filterCacheOption) {
+	load_filter_cache(&filterCache);
+    }
     RocExitCodes portError = get_ports(argv + MAPPER_PORT, numDestinations,
-	    &portNumbers);
+	    &portNumbers, (filterCacheOption) ? &filterCache : NULL);
+    free_filter_cache(&filterCache);
     if (portError == ROC_NORMAL) {
 	portError = connect_to_ports(portNumbers, argv[ID], numDestinations);
     }
     free_port_numbers(portNumbers, numDestinations);
+    if (traceOption && !write_trace()) {
+	fprintf(stderr, "Failed to write trace to %s\n", traceOption);
+    }
     return roc_error_message(portError);
 }
 
 RocExitCodes get_ports(char** destinationsAndMapper,
-	int numDestinations, char*** portNumbers) {
-    for (int destination = 1; destination <= numDestinations; destination++) {
+	int numDestinations, char*** portNumbers, FilterCache* filterCache) {
+    // Each destination is looked up at the mapper owning its ID
+    MapperRing* mappers = (strcmp(destinationsAndMapper[0], "-")) ?
+	    build_mapper_ring(destinationsAndMapper[0]) : NULL;
+    RocExitCodes portsError = ROC_NORMAL;
+
+    for (int destination = 1; destination <= numDestinations &&
+	    portsError == ROC_NORMAL; destination++) {
 	char* destinationErrors;
 	int destinationPort = strtol(destinationsAndMapper[destination],
 		&destinationErrors, 10);
@@ -75,19 +127,28 @@ RocExitCodes get_ports(char** destinationsAndMapper,
 		destinationPort > PORT_MAX) {
 
 	    // Mapper port is stored at first entry, check if mapper was given
-	    if (strcmp(destinationsAndMapper[0], "-")) {
-		// Mapper port is first entry thus pass in destination - 1
-		RocExitCodes mapperError =
-			query_mapper(destinationsAndMapper[destination],
-			destination - 1, destinationsAndMapper[0],
-			portNumbers);
-		if (mapperError != ROC_NORMAL) {
-		    return mapperError;
+	    if (mappers) {
+		char* mapperPort = route_to_mapper(mappers,
+			destinationsAndMapper[destination]);
+		char* destinationId = destinationsAndMapper[destination];
+		MapperFilter* filter = (filterCache &&
+			!check_invalid_chars(destinationId)) ?
+			find_filter(filterCache, mapperPort) : NULL;
+
+		// A destination absent from the filter is certainly not
+		// registered, which the mapper need not be asked to confirm
+		if (filter && !filter_may_contain(filter->bits,
+			filter->numBits, destinationsAndMapper[destination])) {
+		    portsError = ROC_MAP_ENTRY;
+		    continue;
 		}
+		// Mapper port is first entry thus pass in destination - 1
+		portsError = query_mapper(destinationsAndMapper[destination],
+			destination - 1, mapperPort, portNumbers);
 	    } else {
 		// No mapper provided but destinationPort is not a valid port
 		// number
-		return ROC_MAPPER_REQUIRED;
+		portsError = ROC_MAPPER_REQUIRED;
 	    }
 	} else {
 	    // Valid port number was given, add to *portNumbers (-1 to exclude
@@ -97,7 +158,10 @@ RocExitCodes get_ports(char** destinationsAndMapper,
 		    destinationsAndMapper[destination]);
 	}
     }
-    return ROC_NORMAL;
+    if (mappers) {
+	free_mapper_ring(mappers);
+    }
+    return portsError;
 }
 
 RocExitCodes query_mapper(char* destinationToQuery, int destination,
@@ -105,6 +169,7 @@ RocExitCodes query_mapper(char* destinationToQuery, int destination,
     if (check_invalid_chars(destinationToQuery)) {
 	return ROC_DESTINATION; // Invalid destination given in command line
     }
+    long long lookupStarted = trace_begin();
     int thisEndWrite; // stores mapper socket
 
     // Used to differentiate behaviour of functions based on which program(s)
@@ -130,14 +195,18 @@ RocExitCodes query_mapper(char* destinationToQuery, int destination,
 	return ROC_MAPPER_CONNECT;
     }
     // Query mapper for port number
+    long long started = trace_begin();
     fprintf(toWrite, "?%s\n", destinationToQuery);
     fflush(toWrite);
+    trace_end("send", "roc", started);
     size_t portNumberLength = INITIAL_BUFFER_SIZE;
     char* portNumber = (char*)malloc(portNumberLength * sizeof(char));
 
     RocExitCodes queryReturn = ROC_NORMAL;
-    if (get_line(&portNumber, &portNumberLength, toRead),
-	    strlen(portNumber) != 0) {
+    started = trace_begin();
+    get_line(&portNumber, &portNumberLength, toRead);
+    trace_end("wait", "roc", started);
+    if (strlen(portNumber) != 0) {
 	if (!strcmp(portNumber, ";")) {
 	    queryReturn = ROC_MAP_ENTRY;
 	} else {
@@ -145,14 +214,175 @@ RocExitCodes query_mapper(char* destinationToQuery, int destination,
 	    strcat((*portNumbers)[destination], portNumber);
 	}
     } else {
-	queryReturn = ROC_MAP_ENTRY;
+	// No reply within the timeout (or deadline) is not a missing entry
+	queryReturn = (ferror(toRead)) ? ROC_MAPPER_CONNECT : ROC_MAP_ENTRY;
     }
     free(portNumber);
     fclose(toRead);
     fclose(toWrite);
+    trace_end("mapper_lookup", "roc", lookupStarted);
     return queryReturn;
 }
 
+void load_filter_cache(FilterCache* filterCache) {
+    FILE* cacheFile = fopen(filterCache->path, "r");
+    if (!cacheFile) {
+	return; // nothing cached yet
+    }
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    while (get_line(&line, &lineLength, cacheFile)) {
+	// Each line leads with the mapper's port and the time fetched
+	char* fetched = index(line, ':');
+	char* filterLine = (fetched) ? index(fetched + 1, ':') : NULL;
+	if (!filterLine) {
+	    continue;
+	}
+	*fetched++ = '\0';
+	MapperFilter filter;
+	if (!parse_filter(filterLine + 1, &filter)) {
+	    continue;
+	}
+	filter.mapperPort = strdup(line);
+	filter.fetched = strtoll(fetched, NULL, 10);
+	filterCache->filters = (MapperFilter*)realloc(filterCache->filters,
+		(filterCache->numFilters + 1) * sizeof(MapperFilter));
+	filterCache->filters[filterCache->numFilters++] = filter;
+    }
+    free(line);
+    fclose(cacheFile);
+}
+
+void save_filter_cache(FilterCache* filterCache) {
+    // Written aside then renamed over the cache, which is atomic
+    char* tempPath = (char*)malloc(strlen(filterCache->path) +
+	    INITIAL_BUFFER_SIZE);
+    sprintf(tempPath, "%s.%d", filterCache->path, getpid());
+    FILE* cacheFile = fopen(tempPath, "w");
+    if (!cacheFile) {
+	free(tempPath);
+	return; // the cache is only an optimisation
+    }
+    for (int cached = 0; cached < filterCache->numFilters; cached++) {
+	MapperFilter* filter = filterCache->filters + cached;
+	fprintf(cacheFile, "%s:%lld:%u:%d:", filter->mapperPort,
+		(long long)filter->fetched, filter->numBits, FILTER_HASHES);
+	for (uint32_t byte = 0; byte < filter->numBits / 8; byte++) {
+	    fprintf(cacheFile, "%02x", filter->bits[byte]);
+	}
+	fprintf(cacheFile, "\n");
+    }
+    if (fclose(cacheFile) || rename(tempPath, filterCache->path)) {
+	unlink(tempPath);
+    }
+    free(tempPath);
+}
+
+MapperFilter* find_filter(FilterCache* filterCache, char* mapperPort) {
+    time_t now = time(NULL);
+    MapperFilter* filter = NULL;
+    for (int cached = 0; cached < filterCache->numFilters; cached++) {
+	if (!strcmp(filterCache->filters[cached].mapperPort, mapperPort)) {
+	    filter = filterCache->filters + cached;
+	    break;
+	}
+    }
+    if (filter && now - filter->fetched <= filterCache->ttl) {
+	return filter;
+    }
+
+    // Missing (or stale), hence downloaded and cached for the next roc
+    MapperFilter downloaded;
+    if (!download_filter(mapperPort, &downloaded)) {
+	return NULL;
+    }
+    downloaded.mapperPort = strdup(mapperPort);
+    downloaded.fetched = now;
+    if (filter) {
+	free(filter->mapperPort);
+	free(filter->bits);
+    } else {
+	filterCache->filters = (MapperFilter*)realloc(filterCache->filters,
+		(filterCache->numFilters + 1) * sizeof(MapperFilter));
+	filter = filterCache->filters + filterCache->numFilters++;
+    }
+    *filter = downloaded;
+    save_filter_cache(filterCache);
+    return filter;
+}
+
+bool download_filter(char* mapperPort, MapperFilter* filter) {
+    int thisEndWrite;
+    if (setup_client(mapperPort, &thisEndWrite, false) != ROC_NORMAL) {
+	return false;
+    }
+    int thisEndRead = dup(thisEndWrite);
+    FILE* toWrite = fdopen(thisEndWrite, "w");
+    FILE* toRead = (thisEndRead == ERROR_RETURN) ? NULL :
+	    fdopen(thisEndRead, "r");
+    if (!toWrite || !toRead) {
+	if (toWrite) {
+	    fclose(toWrite);
+	}
+	return false;
+    }
+    long long started = trace_begin();
+    fprintf(toWrite, "bloom\n");
+    fflush(toWrite);
+    size_t lineLength = INITIAL_BUFFER_SIZE;
+    char* line = (char*)malloc(lineLength * sizeof(char));
+    get_line(&line, &lineLength, toRead);
+    bool downloaded = parse_filter(line, filter);
+    trace_end("filter_download", "roc", started);
+    free(line);
+    fclose(toRead);
+    fclose(toWrite);
+    return downloaded;
+}
+
+/* Helper function for parse_filter(). Takes in a hex digit. Returns its
+ * value, or ERROR_RETURN if it is not a (lowercase) hex digit. */
+static int hex_value(char digit) {
+    if (digit >= '0' && digit <= '9') {
+	return digit - '0';
+    }
+    return (digit >= 'a' && digit <= 'f') ? digit - 'a' + 10 : ERROR_RETURN;
+}
+
+bool parse_filter(char* line, MapperFilter* filter) {
+    char* numHashes = index(line, ':');
+    char* bits = (numHashes) ? index(numHashes + 1, ':') : NULL;
+    if (!bits) {
+	return false;
+    }
+    unsigned long numBits = strtoul(line, NULL, 10);
+    if (numBits < FILTER_MIN_BITS || numBits > FILTER_MAX_BITS ||
+	    (numBits & (numBits - 1)) || strtol(numHashes + 1, NULL, 10) !=
+	    FILTER_HASHES || strlen(bits + 1) != numBits / 4) {
+	return false;
+    }
+    filter->numBits = numBits;
+    filter->bits = (unsigned char*)malloc(numBits / 8);
+    for (unsigned long byte = 0; byte < numBits / 8; byte++) {
+	int high = hex_value(bits[1 + 2 * byte]);
+	int low = hex_value(bits[2 + 2 * byte]);
+	if (high == ERROR_RETURN || low == ERROR_RETURN) {
+	    free(filter->bits);
+	    return false;
+	}
+	filter->bits[byte] = (high << 4) | low;
+    }
+    return true;
+}
+
+void free_filter_cache(FilterCache* filterCache) {
+    for (int cached = 0; cached < filterCache->numFilters; cached++) {
+	free(filterCache->filters[cached].mapperPort);
+	free(filterCache->filters[cached].bits);
+    }
+    free(filterCache->filters);
+}
+
 RocExitCodes connect_to_ports(char** portNumbers, char* id,
 	int numDestinations) {
     RocExitCodes connectionError = ROC_NORMAL;
@@ -162,6 +392,7 @@ RocExitCodes connect_to_ports(char** portNumbers, char* id,
     bool controlCalled = false;
 
     for (int destination = 0; destination < numDestinations; destination++) {
+	long long arrivalStarted = trace_begin();
 	int thisEndWrite; // stores control socket
 
 	// connect to each control and then print info\n
@@ -170,8 +401,10 @@ RocExitCodes connect_to_ports(char** portNumbers, char* id,
 
 	// setup_client() returns ROC_MAPPER_CONNECT on error, in this case,
 	// we want ROC_DESTINATION to be the return value instead
-	connectionError = (connectionError == ROC_NORMAL) ? ROC_NORMAL :
-		ROC_DESTINATION;
+	if (connectionError != ROC_NORMAL) {
+	    connectionError = ROC_DESTINATION;
+	    continue; // Attempt to connect to the other airports as normal
+	}
 
 	int thisEndRead = dup(thisEndWrite);
 	if (thisEndRead == ERROR_RETURN) { // Ensure dup() succeeded
@@ -184,13 +417,19 @@ RocExitCodes connect_to_ports(char** portNumbers, char* id,
 	    connectionError = ROC_DESTINATION;
 	    continue; // Attempt to connect to the other airports as normal
 	}
+	long long started = trace_begin();
 	fprintf(writeEnd, "%s\n", id);
 	fflush(writeEnd);
+	trace_end("send", "roc", started);
 
 	size_t airportInfoLength = INITIAL_BUFFER_SIZE;
 	char* airportInfo = (char*)malloc(airportInfoLength * sizeof(char));
-	if (get_line(&airportInfo, &airportInfoLength, readEnd),
-		strlen(airportInfo) != 0) {
+	started = trace_begin();
+	get_line(&airportInfo, &airportInfoLength, readEnd);
+	trace_end("wait", "roc", started);
+	if (ferror(readEnd)) {
+	    connectionError = ROC_DESTINATION; // no reply within the timeout
+	} else if (strlen(airportInfo) != 0) {
 	    if (check_invalid_chars(airportInfo)) {
 		connectionError = ROC_DESTINATION;
 	    } else {
@@ -202,6 +441,7 @@ RocExitCodes connect_to_ports(char** portNumbers, char* id,
 	fclose(readEnd);
 	fflush(writeEnd);
 	fclose(writeEnd);
+	trace_end("arrival", "roc", arrivalStarted);
     }
     return connectionError;
 }
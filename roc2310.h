@@ -12,6 +12,7 @@
 #include <semaphore.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
 #include "errors.h"
 #include "general.h"
 
@@ -25,14 +26,53 @@
 /* Used to index argv for the mapper port. */
 #define MAPPER_PORT 2
 
+/* Unless given via --filter-ttl, a cached filter is downloaded afresh once
+ * it is older than this many seconds. */
+#define DEFAULT_FILTER_TTL 60
+
+/* Bounds (in seconds) of the age given via --filter-ttl. */
+#define MIN_FILTER_TTL 1
+#define MAX_FILTER_TTL 86400
+
+/* Bounds (in milliseconds) of the per connection timeout and the flight
+ * deadline given via --timeout and --deadline. */
+#define MIN_CONNECT_TIMEOUT 1
+#define MAX_CONNECT_TIMEOUT 86400000
+
+/* Maximum number of retries of each connection given via --retries. */
+#define MAX_CONNECT_RETRIES 10
+
+/* Membership filter of the airport IDs of a single mapper (see
+ * filter_may_contain()) */
+typedef struct {
+    char* mapperPort;
+    time_t fetched; // when downloaded from said mapper
+    uint32_t numBits;
+    unsigned char* bits;
+} MapperFilter;
+
+/* Filter Cache, as per --filter-cache. Holds the filter of each mapper
+ * consulted, as loaded from (and saved to) the cache file, one line each:
+ *     mapperPort:fetched:numBits:numHashes:bits
+ * (the last three as per the mapper's filter command). */
+typedef struct {
+    char* path;
+    int ttl; // seconds
+    MapperFilter* filters;
+    int numFilters;
+} FilterCache;
+
 /* Takes in the plane's destinations and the mapper port (or -), an empty
- * space to store port numbers, and the number of destinations. Validates and
- * populates portNumbers with the port numbers of the give destinations. If a
- * mapper is provided, and a port number is found invalid, this function
- * queries said mapper and obtains a valid port number. Returns the
- * appropriate exit code. */
+ * space to store port numbers, the number of destinations and the filter
+ * cache (NULL for none). Validates and populates portNumbers with the port
+ * numbers of the give destinations. If a mapper is provided, and a port
+ * number is found invalid, this function queries said mapper and obtains a
+ * valid port number, unless the mapper's filter shows the destination is
+ * not registered. If the mapper is a cluster (a list of ports), the mapper
+ * owning each destination's ID is queried (see route_to_mapper()). Returns
+ * the appropriate exit code. */
 RocExitCodes get_ports(char** destinationsAndMapper, int numDestinations,
-	char*** portNumbers);
+	char*** portNumbers, FilterCache* filterCache);
 
 /* Takes in a destination airport ID, the index of the destination of
  * interest (with respect to the order of destinations specified in the
@@ -43,6 +83,31 @@ RocExitCodes get_ports(char** destinationsAndMapper, int numDestinations,
 RocExitCodes query_mapper(char* destinationToQuery, int thisDestination,
 	char* mapperPort, char*** portNumbers);
 
+/* Takes in a filter cache. Loads every filter in its file (if any), however
+ * old, as the age of each is checked when it is used. */
+void load_filter_cache(FilterCache* filterCache);
+
+/* Takes in a filter cache. Writes its filters to its file, replacing said
+ * file at once, such that concurrent rocs never read a partial cache. */
+void save_filter_cache(FilterCache* filterCache);
+
+/* Takes in a filter cache and the port of a mapper. Returns said mapper's
+ * filter, as cached if younger than the cache's TTL, else as downloaded
+ * (and saved to the cache), or NULL if said mapper could not provide it. */
+MapperFilter* find_filter(FilterCache* filterCache, char* mapperPort);
+
+/* Takes in the port of a mapper and an empty filter. Downloads said mapper's
+ * filter into said filter. Returns if the download succeeded. */
+bool download_filter(char* mapperPort, MapperFilter* filter);
+
+/* Takes in a filter line (numBits:numHashes:bits) and an empty filter.
+ * Validates and decodes said line into said filter. Returns if the line is
+ * valid, i.e. for a power of two bits within bounds and FILTER_HASHES. */
+bool parse_filter(char* line, MapperFilter* filter);
+
+/* Takes in (and frees) the filters of a filter cache. */
+void free_filter_cache(FilterCache* filterCache);
+
 /* Takes in the (validated) port numbers, the plane id, and the number of
  * destinations. Connects to each destination and populates the log with
  * airport information. Returns the appropriate exit code. */